@@ -0,0 +1,126 @@
+#include "synthetic.hpp"
+
+#include <trueprompter/recognition/kaldi/kaldi.hpp>
+#include <trueprompter/recognition/matcher.hpp>
+
+#include <benchmark/benchmark.h>
+
+
+namespace {
+
+using NTruePrompter::NRecognition::TPhoneme;
+using NTruePrompter::NRecognition::TPhonemesMatcher;
+using NTruePrompter::NRecognition::TSpeechPhonemesBuffer;
+
+constexpr size_t ScriptSize = 200000;
+constexpr size_t UtteranceSize = 30;
+
+/**
+ * Feeds speech read from the script one recognized phoneme per Match call,
+ * committing utterances of UtteranceSize phonemes, like the recognizer partial results do.
+ */
+void RunReading(benchmark::State& state, const TPhonemesMatcher::TMatchParameters& params) {
+    const auto script = NTruePrompter::NBench::GeneratePhonemes(ScriptSize);
+    const auto speech = NTruePrompter::NBench::GenerateSpeech(script, 0, ScriptSize);
+
+    TPhonemesMatcher matcher(script);
+    TSpeechPhonemesBuffer buffer;
+    size_t pos = 0;
+    size_t utteranceBegin = 0;
+    for (auto _ : state) {
+        if (pos == speech.size()) {
+            state.PauseTiming();
+            matcher.SetCurrentPos(0);
+            buffer.Reset();
+            pos = 0;
+            utteranceBegin = 0;
+            state.ResumeTiming();
+        }
+        ++pos;
+        buffer.Update(std::span<const TPhoneme>(speech.data() + utteranceBegin, pos - utteranceBegin));
+        matcher.Match(buffer, params);
+        if (pos - utteranceBegin == UtteranceSize) {
+            buffer.Commit();
+            utteranceBegin = pos;
+        }
+    }
+    state.counters["text_pos"] = (double)matcher.GetCurrentPos();
+}
+
+void BM_MatchReading(benchmark::State& state) {
+    TPhonemesMatcher::TMatchParameters params;
+    if (state.range(0) > 0) {
+        params.LookAhead = state.range(0);
+    }
+    RunReading(state, params);
+}
+
+void BM_MatchReadingAdaptive(benchmark::State& state) {
+    TPhonemesMatcher::TMatchParameters params;
+    params.InitialLookAhead = state.range(0);
+    RunReading(state, params);
+}
+
+// Speaker jumps far ahead of the window on every iteration, so every update is a lost one
+void BM_MatchJump(benchmark::State& state) {
+    const auto script = NTruePrompter::NBench::GeneratePhonemes(ScriptSize);
+    TPhonemesMatcher::TMatchParameters params;
+    params.LookAhead = state.range(0);
+    params.RelocationMinMatchWeight = 10.0;
+
+    TPhonemesMatcher matcher(script);
+    TSpeechPhonemesBuffer buffer;
+    size_t jump = 0;
+    for (auto _ : state) {
+        state.PauseTiming();
+        jump = (jump + 7919 * 13) % (ScriptSize - 1000);
+        const auto speech = NTruePrompter::NBench::GenerateSpeech(script, jump, UtteranceSize, 0.1, jump);
+        matcher.SetCurrentPos(0);
+        buffer.Reset();
+        buffer.Update(speech);
+        state.ResumeTiming();
+
+        matcher.Match(buffer, params);
+    }
+}
+
+void BM_SpeechBufferCycle(benchmark::State& state) {
+    const auto speech = NTruePrompter::NBench::GeneratePhonemes(UtteranceSize * 16);
+    TSpeechPhonemesBuffer buffer(state.range(0));
+    size_t pos = 0;
+    size_t utteranceBegin = 0;
+    for (auto _ : state) {
+        if (pos == speech.size()) {
+            pos = 0;
+            utteranceBegin = 0;
+        }
+        ++pos;
+        buffer.Update(std::span<const TPhoneme>(speech.data() + utteranceBegin, pos - utteranceBegin));
+        benchmark::DoNotOptimize(buffer.GetUnmatched());
+        if (pos - utteranceBegin == UtteranceSize) {
+            buffer.Commit();
+            buffer.Match(UtteranceSize / 2);
+            utteranceBegin = pos;
+        }
+    }
+}
+
+void BM_WordsMatcherSetCurrentPos(benchmark::State& state) {
+    const std::string text = NTruePrompter::NBench::GenerateText(state.range(0));
+    auto tokenizer = NTruePrompter::NRecognition::NewKaldiTokenizer(std::make_shared<NTruePrompter::NBench::TSyntheticPhoneticizer>());
+    NTruePrompter::NRecognition::TWordsMatcher matcher(text, std::make_shared<NTruePrompter::NBench::TSilentRecognizer>(), tokenizer);
+
+    std::mt19937 rng(4);
+    for (auto _ : state) {
+        matcher.SetCurrentPos(rng() % text.size());
+        benchmark::DoNotOptimize(matcher.GetCurrentPos());
+    }
+}
+
+} // namespace
+
+BENCHMARK(BM_MatchReading)->ArgName("look_ahead")->Arg(0)->Arg(100)->Arg(1000)->Arg(10000);
+BENCHMARK(BM_MatchReadingAdaptive)->ArgName("initial_look_ahead")->Arg(64)->Arg(256);
+BENCHMARK(BM_MatchJump)->ArgName("look_ahead")->Arg(100)->Arg(1000);
+BENCHMARK(BM_SpeechBufferCycle)->ArgName("capacity")->Arg(64)->Arg(1024);
+BENCHMARK(BM_WordsMatcherSetCurrentPos)->ArgName("words")->Arg(1000)->Arg(200000);
@@ -0,0 +1,118 @@
+#include "synthetic.hpp"
+
+#include <trueprompter/recognition/smith_waterman.hpp>
+
+#include <benchmark/benchmark.h>
+
+#include <optional>
+#include <stdexcept>
+
+
+namespace {
+
+using NTruePrompter::NRecognition::TPhoneme;
+using NTruePrompter::NRecognition::TProfiledSmithWaterman;
+
+void SetCellsCounter(benchmark::State& state, size_t rows, size_t cols) {
+    state.counters["cells"] = benchmark::Counter((double)rows * (double)cols, benchmark::Counter::kIsIterationInvariantRate);
+}
+
+std::optional<TProfiledSmithWaterman> MakeAligner(benchmark::State& state, TProfiledSmithWaterman::EKernel kernel) {
+    try {
+        return TProfiledSmithWaterman(kernel);
+    } catch (const std::runtime_error& e) {
+        state.SkipWithError(e.what());
+        return std::nullopt;
+    }
+}
+
+// Whole matrix per iteration: sources differ in the first phoneme, so no rows are reused
+void BM_ProfiledSmithWaterman(benchmark::State& state, TProfiledSmithWaterman::EKernel kernel) {
+    const size_t rows = state.range(0);
+    const size_t cols = state.range(1);
+    const auto target = NTruePrompter::NBench::GeneratePhonemes(cols);
+    auto source = NTruePrompter::NBench::GenerateSpeech(target, cols / 2, rows);
+    auto otherSource = source;
+    otherSource[0] = (otherSource[0] + 1) % NTruePrompter::NBench::PhonemesCount;
+
+    auto aligner = MakeAligner(state, kernel);
+    if (!aligner) {
+        return;
+    }
+    aligner->SetTarget(target, {}, [](size_t) {
+        return 1.0;
+    });
+
+    bool other = false;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(aligner->Align(other ? otherSource : source));
+        other = !other;
+    }
+    SetCellsCounter(state, source.size(), cols);
+}
+
+// Speech grows by one phoneme per iteration, only the new row is computed
+void BM_ProfiledSmithWatermanAppend(benchmark::State& state, TProfiledSmithWaterman::EKernel kernel) {
+    const size_t rows = state.range(0);
+    const size_t cols = state.range(1);
+    const auto target = NTruePrompter::NBench::GeneratePhonemes(cols);
+    const auto speech = NTruePrompter::NBench::GenerateSpeech(target, cols / 2, rows);
+
+    auto aligner = MakeAligner(state, kernel);
+    if (!aligner) {
+        return;
+    }
+    aligner->SetTarget(target, {}, [](size_t) {
+        return 1.0;
+    });
+
+    size_t size = 0;
+    for (auto _ : state) {
+        size = size % speech.size() + 1;
+        benchmark::DoNotOptimize(aligner->Align(std::span<const TPhoneme>(speech.data(), size)));
+    }
+    SetCellsCounter(state, 1, cols);
+}
+
+// Generic template engine with inlined scorers, baseline for the profiled one
+void BM_SmithWaterman(benchmark::State& state) {
+    const size_t rows = state.range(0);
+    const size_t cols = state.range(1);
+    const auto target = NTruePrompter::NBench::GeneratePhonemes(cols);
+    const auto source = NTruePrompter::NBench::GenerateSpeech(target, cols / 2, rows);
+
+    NTruePrompter::NRecognition::TSmithWaterman<double> smithWaterman;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(smithWaterman.Align(
+            std::span<const TPhoneme>(source),
+            std::span<const TPhoneme>(target),
+            [](const TPhoneme*, const TPhoneme*) {
+                return -1.0;
+            },
+            [](const TPhoneme*, const TPhoneme*) {
+                return -1.0;
+            },
+            [](const TPhoneme* a, const TPhoneme* b) {
+                return *a == *b ? 1.0 : -1.0;
+            }
+        ));
+    }
+    SetCellsCounter(state, source.size(), cols);
+}
+
+void SizeArgs(benchmark::internal::Benchmark* benchmark) {
+    benchmark->ArgNames({ "speech", "text" });
+    for (int64_t rows : { 16, 64, 256 }) {
+        for (int64_t cols : { 256, 4096, 65536 }) {
+            benchmark->Args({ rows, cols });
+        }
+    }
+}
+
+} // namespace
+
+BENCHMARK_CAPTURE(BM_ProfiledSmithWaterman, scalar, TProfiledSmithWaterman::EKernel::Scalar)->Apply(SizeArgs);
+BENCHMARK_CAPTURE(BM_ProfiledSmithWaterman, sse41, TProfiledSmithWaterman::EKernel::Sse41)->Apply(SizeArgs);
+BENCHMARK_CAPTURE(BM_ProfiledSmithWaterman, avx2, TProfiledSmithWaterman::EKernel::Avx2)->Apply(SizeArgs);
+BENCHMARK_CAPTURE(BM_ProfiledSmithWatermanAppend, auto, TProfiledSmithWaterman::EKernel::Auto)->Apply(SizeArgs);
+BENCHMARK(BM_SmithWaterman)->Apply(SizeArgs);
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <trueprompter/recognition/recognizer.hpp>
+#include <trueprompter/recognition/tokenizer.hpp>
+
+#include <random>
+#include <string>
+#include <vector>
+
+
+/**
+ * Model-free inputs for benchmarks. Everything is seeded, so numbers are comparable between runs.
+ */
+namespace NTruePrompter::NBench {
+
+// Roughly the size of a real g2p phoneme set
+constexpr NRecognition::TPhoneme PhonemesCount = 50;
+
+inline std::vector<NRecognition::TPhoneme> GeneratePhonemes(size_t size, uint32_t seed = 1) {
+    std::mt19937 rng(seed);
+    std::vector<NRecognition::TPhoneme> phonemes(size);
+    for (auto& phoneme : phonemes) {
+        phoneme = rng() % PhonemesCount;
+    }
+    return phonemes;
+}
+
+/**
+ * Speech read from phonemes[from, from + size) with recognition errors:
+ * every errorRate-th phoneme on average is replaced, dropped or followed by an extra one.
+ */
+inline std::vector<NRecognition::TPhoneme> GenerateSpeech(std::span<const NRecognition::TPhoneme> phonemes, size_t from, size_t size, double errorRate = 0.1, uint32_t seed = 2) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> chance;
+    std::vector<NRecognition::TPhoneme> speech;
+    for (size_t i = from; i < phonemes.size() && speech.size() < size; ++i) {
+        if (chance(rng) >= errorRate) {
+            speech.push_back(phonemes[i]);
+            continue;
+        }
+        switch (rng() % 3) {
+            case 0:
+                speech.push_back(rng() % PhonemesCount);
+                break;
+            case 1:
+                break;
+            default:
+                speech.push_back(phonemes[i]);
+                speech.push_back(rng() % PhonemesCount);
+                break;
+        }
+    }
+    return speech;
+}
+
+inline std::string GenerateText(size_t words, uint32_t seed = 3) {
+    std::mt19937 rng(seed);
+    std::string text;
+    for (size_t i = 0; i < words; ++i) {
+        const size_t length = 1 + rng() % 10;
+        for (size_t j = 0; j < length; ++j) {
+            text += (char)('a' + rng() % 26);
+        }
+        text += i % 12 == 11 ? ".\n" : " ";
+    }
+    return text;
+}
+
+/**
+ * Deterministic g2p stand-in: one phoneme per letter, derived from the letter and its neighbour.
+ */
+class TSyntheticPhoneticizer : public NRecognition::IPhoneticizer {
+public:
+    std::vector<NRecognition::TPhoneme> Phoneticize(const std::string& word) const override {
+        std::vector<NRecognition::TPhoneme> phonemes;
+        phonemes.reserve(word.size());
+        for (size_t i = 0; i < word.size(); ++i) {
+            const unsigned next = i + 1 < word.size() ? (unsigned char)word[i + 1] : 0;
+            phonemes.push_back(((unsigned char)word[i] * 31 + next) % PhonemesCount);
+        }
+        return phonemes;
+    }
+
+    std::string GetVersion() const override {
+        return "synthetic-1";
+    }
+};
+
+/**
+ * Recognizer stand-in that never hears anything, for benchmarks not driven by audio.
+ */
+class TSilentRecognizer : public NRecognition::IRecognizer {
+public:
+    bool Update(const float*, size_t, int32_t, std::vector<NRecognition::TPhoneme>* tokensOut) override {
+        tokensOut->clear();
+        return false;
+    }
+
+    void Reset() override {
+    }
+};
+
+} // namespace NTruePrompter::NBench
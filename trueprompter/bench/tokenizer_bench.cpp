@@ -0,0 +1,26 @@
+#include "synthetic.hpp"
+
+#include <trueprompter/recognition/kaldi/kaldi.hpp>
+
+#include <benchmark/benchmark.h>
+
+
+namespace {
+
+void BM_TokenizerApply(benchmark::State& state) {
+    const std::string text = NTruePrompter::NBench::GenerateText(state.range(0));
+    auto tokenizer = NTruePrompter::NRecognition::NewKaldiTokenizer(std::make_shared<NTruePrompter::NBench::TSyntheticPhoneticizer>(), state.range(1));
+
+    std::vector<NTruePrompter::NRecognition::TPhoneme> phonemes;
+    NTruePrompter::NRecognition::TPhonemeOffsets offsets;
+    for (auto _ : state) {
+        tokenizer->Apply(text, &phonemes, &offsets);
+        benchmark::DoNotOptimize(phonemes.data());
+    }
+    state.SetBytesProcessed((int64_t)state.iterations() * (int64_t)text.size());
+}
+
+} // namespace
+
+// A page and a book, sequential and on a pool
+BENCHMARK(BM_TokenizerApply)->ArgNames({ "words", "threads" })->ArgsProduct({ { 300, 200000 }, { 1, 4 } })->Unit(benchmark::kMillisecond)->UseRealTime();
@@ -17,8 +17,14 @@
 
 
 int main(int argc, char* argv[]) {
-    if (argc < 3 || argc > 4) {
-        std::cerr << "Usage: " << argv[0] << " <uri> <language> [text_file]" << std::endl;
+    if (argc < 3 || argc > 5) {
+        std::cerr << "Usage: " << argv[0] << " <uri> <language> [text_file [BALANCED|LIVE|REHEARSAL]]" << std::endl;
+        return -1;
+    }
+
+    auto latencyProfile = NTruePrompter::NCommon::NProto::BALANCED;
+    if (argc == 5 && !NTruePrompter::NCommon::NProto::ELatencyProfile_Parse(argv[4], &latencyProfile)) {
+        std::cerr << "Unknown latency profile " << argv[4] << std::endl;
         return -1;
     }
 
@@ -73,6 +79,7 @@ int main(int argc, char* argv[]) {
 
                 NTruePrompter::NCommon::NProto::TRequest initialMessage;
                 initialMessage.mutable_handshake()->set_client_name("trueprompter_client");
+                initialMessage.mutable_handshake()->set_latency_profile(latencyProfile);
                 initialMessage.mutable_text_data()->set_text(text);
                 initialMessage.mutable_text_data()->set_language(language);
                 *initialMessage.mutable_audio_data()->mutable_meta() = encoder->GetMeta();
@@ -80,7 +87,14 @@ int main(int argc, char* argv[]) {
                 client.send(hdl, initialMessage.SerializeAsString(), websocketpp::frame::opcode::value::binary);
             }
 
-            std::vector<float> audioBuffer(8192);
+            // Audio waits in the buffer until it is full, so its length adds to the latency
+            double bufferSeconds = 0.2;
+            if (latencyProfile == NTruePrompter::NCommon::NProto::LIVE) {
+                bufferSeconds = 0.05;
+            } else if (latencyProfile == NTruePrompter::NCommon::NProto::REHEARSAL) {
+                bufferSeconds = 0.5;
+            }
+            std::vector<float> audioBuffer(encoder->GetSampleRate() * bufferSeconds);
 
             while (!hdl.expired()) {
                 std::scoped_lock guard(lock);
@@ -1,7 +1,10 @@
 #include "audio_codec.hpp"
 #include "av_audio_codec.hpp"
 
+#include <algorithm>
+#include <cmath>
 #include <tuple>
+#include <vector>
 
 
 namespace {
@@ -62,6 +65,80 @@ private:
     int32_t SampleRate_;
 };
 
+class TPCMS16Encoder : public NTruePrompter::NCodec::IAudioEncoder {
+public:
+    TPCMS16Encoder(int32_t sampleRate)
+        : SampleRate_(sampleRate)
+    {}
+
+    void Encode(const float* data, size_t size) override {
+        Samples_.resize(size);
+        for (size_t i = 0; i < size; ++i) {
+            Samples_[i] = (int16_t)std::lrint(std::clamp(data[i], -1.0f, 1.0f) * 32767.0f);
+        }
+        Callback(reinterpret_cast<const uint8_t*>(Samples_.data()), size * sizeof(int16_t));
+    }
+
+    void Finalize() override {}
+
+    int32_t GetSampleRate() const {
+        return SampleRate_;
+    }
+
+    NTruePrompter::NCodec::NProto::TAudioMeta GetMeta() const override {
+        NTruePrompter::NCodec::NProto::TAudioMeta meta;
+        meta.set_sample_rate(GetSampleRate());
+        meta.set_format(NTruePrompter::NCodec::NProto::EFormat::RAW);
+        meta.set_codec(NTruePrompter::NCodec::NProto::ECodec::PCM_S16LE);
+        return meta;
+    }
+
+private:
+    int32_t SampleRate_;
+    std::vector<int16_t> Samples_;
+};
+
+class TPCMS16Decoder : public NTruePrompter::NCodec::IAudioDecoder {
+public:
+    TPCMS16Decoder(int32_t sampleRate)
+        : SampleRate_(sampleRate)
+    {}
+
+    void Decode(const uint8_t* data, size_t size) override {
+        const int16_t* samples = reinterpret_cast<const int16_t*>(data);
+        size /= sizeof(int16_t);
+        if (HasS16Callback()) {
+            S16Callback(samples, size);
+            return;
+        }
+
+        // Reused, so decoding does not allocate once the buffer is large enough
+        Samples_.resize(size);
+        for (size_t i = 0; i < size; ++i) {
+            Samples_[i] = samples[i] / 32767.0f;
+        }
+        Callback(Samples_.data(), size);
+    }
+
+    void Finalize() override {}
+
+    int32_t GetSampleRate() const {
+        return SampleRate_;
+    }
+
+    NTruePrompter::NCodec::NProto::TAudioMeta GetMeta() const override {
+        NTruePrompter::NCodec::NProto::TAudioMeta meta;
+        meta.set_sample_rate(GetSampleRate());
+        meta.set_format(NTruePrompter::NCodec::NProto::EFormat::RAW);
+        meta.set_codec(NTruePrompter::NCodec::NProto::ECodec::PCM_S16LE);
+        return meta;
+    }
+
+private:
+    int32_t SampleRate_;
+    std::vector<float> Samples_;
+};
+
 } // namespace
 
 namespace NTruePrompter::NCodec {
@@ -75,6 +152,8 @@ std::shared_ptr<IAudioEncoder> CreateEncoder(const NProto::TAudioMeta& meta) {
         switch (meta.codec()) {
             case NProto::ECodec::PCM_F32LE:
                 return std::make_shared<TPCMEncoder>(meta.sample_rate());
+            case NProto::ECodec::PCM_S16LE:
+                return std::make_shared<TPCMS16Encoder>(meta.sample_rate());
         }
     }
     try {
@@ -89,6 +168,8 @@ std::shared_ptr<IAudioDecoder> CreateDecoder(const NProto::TAudioMeta& meta) {
         switch (meta.codec()) {
             case NProto::ECodec::PCM_F32LE:
                 return std::make_shared<TPCMDecoder>(meta.sample_rate());
+            case NProto::ECodec::PCM_S16LE:
+                return std::make_shared<TPCMS16Decoder>(meta.sample_rate());
         }
     }
     try {
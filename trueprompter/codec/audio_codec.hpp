@@ -5,6 +5,7 @@
 #include <stdexcept>
 #include <functional>
 #include <cstddef>
+#include <cstdint>
 
 
 namespace NTruePrompter::NCodec {
@@ -63,6 +64,11 @@ public:
         Callback_ = callback;
     }
 
+    // Decoders of 16-bit audio pass samples here as is if it is set, the float callback gets them converted otherwise
+    void SetS16Callback(const std::function<void(const int16_t*, size_t)>& callback) {
+        S16Callback_ = callback;
+    }
+
 protected:
     void Callback(const float* data, size_t size) {
         if (!Callback_) {
@@ -71,8 +77,17 @@ protected:
         Callback_(data, size);
     }
 
+    bool HasS16Callback() const {
+        return (bool)S16Callback_;
+    }
+
+    void S16Callback(const int16_t* data, size_t size) {
+        S16Callback_(data, size);
+    }
+
 private:
     std::function<void(const float* data, size_t size)> Callback_;
+    std::function<void(const int16_t* data, size_t size)> S16Callback_;
 };
 
 bool IsMetaEquivalent(const NProto::TAudioMeta& l, const NProto::TAudioMeta& r);
@@ -0,0 +1,51 @@
+#include <trueprompter/recognition/kaldi/kaldi.hpp>
+#include <trueprompter/recognition/script_cache.hpp>
+#include <trueprompter/recognition/tokenizer.hpp>
+
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+
+int main(int argc, char* argv[]) {
+    if (argc != 5) {
+        std::cerr << "Usage: " << argv[0] << " <models_folder> <language> <scripts_folder> <script_cache_dir>" << std::endl;
+        return -1;
+    }
+
+    const std::filesystem::path modelsFolder = argv[1];
+    const std::string language = argv[2];
+    const std::filesystem::path scriptsFolder = argv[3];
+
+    // Same model and tokenizer as the server uses, otherwise tokenizer ids differ and scripts are never found
+    auto tokenizerFactory = NTruePrompter::NRecognition::NewKaldiTokenizerFactory({
+        { language, NTruePrompter::NRecognition::LoadKaldiModel(modelsFolder / language) },
+    });
+    auto tokenizer = tokenizerFactory->New(language);
+    const std::string tokenizerId = tokenizer->GetId();
+    NTruePrompter::NRecognition::TScriptCache cache(std::filesystem::path(argv[4]));
+
+    size_t compiled = 0;
+    size_t upToDate = 0;
+    for (const auto& entry : std::filesystem::recursive_directory_iterator(scriptsFolder)) {
+        if (!entry.is_regular_file()) {
+            continue;
+        }
+
+        std::stringstream buffer;
+        buffer << std::ifstream(entry.path(), std::ios::binary).rdbuf();
+        const std::string text = buffer.str();
+
+        if (cache.Find(language, text, tokenizerId)) {
+            ++upToDate;
+            continue;
+        }
+        auto script = NTruePrompter::NRecognition::TTokenizedScript::FromText(text, *tokenizer);
+        cache.Store(language, *script);
+        ++compiled;
+        std::cout << entry.path().string() << " -> " << cache.GetPath(language, script->GetTextHash()).string() << " (" << script->GetPhonemes().size() << " phonemes)" << std::endl;
+    }
+
+    std::cout << "Compiled " << compiled << " scripts, " << upToDate << " up to date" << std::endl;
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include "phoneme.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+
+namespace NTruePrompter::NRecognition {
+
+/**
+ * Bounded word to phonemes cache, safe to share between threads.
+ * Words are spread over independently locked shards, each evicting with the clock (second chance) policy,
+ * so frequent words survive streams of rare ones.
+ */
+class TG2PCache {
+public:
+    struct TStats {
+        uint64_t Hits = 0;
+        uint64_t Misses = 0;
+        size_t Size = 0;
+    };
+
+    explicit TG2PCache(size_t capacity, size_t shardsCount = 16)
+        : Shards_(capacity ? std::max<size_t>(std::min(shardsCount, capacity), 1) : 0)
+    {
+        for (size_t i = 0; i < Shards_.size(); ++i) {
+            // Spread capacity so that shard capacities sum up to the total one
+            Shards_[i].Capacity = capacity / Shards_.size() + (i < capacity % Shards_.size() ? 1 : 0);
+            Shards_[i].Slots.reserve(Shards_[i].Capacity);
+        }
+    }
+
+    TG2PCache(const TG2PCache&) = delete;
+    TG2PCache& operator=(const TG2PCache&) = delete;
+
+    std::optional<std::vector<TPhoneme>> Find(const std::string& word) const {
+        if (Shards_.empty()) {
+            Misses_.fetch_add(1, std::memory_order_relaxed);
+            return std::nullopt;
+        }
+
+        TShard& shard = GetShard(word);
+        std::lock_guard<std::mutex> guard(shard.Mutex);
+        auto it = shard.Index.find(word);
+        if (it == shard.Index.end()) {
+            Misses_.fetch_add(1, std::memory_order_relaxed);
+            return std::nullopt;
+        }
+        Hits_.fetch_add(1, std::memory_order_relaxed);
+        TSlot& slot = shard.Slots[it->second];
+        slot.Referenced = true;
+        return slot.Phonemes;
+    }
+
+    void Insert(const std::string& word, const std::vector<TPhoneme>& phonemes) {
+        if (Shards_.empty()) {
+            return;
+        }
+
+        TShard& shard = GetShard(word);
+        std::lock_guard<std::mutex> guard(shard.Mutex);
+        if (shard.Index.count(word)) {
+            return;
+        }
+
+        size_t slotIndex = shard.Slots.size();
+        if (slotIndex < shard.Capacity) {
+            shard.Slots.emplace_back();
+        } else {
+            // Clock sweep: skip and clear recently used slots, evict the first one not used since last sweep
+            while (shard.Slots[shard.Hand].Referenced) {
+                shard.Slots[shard.Hand].Referenced = false;
+                shard.Hand = (shard.Hand + 1) % shard.Slots.size();
+            }
+            slotIndex = shard.Hand;
+            shard.Hand = (shard.Hand + 1) % shard.Slots.size();
+            shard.Index.erase(shard.Slots[slotIndex].Word);
+        }
+
+        // Slots never reallocate, so index keys can point into them
+        TSlot& slot = shard.Slots[slotIndex];
+        slot.Word = word;
+        slot.Phonemes = phonemes;
+        slot.Referenced = false;
+        shard.Index.emplace(slot.Word, slotIndex);
+    }
+
+    /**
+     * Returns cached phonemes or computes, caches and returns them.
+     */
+    template<typename TCompute>
+    std::vector<TPhoneme> GetOrCompute(const std::string& word, TCompute&& compute) {
+        if (auto phonemes = Find(word)) {
+            return std::move(*phonemes);
+        }
+        std::vector<TPhoneme> phonemes = compute(word);
+        Insert(word, phonemes);
+        return phonemes;
+    }
+
+    TStats GetStats() const {
+        TStats stats;
+        stats.Hits = Hits_.load(std::memory_order_relaxed);
+        stats.Misses = Misses_.load(std::memory_order_relaxed);
+        for (const TShard& shard : Shards_) {
+            std::lock_guard<std::mutex> guard(shard.Mutex);
+            stats.Size += shard.Index.size();
+        }
+        return stats;
+    }
+
+private:
+    struct TSlot {
+        std::string Word;
+        std::vector<TPhoneme> Phonemes;
+        bool Referenced = false;
+    };
+
+    struct TShard {
+        mutable std::mutex Mutex;
+        size_t Capacity = 0;
+        std::vector<TSlot> Slots;
+        std::unordered_map<std::string_view, size_t> Index;
+        size_t Hand = 0;
+    };
+
+    TShard& GetShard(const std::string& word) const {
+        return Shards_[std::hash<std::string_view>()(word) % Shards_.size()];
+    }
+
+private:
+    mutable std::vector<TShard> Shards_;
+    mutable std::atomic<uint64_t> Hits_ = 0;
+    mutable std::atomic<uint64_t> Misses_ = 0;
+};
+
+} // namespace NTruePrompter::NRecognition
@@ -0,0 +1,105 @@
+#include "batched_decoder.hpp"
+
+#include <algorithm>
+
+
+namespace NTruePrompter::NRecognition {
+
+TBatchedDecoder::TBatchedDecoder(const kaldi::LatticeIncrementalDecoderConfig& config, const kaldi::TransitionModel& transitionModel, TNnetBatcher& batcher, int32_t framesPerChunk, const fst::Fst<fst::StdArc>& fst, kaldi::OnlineNnet2FeaturePipeline* featurePipeline)
+    : TransitionModel_(transitionModel)
+    , Batcher_(batcher)
+    , FramesPerChunk_(std::max(framesPerChunk, 1))
+    , FeaturePipeline_(featurePipeline)
+    , Decoder_(fst, transitionModel, config)
+    , Decodable_(transitionModel)
+{
+    InitDecoding();
+}
+
+void TBatchedDecoder::InitDecoding(int32_t frameOffset) {
+    FrameOffset_ = frameOffset;
+    Decodable_.Reset();
+    Decoder_.InitDecoding();
+}
+
+void TBatchedDecoder::AdvanceDecoding() {
+    const int32_t subsampling = Batcher_.GetFrameSubsamplingFactor();
+    const int32_t inputFrames = FeaturePipeline_->NumFramesReady();
+
+    // Output frames are numbered from the stream start, a chunk is ready once its last frame has the right context
+    Tasks_.clear();
+    for (int32_t begin = FrameOffset_ + Decodable_.NumFramesReady();
+        (begin + FramesPerChunk_ - 1) * subsampling + Batcher_.GetRightContext() < inputFrames;
+        begin += FramesPerChunk_)
+    {
+        Tasks_.push_back(CreateTask(begin));
+    }
+
+    if (!Tasks_.empty()) {
+        TaskPointers_.clear();
+        for (const auto& task : Tasks_) {
+            TaskPointers_.push_back(task.get());
+        }
+        Batcher_.Compute(TaskPointers_);
+        Decodable_.SetChunks(Tasks_);
+    }
+
+    Decoder_.AdvanceDecoding(&Decodable_);
+}
+
+bool TBatchedDecoder::EndpointDetected(const kaldi::OnlineEndpointConfig& config) const {
+    return kaldi::EndpointDetected(config, TransitionModel_, FeaturePipeline_->FrameShiftInSeconds() * Batcher_.GetFrameSubsamplingFactor(), Decoder_);
+}
+
+// Frames before the stream start repeat its first frame, as in looped computation
+std::unique_ptr<kaldi::nnet3::NnetInferenceTask> TBatchedDecoder::CreateTask(int32_t firstOutputFrame) const {
+    const int32_t subsampling = Batcher_.GetFrameSubsamplingFactor();
+    const int32_t leftContext = Batcher_.GetLeftContext();
+    const int32_t rows = (FramesPerChunk_ - 1) * subsampling + leftContext + Batcher_.GetRightContext() + 1;
+    const int32_t firstInputFrame = firstOutputFrame * subsampling - leftContext;
+
+    kaldi::Matrix<kaldi::BaseFloat> input(rows, Batcher_.GetInputDim(), kaldi::kUndefined);
+    for (int32_t i = 0; i < rows; ++i) {
+        kaldi::SubVector<kaldi::BaseFloat> row(input, i);
+        FeaturePipeline_->InputFeature()->GetFrame(std::max(firstInputFrame + i, 0), &row);
+    }
+
+    auto task = std::make_unique<kaldi::nnet3::NnetInferenceTask>();
+    task->input.Swap(&input);
+    task->first_input_t = -leftContext;
+    task->output_t_stride = subsampling;
+    task->num_output_frames = FramesPerChunk_;
+    task->num_initial_unused_output_frames = 0;
+    task->num_used_output_frames = FramesPerChunk_;
+    task->first_used_output_frame_index = firstOutputFrame;
+    task->is_edge = false;
+    task->is_irregular = false;
+    task->priority = 0;
+    task->output_to_cpu = true;
+
+    if (Batcher_.GetIvectorDim()) {
+        kaldi::Vector<kaldi::BaseFloat> ivector(Batcher_.GetIvectorDim(), kaldi::kUndefined);
+        FeaturePipeline_->IvectorFeature()->GetFrame(firstInputFrame + rows - 1, &ivector);
+        task->ivector.Resize(ivector.Dim(), kaldi::kUndefined);
+        task->ivector.CopyFromVec(ivector);
+    }
+    return task;
+}
+
+void TBatchedDecoder::TDecodable::SetChunks(const std::vector<std::unique_ptr<kaldi::nnet3::NnetInferenceTask>>& tasks) {
+    FirstFrame_ = NumFramesReady();
+
+    int32_t frames = 0;
+    for (const auto& task : tasks) {
+        frames += task->output_cpu.NumRows();
+    }
+    Loglikes_.Resize(frames, tasks.front()->output_cpu.NumCols(), kaldi::kUndefined);
+
+    int32_t row = 0;
+    for (const auto& task : tasks) {
+        Loglikes_.RowRange(row, task->output_cpu.NumRows()).CopyFromMat(task->output_cpu);
+        row += task->output_cpu.NumRows();
+    }
+}
+
+} // namespace NTruePrompter::NRecognition
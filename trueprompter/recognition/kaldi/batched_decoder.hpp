@@ -0,0 +1,108 @@
+#pragma once
+
+#include "nnet_batcher.hpp"
+
+#include <decoder/lattice-incremental-online-decoder.h>
+#include <hmm/transition-model.h>
+#include <itf/decodable-itf.h>
+#include <online2/online-endpoint.h>
+#include <online2/online-nnet2-feature-pipeline.h>
+
+#include <memory>
+#include <vector>
+
+
+namespace NTruePrompter::NRecognition {
+
+/**
+ * Counterpart of kaldi::SingleUtteranceNnet3IncrementalDecoder with acoustic scores computed by TNnetBatcher.
+ * Nnet is evaluated by whole chunks only, so scores lag the audio by up to a chunk and its right context.
+ */
+class TBatchedDecoder {
+public:
+    // Fst and feature pipeline must outlive the decoder, chunks are of framesPerChunk output frames
+    TBatchedDecoder(const kaldi::LatticeIncrementalDecoderConfig& config, const kaldi::TransitionModel& transitionModel, TNnetBatcher& batcher, int32_t framesPerChunk, const fst::Fst<fst::StdArc>& fst, kaldi::OnlineNnet2FeaturePipeline* featurePipeline);
+
+    // Frame offset is the number of output frames decoded by previous utterances
+    void InitDecoding(int32_t frameOffset = 0);
+
+    // Computes all chunks the feature pipeline has frames for and decodes them
+    void AdvanceDecoding();
+
+    void FinalizeDecoding() {
+        Decoder_.FinalizeDecoding();
+    }
+
+    int32_t NumFramesDecoded() const {
+        return Decoder_.NumFramesDecoded();
+    }
+
+    int32_t NumFramesInLattice() const {
+        return Decoder_.NumFramesInLattice();
+    }
+
+    const kaldi::CompactLattice& GetLattice(int32_t numFrames, bool useFinalProbs) {
+        return Decoder_.GetLattice(numFrames, useFinalProbs);
+    }
+
+    bool EndpointDetected(const kaldi::OnlineEndpointConfig& config) const;
+
+    const kaldi::LatticeIncrementalOnlineDecoder& Decoder() const {
+        return Decoder_;
+    }
+
+private:
+    // Scores of the chunks computed by the last AdvanceDecoding, earlier frames are decoded already
+    class TDecodable : public kaldi::DecodableInterface {
+    public:
+        TDecodable(const kaldi::TransitionModel& transitionModel)
+            : TransitionModel_(transitionModel)
+        {}
+
+        void Reset() {
+            FirstFrame_ = 0;
+            Loglikes_.Resize(0, 0);
+        }
+
+        void SetChunks(const std::vector<std::unique_ptr<kaldi::nnet3::NnetInferenceTask>>& tasks);
+
+        kaldi::BaseFloat LogLikelihood(int32_t frame, int32_t transitionId) override {
+            return Loglikes_(frame - FirstFrame_, TransitionModel_.TransitionIdToPdfFast(transitionId));
+        }
+
+        int32_t NumFramesReady() const override {
+            return FirstFrame_ + Loglikes_.NumRows();
+        }
+
+        // Audio stream has no end, utterances are finalized by the recognizer
+        bool IsLastFrame(int32_t frame) const override {
+            return false;
+        }
+
+        int32_t NumIndices() const override {
+            return TransitionModel_.NumTransitionIds();
+        }
+
+    private:
+        const kaldi::TransitionModel& TransitionModel_;
+        int32_t FirstFrame_ = 0;
+        kaldi::Matrix<kaldi::BaseFloat> Loglikes_;
+    };
+
+    std::unique_ptr<kaldi::nnet3::NnetInferenceTask> CreateTask(int32_t firstOutputFrame) const;
+
+private:
+    const kaldi::TransitionModel& TransitionModel_;
+    TNnetBatcher& Batcher_;
+    int32_t FramesPerChunk_;
+    kaldi::OnlineNnet2FeaturePipeline* FeaturePipeline_;
+    kaldi::LatticeIncrementalOnlineDecoder Decoder_;
+    TDecodable Decodable_;
+    int32_t FrameOffset_ = 0;
+
+    // Reused between updates
+    std::vector<std::unique_ptr<kaldi::nnet3::NnetInferenceTask>> Tasks_;
+    std::vector<kaldi::nnet3::NnetInferenceTask*> TaskPointers_;
+};
+
+} // namespace NTruePrompter::NRecognition
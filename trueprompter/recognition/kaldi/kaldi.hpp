@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <filesystem>
 #include <memory>
 #include <string>
@@ -9,12 +10,28 @@
 namespace NTruePrompter::NRecognition {
 
 class TKaldiModel;
+class IPhoneticizer;
 class IRecognizerFactory;
+class ITokenizer;
 class ITokenizerFactory;
 
+/**
+ * Lowest beam and max active tokens IRecognizer::SetDecodingLevel may go down to, 0 means no floor.
+ * Model values lower than floors are kept as is.
+ */
+struct TKaldiDecodingFloors {
+    float Beam = 0;
+    int32_t MaxActive = 0;
+};
+
+// Model folder or variant folder, a variant loads its own copy of the base model
 std::shared_ptr<TKaldiModel> LoadKaldiModel(const std::filesystem::path& path);
-std::shared_ptr<IRecognizerFactory> NewKaldiRecognizerFactory(std::unordered_map<std::string, std::shared_ptr<TKaldiModel>> models);
-std::shared_ptr<ITokenizerFactory> NewKaldiTokenizerFactory(std::unordered_map<std::string, std::shared_ptr<TKaldiModel>> models);
+// Every model and variant of the folder by folder name, variants share the acoustic model and graph of their base
+std::unordered_map<std::string, std::shared_ptr<TKaldiModel>> LoadKaldiModels(const std::filesystem::path& modelsFolder);
+std::shared_ptr<IRecognizerFactory> NewKaldiRecognizerFactory(std::unordered_map<std::string, std::shared_ptr<TKaldiModel>> models, TKaldiDecodingFloors floors = {});
+// Tokenizers of the factory share a pool of threads for long texts, 0 means one per core
+std::shared_ptr<ITokenizerFactory> NewKaldiTokenizerFactory(std::unordered_map<std::string, std::shared_ptr<TKaldiModel>> models, size_t threads = 0);
+std::shared_ptr<ITokenizer> NewKaldiTokenizer(std::shared_ptr<const IPhoneticizer> phoneticizer, size_t threads = 1);
 
 } // namespace NTruePrompter::NRecognition
 
@@ -2,11 +2,15 @@
 #include "model.hpp"
 
 #include <include/PhonetisaurusScript.h>
+#include <utf8.h>
+
+#include <cstdio>
+#include <fstream>
 
 namespace NTruePrompter::NRecognition {
 
-TKaldiModel::TKaldiModel(const std::filesystem::path& path)
-    : PhonetisaurusDecoder_(std::make_unique<PhonetisaurusScript>(path / "g2p.fst"))
+TKaldiModelCore::TKaldiModelCore(const std::filesystem::path& path)
+    : Path_(path)
     , TransitionModel_(std::make_unique<kaldi::TransitionModel>())
     , NNet_(std::make_unique<kaldi::nnet3::AmNnetSimple>())
 {
@@ -20,21 +24,84 @@ TKaldiModel::TKaldiModel(const std::filesystem::path& path)
         kaldi::nnet3::CollapseModel({}, &NNet_->GetNnet());
     }
 
+    auto& liveLatency = LatencyConfigs_[(size_t)ELatencyProfile::Live];
+    liveLatency.AudioChunkSeconds = 0.05f;
+    liveLatency.DeterminizeMaxDelay = 8;
+    liveLatency.DeterminizeMinChunkSize = 4;
+    liveLatency.FramesPerChunk = 12;
+    auto& rehearsalLatency = LatencyConfigs_[(size_t)ELatencyProfile::Rehearsal];
+    rehearsalLatency.AudioChunkSeconds = 0.5f;
+    rehearsalLatency.DeterminizeMaxDelay = 40;
+    rehearsalLatency.DeterminizeMinChunkSize = 20;
+    rehearsalLatency.FramesPerChunk = 51;
+    auto& balancedLatency = LatencyConfigs_[(size_t)ELatencyProfile::Balanced];
+
+    // Balanced profile takes the usual kaldi options, so the defaults are set before they are read
+    DecodingConfig_.determinize_max_delay = balancedLatency.DeterminizeMaxDelay;
+    DecodingConfig_.determinize_min_chunk_size = balancedLatency.DeterminizeMinChunkSize;
+
     {
         kaldi::ParseOptions po("");
         DecodingConfig_.Register(&po);
         EndpointConfig_.Register(&po);
         DecodableOpts_.Register(&po);
+        po.Register("g2p-decoders", &G2PConfig_.Decoders, "Max number of g2p decoders, each one holds its own copy of g2p model");
+        po.Register("g2p-cache-size", &G2PConfig_.CacheSize, "Max number of words with cached phonemes, 0 disables cache");
+        po.Register("g2p-warmup-words", &G2PConfig_.WarmUpWords, "File with words to phoneticize at startup, one per line, relative to model folder");
+        po.Register("phones-mode", &PhonesModeName_, "How phones are extracted from the lattice on every update: mbr, incremental or best-path");
+        po.Register("phones-stable-delay", &PhonesStableDelay_, "Frames behind the decoded end after which phones are no longer recomputed in incremental and best-path modes");
+        po.Register("audio-chunk-seconds", &balancedLatency.AudioChunkSeconds, "Audio is fed to the feature pipeline by chunks of this length, silence weighting is updated after each one");
+        po.Register("live-audio-chunk-seconds", &liveLatency.AudioChunkSeconds, "audio-chunk-seconds of live latency profile");
+        po.Register("live-determinize-max-delay", &liveLatency.DeterminizeMaxDelay, "determinize-max-delay of live latency profile");
+        po.Register("live-determinize-min-chunk-size", &liveLatency.DeterminizeMinChunkSize, "determinize-min-chunk-size of live latency profile");
+        po.Register("live-frames-per-chunk", &liveLatency.FramesPerChunk, "frames-per-chunk of live latency profile");
+        po.Register("rehearsal-audio-chunk-seconds", &rehearsalLatency.AudioChunkSeconds, "audio-chunk-seconds of rehearsal latency profile");
+        po.Register("rehearsal-determinize-max-delay", &rehearsalLatency.DeterminizeMaxDelay, "determinize-max-delay of rehearsal latency profile");
+        po.Register("rehearsal-determinize-min-chunk-size", &rehearsalLatency.DeterminizeMinChunkSize, "determinize-min-chunk-size of rehearsal latency profile");
+        po.Register("rehearsal-frames-per-chunk", &rehearsalLatency.FramesPerChunk, "frames-per-chunk of rehearsal latency profile");
+        po.Register("vad", &VadEnabled_, "Skip pauses longer than vad-hangover before feature extraction, a skipped pause ends the utterance");
+        po.Register("vad-energy-threshold", &VadConfig_.EnergyThresholdDb, "Frame energy over the noise floor to be speech, in dB");
+        po.Register("vad-flatness-threshold", &VadConfig_.FlatnessThresholdDb, "Max spectral flatness of speech frames, in dB");
+        po.Register("vad-hangover", &VadConfig_.HangoverSeconds, "Non-speech seconds passed after speech");
+        po.Register("vad-pre-roll", &VadConfig_.PreRollSeconds, "Skipped seconds passed before speech once it starts");
+        po.Register("nnet-batch-size", &NnetBatchSize_, "Chunks per nnet forward pass batched across sessions, 0 evaluates every session on its own with looped computation");
+        po.Register("nnet-batch-max-delay-ms", &NnetBatchMaxDelayMs_, "Max time a chunk waits for others to fill a batch");
+        po.Register("nnet-batch-threads", &NnetBatchThreads_, "Threads computing batches, each one forward pass at a time");
+        po.Register("nnet-batch-min-frames-per-chunk", &NnetBatchMinFramesPerChunk_, "Min frames-per-chunk of batched evaluation, chunk context is computed again for every chunk");
+        po.Register("max-utterance-frames", &MaxUtteranceFrames_, "Frames after which an utterance without endpoint is committed on the next silence or phone boundary, 0 disables");
         po.ReadConfigFile(path / "conf/model.conf");
     }
 
-    DecodingConfig_.determinize_max_delay = 20;
-    DecodingConfig_.determinize_min_chunk_size = 10;
+    if (PhonesModeName_ == "mbr") {
+        PhonesMode_ = EPhonesMode::Mbr;
+    } else if (PhonesModeName_ == "incremental") {
+        PhonesMode_ = EPhonesMode::IncrementalMbr;
+    } else if (PhonesModeName_ == "best-path") {
+        PhonesMode_ = EPhonesMode::BestPath;
+    } else {
+        throw std::runtime_error("Unknown phones mode " + PhonesModeName_);
+    }
+
+    if (!G2PConfig_.WarmUpWords.empty()) {
+        G2PConfig_.WarmUpWords = path / G2PConfig_.WarmUpWords;
+    }
+
+    balancedLatency.DeterminizeMaxDelay = DecodingConfig_.determinize_max_delay;
+    balancedLatency.DeterminizeMinChunkSize = DecodingConfig_.determinize_min_chunk_size;
+    balancedLatency.FramesPerChunk = DecodableOpts_.frames_per_chunk;
+
     kaldi::ReadConfigFromFile(path / "conf/mfcc.conf", &FeatureInfo_.mfcc_opts);
     FeatureInfo_.feature_type = "mfcc";
     FeatureInfo_.mfcc_opts.frame_opts.allow_downsample = true;
     FeatureInfo_.silence_weighting_config.silence_weight = 1e-3;
     FeatureInfo_.silence_weighting_config.silence_phones_str = EndpointConfig_.silence_phones;
+    {
+        std::vector<int32_t> silencePhones;
+        if (!kaldi::SplitStringToIntegers(EndpointConfig_.silence_phones, ":", true, &silencePhones)) {
+            throw std::runtime_error("Bad silence phones " + EndpointConfig_.silence_phones);
+        }
+        SilencePhones_.insert(silencePhones.begin(), silencePhones.end());
+    }
 
     {
         kaldi::OnlineIvectorExtractionConfig opts;
@@ -50,7 +117,40 @@ TKaldiModel::TKaldiModel(const std::filesystem::path& path)
         FeatureInfo_.ivector_extractor_info.Init(opts);
     }
 
-    DecodableInfo_ = std::make_unique<kaldi::nnet3::DecodableNnetSimpleLoopedInfo>(DecodableOpts_, NNet_.get());
+    for (size_t i = 0; i < LatencyConfigs_.size(); ++i) {
+        const TLatencyConfig& latency = LatencyConfigs_[i];
+        if (latency.AudioChunkSeconds <= 0) {
+            throw std::runtime_error("Audio chunk seconds must be positive");
+        }
+        // Incremental phones keep a lattice state id, determinization renumbers states within its delay
+        if (PhonesMode_ == EPhonesMode::IncrementalMbr && PhonesStableDelay_ <= latency.DeterminizeMaxDelay) {
+            throw std::runtime_error("Phones stable delay must be greater than determinize max delay of every latency profile");
+        }
+
+        DecodingConfigs_[i] = DecodingConfig_;
+        DecodingConfigs_[i].determinize_max_delay = latency.DeterminizeMaxDelay;
+        DecodingConfigs_[i].determinize_min_chunk_size = latency.DeterminizeMinChunkSize;
+        DecodingConfigs_[i].Check();
+
+        for (size_t j = 0; j < i && !DecodableInfos_[i]; ++j) {
+            if (LatencyConfigs_[j].FramesPerChunk == latency.FramesPerChunk) {
+                DecodableInfos_[i] = DecodableInfos_[j];
+            }
+        }
+        if (!DecodableInfos_[i]) {
+            LatencyDecodableOpts_[i] = DecodableOpts_;
+            LatencyDecodableOpts_[i].frames_per_chunk = latency.FramesPerChunk;
+            DecodableInfos_[i] = std::make_shared<kaldi::nnet3::DecodableNnetSimpleLoopedInfo>(LatencyDecodableOpts_[i], NNet_.get());
+        }
+    }
+
+    if (NnetBatchSize_ > 0) {
+        TNnetBatcher::TConfig batcherConfig;
+        batcherConfig.BatchSize = NnetBatchSize_;
+        batcherConfig.MaxDelay = std::chrono::milliseconds(std::max(NnetBatchMaxDelayMs_, 0));
+        batcherConfig.Threads = std::max(NnetBatchThreads_, 1);
+        NnetBatcher_ = std::make_unique<TNnetBatcher>(batcherConfig, DecodableOpts_, NNet_->GetNnet());
+    }
 
     HCL_ = std::unique_ptr<fst::Fst<fst::StdArc>>(fst::StdFst::Read(path / "graph/HCLr.fst"));
     G_ = std::unique_ptr<fst::Fst<fst::StdArc>>(fst::StdFst::Read(path / "graph/Gr.fst"));
@@ -58,69 +158,194 @@ TKaldiModel::TKaldiModel(const std::filesystem::path& path)
     HCLG_.reset(fst::LookaheadComposeFst(*HCL_, *G_, Disambig_));
 
     PhoneSyms_ = std::unique_ptr<fst::SymbolTable>(fst::SymbolTable::ReadText(path / "phones.txt"));
+}
+
+TKaldiModel::TVariantConfig TKaldiModel::ReadVariantConfig(const std::filesystem::path& path) {
+    TVariantConfig config;
+    kaldi::ParseOptions po("");
+    po.Register("base", &config.Base, "Model folder whose acoustic model and graph the variant uses, next to the variant folder");
+    po.Register("g2p", &config.G2P, "G2p model of the variant, relative to variant folder, base one if empty");
+    po.Register("g2p-decoders", &config.G2PDecoders, "g2p-decoders of the variant, base one if negative");
+    po.Register("g2p-cache-size", &config.G2PCacheSize, "g2p-cache-size of the variant, base one if negative");
+    po.Register("g2p-warmup-words", &config.G2PWarmUpWords, "g2p-warmup-words of the variant, relative to variant folder, base one if empty");
+    po.Register("char-map", &config.CharMap, "File with \"from to\" characters per line, relative to variant folder, words are mapped before g2p");
+    po.ReadConfigFile(path / "variant.conf");
+    if (config.Base.empty()) {
+        throw std::runtime_error("No base model in " + (path / "variant.conf").string());
+    }
+    return config;
+}
+
+TKaldiModel::TKaldiModel(std::shared_ptr<const TKaldiModelCore> core, const std::filesystem::path& path, const TVariantConfig& variant)
+    : Core_(std::move(core))
+{
+    const auto& base = Core_->GetG2PConfig();
+    PhonetisaurusModelPath_ = variant.G2P.empty() ? Core_->GetPath() / "g2p.fst" : path / variant.G2P;
+    PhonetisaurusDecodersLimit_ = variant.G2PDecoders < 0 ? base.Decoders : variant.G2PDecoders;
+    G2PCacheSize_ = variant.G2PCacheSize < 0 ? base.CacheSize : variant.G2PCacheSize;
+    G2PWarmUpWords_ = variant.G2PWarmUpWords.empty() ? base.WarmUpWords : (path / variant.G2PWarmUpWords).string();
+    G2PCache_ = std::make_unique<TG2PCache>(std::max(G2PCacheSize_, 0));
+
+    // Tokenized scripts are cached by version, so it covers everything that changes phonemes of a word
+    G2PVersion_ = path.filename().string() + "/" + HashFile(PhonetisaurusModelPath_);
+    if (!variant.CharMap.empty()) {
+        ReadCharMap(path / variant.CharMap);
+        G2PVersion_ += "/" + HashFile(path / variant.CharMap);
+    }
+
+    auto phonetisaurusDecoder = AcquirePhonetisaurusDecoder();
+    KaldiToPhonetisaurusPhoneMapping_ = MakeKaldiToPhonetisaurusPhoneMapping(Core_->GetPhoneSymbols(), *phonetisaurusDecoder->osyms_);
+    ReleasePhonetisaurusDecoder(std::move(phonetisaurusDecoder));
+}
 
-    KaldiToPhonetisaurusPhoneMapping_ = MakeKaldiToPhonetisaurusPhoneMapping(*PhoneSyms_, *PhonetisaurusDecoder_->osyms_);
+void TKaldiModel::ReadCharMap(const std::filesystem::path& path) {
+    std::ifstream in(path);
+    if (!in) {
+        throw std::runtime_error("Can't open char map " + path.string());
+    }
+    std::string from;
+    std::string to;
+    while (in >> from >> to) {
+        CharMap_[from] = to;
+    }
 }
 
-std::vector<int64_t> TKaldiModel::Phoneticize(const std::string& word) const {
-    std::vector<int64_t> res;
-    auto ret = PhonetisaurusDecoder_->Phoneticize(word);
-    for (size_t j = 0; j < ret[0].Uniques.size(); ++j) {
-        res.emplace_back(ret[0].Uniques[j]);
+std::string TKaldiModel::MapChars(const std::string& word) const {
+    std::string mapped;
+    mapped.reserve(word.size());
+
+    auto it = word.begin();
+    while (it != word.end()) {
+        auto prev = it;
+        utf8::next(it, word.end());
+        std::string ch(prev, it);
+        auto mit = CharMap_.find(ch);
+        mapped += mit != CharMap_.end() ? mit->second : ch;
     }
-    return res;
+    return mapped;
 }
 
-class TKazakhKaldiModel : public NTruePrompter::NRecognition::TKaldiModel {
-public:
-    using NTruePrompter::NRecognition::TKaldiModel::TKaldiModel;
-
-    std::vector<int64_t> Phoneticize(const std::string& word) const override {
-        static const std::unordered_map<std::string, std::string> mapping {
-            { "Ә", "А", },
-            { "ә", "а", },
-            { "Ғ", "Г", },
-            { "ғ", "г", },
-            { "Қ", "К", },
-            { "қ", "к", },
-            { "Ң", "Н", },
-            { "ң", "н", },
-            { "Ө", "О", },
-            { "ө", "о", },
-            { "Ұ", "У", },
-            { "ұ", "у", },
-            { "Ү", "У", },
-            { "ү", "у", },
-            { "Һ", "Х", },
-            { "һ", "х", },
-            { "І", "И", },
-            { "і", "и", },
-        };
-
-        std::string newWord;
-
-        auto it = word.begin();
-        while (it != word.end()) {
-            auto prev = it;
-            utf8::next(it, word.end());
-            std::string ch(prev, it);
-            auto mit = mapping.find(ch);
-            if (mit != mapping.end()) {
-                newWord += mit->second;
-            } else {
-                newWord += ch;
+std::vector<TPhoneme> TKaldiModel::Phoneticize(const std::string& word) const {
+    return G2PCache_->GetOrCompute(CharMap_.empty() ? word : MapChars(word), [this](const std::string& word) {
+        auto decoder = AcquirePhonetisaurusDecoder();
+        std::vector<TPhoneme> res;
+        try {
+            auto ret = decoder->Phoneticize(word);
+            for (size_t j = 0; j < ret[0].Uniques.size(); ++j) {
+                res.emplace_back((TPhoneme)ret[0].Uniques[j]);
             }
+        } catch (...) {
+            ReleasePhonetisaurusDecoder(std::move(decoder));
+            throw;
+        }
+        ReleasePhonetisaurusDecoder(std::move(decoder));
+        return res;
+    });
+}
+
+std::string TKaldiModel::HashFile(const std::filesystem::path& path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("Can't open " + path.string());
+    }
+    uint64_t hash = 14695981039346656037ull;
+    char buffer[1 << 16];
+    while (in.read(buffer, sizeof(buffer)) || in.gcount() > 0) {
+        for (std::streamsize i = 0; i < in.gcount(); ++i) {
+            hash = (hash ^ (uint8_t)buffer[i]) * 1099511628211ull;
         }
+    }
+    char hex[17];
+    std::snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)hash);
+    return hex;
+}
+
+std::unique_ptr<PhonetisaurusScript> TKaldiModel::AcquirePhonetisaurusDecoder() const {
+    std::unique_lock<std::mutex> lock(PhonetisaurusDecodersMutex_);
+    PhonetisaurusDecoderReleased_.wait(lock, [this] {
+        return !FreePhonetisaurusDecoders_.empty() || PhonetisaurusDecodersCount_ < (size_t)std::max(PhonetisaurusDecodersLimit_, 1);
+    });
+    if (!FreePhonetisaurusDecoders_.empty()) {
+        auto decoder = std::move(FreePhonetisaurusDecoders_.back());
+        FreePhonetisaurusDecoders_.pop_back();
+        return decoder;
+    }
+    // Loading is slow, do it without blocking others
+    ++PhonetisaurusDecodersCount_;
+    lock.unlock();
+    try {
+        return std::make_unique<PhonetisaurusScript>(PhonetisaurusModelPath_);
+    } catch (...) {
+        lock.lock();
+        --PhonetisaurusDecodersCount_;
+        PhonetisaurusDecoderReleased_.notify_one();
+        throw;
+    }
+}
+
+void TKaldiModel::ReleasePhonetisaurusDecoder(std::unique_ptr<PhonetisaurusScript> decoder) const {
+    {
+        std::lock_guard<std::mutex> guard(PhonetisaurusDecodersMutex_);
+        FreePhonetisaurusDecoders_.push_back(std::move(decoder));
+    }
+    PhonetisaurusDecoderReleased_.notify_one();
+}
+
+void TKaldiModel::WarmUpG2PCache() {
+    if (G2PWarmUpWords_.empty()) {
+        return;
+    }
 
-        return NTruePrompter::NRecognition::TKaldiModel::Phoneticize(newWord);
-    } 
-};
+    std::ifstream words(G2PWarmUpWords_);
+    if (!words) {
+        throw std::runtime_error("Can't open g2p warm up words file " + G2PWarmUpWords_);
+    }
+    std::string word;
+    while (words >> word) {
+        Phoneticize(word);
+    }
+}
 
 std::shared_ptr<TKaldiModel> LoadKaldiModel(const std::filesystem::path& path) {
-    if (path.filename() == "ru+kz") {
-        return std::make_shared<TKazakhKaldiModel>(path.parent_path() / "ru");
+    std::shared_ptr<TKaldiModel> model;
+    if (std::filesystem::exists(path / "variant.conf")) {
+        const auto variant = TKaldiModel::ReadVariantConfig(path);
+        model = std::make_shared<TKaldiModel>(std::make_shared<TKaldiModelCore>(path.parent_path() / variant.Base), path, variant);
+    } else {
+        model = std::make_shared<TKaldiModel>(std::make_shared<TKaldiModelCore>(path), path);
+    }
+    model->WarmUpG2PCache();
+    return model;
+}
+
+std::unordered_map<std::string, std::shared_ptr<TKaldiModel>> LoadKaldiModels(const std::filesystem::path& modelsFolder) {
+    std::unordered_map<std::string, std::shared_ptr<TKaldiModelCore>> cores;
+    auto getCore = [&](const std::filesystem::path& path) {
+        auto& core = cores[path.filename().string()];
+        if (!core) {
+            core = std::make_shared<TKaldiModelCore>(path);
+        }
+        return core;
+    };
+
+    std::unordered_map<std::string, std::shared_ptr<TKaldiModel>> models;
+    for (const auto& entry : std::filesystem::directory_iterator(modelsFolder)) {
+        if (!entry.is_directory()) {
+            continue;
+        }
+        std::shared_ptr<TKaldiModel> model;
+        if (std::filesystem::exists(entry.path() / "variant.conf")) {
+            const auto variant = TKaldiModel::ReadVariantConfig(entry.path());
+            model = std::make_shared<TKaldiModel>(getCore(modelsFolder / variant.Base), entry.path(), variant);
+        } else if (std::filesystem::exists(entry.path() / "conf/model.conf")) {
+            model = std::make_shared<TKaldiModel>(getCore(entry.path()), entry.path());
+        } else {
+            continue;
+        }
+        model->WarmUpG2PCache();
+        models[entry.path().filename().string()] = std::move(model);
     }
-    return std::make_shared<TKaldiModel>(path);
+    return models;
 }
 
 }
@@ -16,22 +16,75 @@
 #include <online2/online-nnet2-feature-pipeline.h>
 #include <online2/online-nnet3-incremental-decoding.h>
 
+#include "batched_decoder.hpp"
+#include "nnet_batcher.hpp"
+#include "vad.hpp"
+
+#include <trueprompter/recognition/g2p_cache.hpp>
+#include <trueprompter/recognition/phoneme.hpp>
+#include <trueprompter/recognition/recognizer.hpp>
+#include <trueprompter/recognition/tokenizer.hpp>
+
+#include <array>
+#include <condition_variable>
 #include <filesystem>
+#include <mutex>
 #include <optional>
+#include <string>
 #include <unordered_map>
+#include <unordered_set>
 
 
 class PhonetisaurusScript;
 
 namespace NTruePrompter::NRecognition {
 
-class TKaldiModel {
+/**
+ * Acoustic model, decoding graph and feature extraction of one model folder, everything heavy and language agnostic.
+ * Immutable once loaded, shared by the model of the folder and all variants on top of it.
+ */
+class TKaldiModelCore {
 public:
-    TKaldiModel(const std::filesystem::path& path);
-    virtual ~TKaldiModel() = default;
+    enum class EPhonesMode {
+        // Minimum Bayes risk over the whole utterance lattice, cost grows with utterance length
+        Mbr,
+        // Minimum Bayes risk over the lattice after the last stable phone, earlier phones are kept
+        IncrementalMbr,
+        // Best path traceback after the last stable phone, the cheapest one
+        BestPath,
+    };
+
+    // Chunking and delays of one ELatencyProfile
+    struct TLatencyConfig {
+        // Audio is fed to the feature pipeline by chunks of this length, silence weighting is updated after each one
+        float AudioChunkSeconds = 0.2f;
+        // Incremental determinization of the lattice, in output frames, bounds how late phones reach the lattice
+        int32_t DeterminizeMaxDelay = 20;
+        int32_t DeterminizeMinChunkSize = 10;
+        // Nnet evaluation chunk, in input frames
+        int32_t FramesPerChunk = 20;
+    };
+
+    // G2P options of conf/model.conf, defaults of variants
+    struct TG2PConfig {
+        int32_t Decoders = 4;
+        int32_t CacheSize = 200000;
+        // Full path, empty if none
+        std::string WarmUpWords;
+    };
+
+    TKaldiModelCore(const std::filesystem::path& path);
+
+    const std::filesystem::path& GetPath() const {
+        return Path_;
+    }
+
+    const TG2PConfig& GetG2PConfig() const {
+        return G2PConfig_;
+    }
 
-    PhonetisaurusScript& GetPhonetisaurusDecoder() const {
-        return *PhonetisaurusDecoder_;
+    const fst::SymbolTable& GetPhoneSymbols() const {
+        return *PhoneSyms_;
     }
 
     const fst::Fst<fst::StdArc>* GetFst() const {
@@ -46,56 +99,102 @@ public:
         return EndpointConfig_;
     }
 
-    std::optional<int64_t> RemapPhone(int64_t phone) const {
-        auto it = KaldiToPhonetisaurusPhoneMapping_.find(phone);
-        if (it != KaldiToPhonetisaurusPhoneMapping_.end()) {
-            return it->second;
+    EPhonesMode GetPhonesMode() const {
+        return PhonesMode_;
+    }
+
+    // Phones ending this number of frames before the decoded end are considered final
+    int32_t GetPhonesStableDelay() const {
+        return PhonesStableDelay_;
+    }
+
+    const TLatencyConfig& GetLatencyConfig(ELatencyProfile profile) const {
+        return LatencyConfigs_[(size_t)profile];
+    }
+
+    // Duration of one decoded frame
+    float GetFrameSeconds() const {
+        return FeatureInfo_.mfcc_opts.frame_opts.frame_shift_ms / 1000.0f * DecodableOpts_.frame_subsampling_factor;
+    }
+
+    // Nothing if voice activity detection is off
+    std::optional<TVoiceActivityDetector::TConfig> GetVadConfig() const {
+        if (!VadEnabled_) {
+            return std::nullopt;
         }
-        return std::nullopt;
+        return VadConfig_;
     }
 
-    virtual std::vector<int64_t> Phoneticize(const std::string& word) const;
+    // 0 means utterances end on endpoints only
+    int32_t GetMaxUtteranceFrames() const {
+        return MaxUtteranceFrames_;
+    }
+
+    bool IsSilencePhone(int32_t phone) const {
+        return SilencePhones_.count(phone);
+    }
 
     std::unique_ptr<kaldi::OnlineSilenceWeighting> CreateSilenceWeighting() const {
         return std::make_unique<kaldi::OnlineSilenceWeighting>(*TransitionModel_, FeatureInfo_.silence_weighting_config, 3);
     }
 
-    auto CreateFeaturePipelineAndDecoder() const {
-        auto featurePipeline = std::make_unique<kaldi::OnlineNnet2FeaturePipeline>(FeatureInfo_);
-        auto decoder = std::make_unique<kaldi::SingleUtteranceNnet3IncrementalDecoder>(
-            DecodingConfig_,
+    /**
+     * Decoding graph for one thread. The graph is composed lazily and caches expanded states,
+     * so concurrently used decoders need their own copies, these share everything but the cache.
+     */
+    std::unique_ptr<fst::Fst<fst::StdArc>> CreateFst() const {
+        return std::unique_ptr<fst::Fst<fst::StdArc>>(HCLG_->Copy(true));
+    }
+
+    // Decoding config of conf/model.conf with determinization delays of the profile
+    const kaldi::LatticeIncrementalDecoderConfig& GetDecodingConfig(ELatencyProfile profile) const {
+        return DecodingConfigs_[(size_t)profile];
+    }
+
+    std::unique_ptr<kaldi::OnlineNnet2FeaturePipeline> CreateFeaturePipeline() const {
+        return std::make_unique<kaldi::OnlineNnet2FeaturePipeline>(FeatureInfo_);
+    }
+
+    // Fst and feature pipeline must outlive the decoder
+    std::unique_ptr<kaldi::SingleUtteranceNnet3IncrementalDecoder> CreateDecoder(const kaldi::LatticeIncrementalDecoderConfig& config, ELatencyProfile profile, const fst::Fst<fst::StdArc>& fst, kaldi::OnlineNnet2FeaturePipeline* featurePipeline) const {
+        return std::make_unique<kaldi::SingleUtteranceNnet3IncrementalDecoder>(
+            config,
             *TransitionModel_,
-            *DecodableInfo_,
-            *HCLG_,
-            featurePipeline.get()
+            *DecodableInfos_[(size_t)profile],
+            fst,
+            featurePipeline
         );
-        return std::tuple(std::move(featurePipeline), std::move(decoder));
     }
 
-private:
-    static std::unordered_map<int64_t, int64_t> MakeKaldiToPhonetisaurusPhoneMapping(const fst::SymbolTable& kaldiSymbols, const fst::SymbolTable& phonetisaurusSymbols) {
-        std::unordered_map<int64_t, int64_t> mapping;
-
-        for (fst::SymbolTableIterator it(kaldiSymbols); !it.Done(); it.Next()) {
-            std::string symbol = it.Symbol();
-            auto underscorePos = symbol.find_first_of('_');
-            if (underscorePos == std::string::npos) {
-                continue;
-            }
-            symbol.resize(underscorePos);
-            auto phonetisaurusPhone = phonetisaurusSymbols.Find(symbol);
-            if (phonetisaurusPhone != fst::kNoSymbol) {
-                mapping[it.Value()] = phonetisaurusPhone;
-            }
-        }
+    // Nnet is evaluated by TNnetBatcher shared by sessions instead of each decoder on its own
+    bool IsNnetBatched() const {
+        return NnetBatcher_ != nullptr;
+    }
 
-        return mapping;
+    // Fst and feature pipeline must outlive the decoder, IsNnetBatched() models only
+    std::unique_ptr<TBatchedDecoder> CreateBatchedDecoder(const kaldi::LatticeIncrementalDecoderConfig& config, ELatencyProfile profile, const fst::Fst<fst::StdArc>& fst, kaldi::OnlineNnet2FeaturePipeline* featurePipeline) const {
+        // Context is computed again for every chunk, short ones would mostly compute context
+        const int32_t framesPerChunk = std::max(LatencyConfigs_[(size_t)profile].FramesPerChunk, NnetBatchMinFramesPerChunk_) / DecodableOpts_.frame_subsampling_factor;
+        return std::make_unique<TBatchedDecoder>(config, *TransitionModel_, *NnetBatcher_, framesPerChunk, fst, featurePipeline);
     }
 
 private:
-    std::unique_ptr<PhonetisaurusScript> PhonetisaurusDecoder_;
+    std::filesystem::path Path_;
+    TG2PConfig G2PConfig_;
 
-    std::unordered_map<int64_t, int64_t> KaldiToPhonetisaurusPhoneMapping_;
+    std::string PhonesModeName_ = "incremental";
+    EPhonesMode PhonesMode_ = EPhonesMode::IncrementalMbr;
+    int32_t PhonesStableDelay_ = 50;
+    int32_t MaxUtteranceFrames_ = 1000;
+    // Balanced, Live and Rehearsal
+    std::array<TLatencyConfig, 3> LatencyConfigs_;
+    int32_t NnetBatchSize_ = 0;
+    int32_t NnetBatchMaxDelayMs_ = 10;
+    int32_t NnetBatchThreads_ = 1;
+    int32_t NnetBatchMinFramesPerChunk_ = 30;
+    bool VadEnabled_ = true;
+    TVoiceActivityDetector::TConfig VadConfig_;
+    std::unordered_set<int32_t> SilencePhones_;
 
     std::unique_ptr<kaldi::TransitionModel> TransitionModel_;
     std::unique_ptr<kaldi::nnet3::AmNnetSimple> NNet_;
@@ -105,7 +204,11 @@ private:
     kaldi::nnet3::NnetSimpleLoopedComputationOptions DecodableOpts_;
     kaldi::OnlineNnet2FeaturePipelineInfo FeatureInfo_;
 
-    std::unique_ptr<kaldi::nnet3::DecodableNnetSimpleLoopedInfo> DecodableInfo_;
+    std::array<kaldi::LatticeIncrementalDecoderConfig, 3> DecodingConfigs_;
+    // Infos keep references to their options. Looped computation is compiled per chunk size, profiles with the same one share it
+    std::array<kaldi::nnet3::NnetSimpleLoopedComputationOptions, 3> LatencyDecodableOpts_;
+    std::array<std::shared_ptr<kaldi::nnet3::DecodableNnetSimpleLoopedInfo>, 3> DecodableInfos_;
+    std::unique_ptr<TNnetBatcher> NnetBatcher_;
 
     std::unique_ptr<fst::Fst<fst::StdArc>> HCL_;
     std::unique_ptr<fst::Fst<fst::StdArc>> G_;
@@ -116,5 +219,114 @@ private:
     std::unique_ptr<fst::SymbolTable> PhoneSyms_;
 };
 
-} // NTruePrompter::NRecognition
+/**
+ * Model of one language, g2p with optional char mapping over a shared core.
+ * A folder with conf/model.conf is a model by itself, a folder with variant.conf is a variant layering its own g2p
+ * and char mapping on top of the core of its base folder, see LoadKaldiModels.
+ */
+class TKaldiModel : public IPhoneticizer {
+public:
+    // variant.conf, unset values are the ones of the base model
+    struct TVariantConfig {
+        // Base model folder name, next to the variant folder
+        std::string Base;
+        // Paths relative to the variant folder
+        std::string G2P;
+        std::string G2PWarmUpWords;
+        // Lines of "from to" characters, words are mapped before g2p
+        std::string CharMap;
+        // Negative means unset
+        int32_t G2PDecoders = -1;
+        int32_t G2PCacheSize = -1;
+    };
 
+    static TVariantConfig ReadVariantConfig(const std::filesystem::path& path);
+
+    // Path is the model folder, or the variant folder along with its config
+    TKaldiModel(std::shared_ptr<const TKaldiModelCore> core, const std::filesystem::path& path, const TVariantConfig& variant = {});
+
+    const std::shared_ptr<const TKaldiModelCore>& GetCore() const {
+        return Core_;
+    }
+
+    std::optional<TPhoneme> RemapPhone(int64_t phone) const {
+        auto it = KaldiToPhonetisaurusPhoneMapping_.find(phone);
+        if (it != KaldiToPhonetisaurusPhoneMapping_.end()) {
+            return it->second;
+        }
+        return std::nullopt;
+    }
+
+    /**
+     * Thread-safe, concurrent calls use separate g2p decoders, up to --g2p-decoders of them.
+     */
+    std::vector<TPhoneme> Phoneticize(const std::string& word) const override;
+
+    // Model or variant folder name, g2p model content hash and char map content hash, if any
+    std::string GetVersion() const override {
+        return G2PVersion_;
+    }
+
+    /**
+     * Phoneticizes words from --g2p-warmup-words file, if any, so that their phonemes are cached from the start.
+     * Words are cached after char mapping, as Phoneticize does.
+     */
+    void WarmUpG2PCache();
+
+    TG2PCache::TStats GetG2PCacheStats() const {
+        return G2PCache_->GetStats();
+    }
+
+private:
+    static std::string HashFile(const std::filesystem::path& path);
+
+    void ReadCharMap(const std::filesystem::path& path);
+    std::string MapChars(const std::string& word) const;
+
+    std::unique_ptr<PhonetisaurusScript> AcquirePhonetisaurusDecoder() const;
+    void ReleasePhonetisaurusDecoder(std::unique_ptr<PhonetisaurusScript> decoder) const;
+
+    static std::unordered_map<int64_t, TPhoneme> MakeKaldiToPhonetisaurusPhoneMapping(const fst::SymbolTable& kaldiSymbols, const fst::SymbolTable& phonetisaurusSymbols) {
+        if (phonetisaurusSymbols.AvailableKey() > std::numeric_limits<TPhoneme>::max()) {
+            throw std::runtime_error("Too many phonemes in g2p model");
+        }
+
+        std::unordered_map<int64_t, TPhoneme> mapping;
+
+        for (fst::SymbolTableIterator it(kaldiSymbols); !it.Done(); it.Next()) {
+            std::string symbol = it.Symbol();
+            auto underscorePos = symbol.find_first_of('_');
+            if (underscorePos == std::string::npos) {
+                continue;
+            }
+            symbol.resize(underscorePos);
+            auto phonetisaurusPhone = phonetisaurusSymbols.Find(symbol);
+            if (phonetisaurusPhone != fst::kNoSymbol) {
+                mapping[it.Value()] = (TPhoneme)phonetisaurusPhone;
+            }
+        }
+
+        return mapping;
+    }
+
+private:
+    std::shared_ptr<const TKaldiModelCore> Core_;
+
+    // PhonetisaurusScript is not thread-safe, so every concurrent Phoneticize gets its own one
+    std::filesystem::path PhonetisaurusModelPath_;
+    int32_t PhonetisaurusDecodersLimit_ = 4;
+    mutable std::mutex PhonetisaurusDecodersMutex_;
+    mutable std::condition_variable PhonetisaurusDecoderReleased_;
+    mutable std::vector<std::unique_ptr<PhonetisaurusScript>> FreePhonetisaurusDecoders_;
+    mutable size_t PhonetisaurusDecodersCount_ = 0;
+
+    std::unique_ptr<TG2PCache> G2PCache_;
+    int32_t G2PCacheSize_ = 200000;
+    std::string G2PWarmUpWords_;
+    std::string G2PVersion_;
+
+    std::unordered_map<int64_t, TPhoneme> KaldiToPhonetisaurusPhoneMapping_;
+    std::unordered_map<std::string, std::string> CharMap_;
+};
+
+} // NTruePrompter::NRecognition
@@ -0,0 +1,97 @@
+#include "nnet_batcher.hpp"
+
+#include <nnet3/nnet-utils.h>
+
+#include <algorithm>
+
+
+namespace NTruePrompter::NRecognition {
+
+TNnetBatcher::TNnetBatcher(const TConfig& config, const kaldi::nnet3::NnetSimpleLoopedComputationOptions& decodableOpts, const kaldi::nnet3::Nnet& nnet)
+    : Config_(config)
+{
+    Opts_.frame_subsampling_factor = decodableOpts.frame_subsampling_factor;
+    Opts_.acoustic_scale = decodableOpts.acoustic_scale;
+    Opts_.optimize_config = decodableOpts.optimize_config;
+    Opts_.compute_config = decodableOpts.compute_config;
+    Opts_.minibatch_size = std::max(Config_.BatchSize, 1);
+    Opts_.edge_minibatch_size = Opts_.minibatch_size;
+
+    kaldi::nnet3::ComputeSimpleNnetContext(nnet, &LeftContext_, &RightContext_);
+    InputDim_ = nnet.InputDim("input");
+    IvectorDim_ = std::max(nnet.InputDim("ivector"), 0);
+
+    for (size_t i = 0; i < std::max<size_t>(Config_.Threads, 1); ++i) {
+        auto shard = std::make_unique<TShard>();
+        shard->Computer = std::make_unique<kaldi::nnet3::NnetBatchComputer>(Opts_, nnet, Priors_);
+        shard->Thread = std::thread([this, shard = shard.get()]() {
+            Run(*shard);
+        });
+        Shards_.push_back(std::move(shard));
+    }
+}
+
+TNnetBatcher::~TNnetBatcher() {
+    Stopped_ = true;
+    for (auto& shard : Shards_) {
+        {
+            std::lock_guard<std::mutex> guard(shard->Mutex);
+        }
+        shard->TaskAdded.notify_one();
+        shard->Thread.join();
+    }
+}
+
+void TNnetBatcher::Compute(const std::vector<kaldi::nnet3::NnetInferenceTask*>& tasks) {
+    if (tasks.empty()) {
+        return;
+    }
+
+    TShard& shard = *Shards_[NextShard_++ % Shards_.size()];
+    {
+        std::lock_guard<std::mutex> guard(shard.Mutex);
+        for (auto* task : tasks) {
+            shard.Computer->AcceptTask(task);
+        }
+        if (!shard.Pending) {
+            shard.FirstPendingTime = std::chrono::steady_clock::now();
+        }
+        shard.Pending += tasks.size();
+    }
+    shard.TaskAdded.notify_one();
+
+    for (auto* task : tasks) {
+        task->semaphore.Wait();
+    }
+}
+
+void TNnetBatcher::Run(TShard& shard) {
+    std::unique_lock<std::mutex> lock(shard.Mutex);
+    while (true) {
+        shard.TaskAdded.wait(lock, [&]() {
+            return shard.Pending || Stopped_;
+        });
+        shard.TaskAdded.wait_until(lock, shard.FirstPendingTime + Config_.MaxDelay, [&]() {
+            return shard.Computer->NumFullPendingMinibatches() > 0 || Stopped_;
+        });
+        if (Stopped_) {
+            return;
+        }
+
+        // Tasks added while computing start a new delay, even if they get into this round
+        const bool expired = std::chrono::steady_clock::now() >= shard.FirstPendingTime + Config_.MaxDelay;
+        if (expired) {
+            shard.Pending = 0;
+        }
+        lock.unlock();
+        while (shard.Computer->Compute(false)) {
+        }
+        if (expired) {
+            while (shard.Computer->Compute(true)) {
+            }
+        }
+        lock.lock();
+    }
+}
+
+} // namespace NTruePrompter::NRecognition
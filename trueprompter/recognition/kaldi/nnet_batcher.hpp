@@ -0,0 +1,90 @@
+#pragma once
+
+#include <nnet3/decodable-simple-looped.h>
+#include <nnet3/nnet-batch-compute.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace NTruePrompter::NRecognition {
+
+/**
+ * Evaluates nnet3 chunks of many sessions of one model together, so that small per-session chunks become
+ * one large matrix multiplication. Chunks of the same size wait for each other up to MaxDelay, full batches go at once.
+ * Chunks are computed with their full context, there is no state between them.
+ */
+class TNnetBatcher {
+public:
+    struct TConfig {
+        // Chunks per forward pass
+        int32_t BatchSize = 32;
+        std::chrono::microseconds MaxDelay = std::chrono::milliseconds(10);
+        // Each thread batches its own share of calls, so it is one forward pass at a time per thread
+        size_t Threads = 1;
+    };
+
+    TNnetBatcher(const TConfig& config, const kaldi::nnet3::NnetSimpleLoopedComputationOptions& decodableOpts, const kaldi::nnet3::Nnet& nnet);
+    ~TNnetBatcher();
+
+    /**
+     * Blocks until outputs of all tasks are computed. Tasks output to cpu, outputs are scaled by the acoustic scale.
+     */
+    void Compute(const std::vector<kaldi::nnet3::NnetInferenceTask*>& tasks);
+
+    // Input frames needed before and after an output frame
+    int32_t GetLeftContext() const {
+        return LeftContext_;
+    }
+
+    int32_t GetRightContext() const {
+        return RightContext_;
+    }
+
+    int32_t GetFrameSubsamplingFactor() const {
+        return Opts_.frame_subsampling_factor;
+    }
+
+    int32_t GetInputDim() const {
+        return InputDim_;
+    }
+
+    // 0 if the nnet takes no ivectors
+    int32_t GetIvectorDim() const {
+        return IvectorDim_;
+    }
+
+private:
+    struct TShard {
+        std::unique_ptr<kaldi::nnet3::NnetBatchComputer> Computer;
+        std::mutex Mutex;
+        std::condition_variable TaskAdded;
+        // Tasks added since the last partial batch was flushed
+        size_t Pending = 0;
+        std::chrono::steady_clock::time_point FirstPendingTime;
+        std::thread Thread;
+    };
+
+    void Run(TShard& shard);
+
+private:
+    TConfig Config_;
+    // Computers keep references to options and nnet
+    kaldi::nnet3::NnetBatchComputerOptions Opts_;
+    kaldi::Vector<kaldi::BaseFloat> Priors_;
+    int32_t LeftContext_ = 0;
+    int32_t RightContext_ = 0;
+    int32_t InputDim_ = 0;
+    int32_t IvectorDim_ = 0;
+
+    std::vector<std::unique_ptr<TShard>> Shards_;
+    std::atomic<size_t> NextShard_ = 0;
+    std::atomic<bool> Stopped_ = false;
+};
+
+} // namespace NTruePrompter::NRecognition
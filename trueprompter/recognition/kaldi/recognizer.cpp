@@ -3,126 +3,536 @@
 
 #include <trueprompter/recognition/recognizer.hpp>
 
+#include <fst/topsort.h>
+
+#include <algorithm>
+#include <type_traits>
+#include <unordered_map>
+
 
 namespace {
 
+// Decoder is either kaldi::SingleUtteranceNnet3IncrementalDecoder or TBatchedDecoder of models with batched nnet evaluation
+template <typename TDecoder>
 class TKaldiRecognizer : public NTruePrompter::NRecognition::IRecognizer {
 public:
-    TKaldiRecognizer(std::shared_ptr<NTruePrompter::NRecognition::TKaldiModel> model)
+    // Every decoding level narrows beams and max active tokens by these factors
+    static constexpr float BeamStep = 0.85f;
+    static constexpr float MaxActiveStep = 0.6f;
+    static constexpr size_t MaxDecodingLevel = 3;
+    // Frames over max-utterance-frames to wait for a silence, then for a phone boundary, then the utterance is cut anyway
+    static constexpr int32_t SoftCommitGrace = 50;
+
+    TKaldiRecognizer(std::shared_ptr<NTruePrompter::NRecognition::TKaldiModel> model, NTruePrompter::NRecognition::ELatencyProfile latencyProfile, NTruePrompter::NRecognition::TKaldiDecodingFloors floors)
         : Model_(std::move(model))
-    {
-        std::tie(FeaturePipeline_, Decoder_) = Model_->CreateFeaturePipelineAndDecoder();
+        , Core_(Model_->GetCore())
+        , LatencyProfile_(latencyProfile)
+        , Floors_(floors)
+        , Fst_(Core_->CreateFst())
+        , FeaturePipeline_(Core_->CreateFeaturePipeline())
+        , Decoder_(CreateDecoder(Core_->GetDecodingConfig(LatencyProfile_)))
+    {}
+
+    bool Update(const float* data, size_t dataSize, int32_t sampleRate, std::vector<NTruePrompter::NRecognition::TPhoneme>* tokensOut) override {
+        return UpdateImpl(data, dataSize, sampleRate, tokensOut);
+    }
+
+    bool Update(const int16_t* data, size_t dataSize, int32_t sampleRate, std::vector<NTruePrompter::NRecognition::TPhoneme>* tokensOut) override {
+        return UpdateImpl(data, dataSize, sampleRate, tokensOut);
+    }
+
+    void Reset() override {
+        Decoder_->FinalizeDecoding();
+        StartNextUtterance();
+    }
+
+    // Decoder config can't be changed in the middle of an utterance, so the level is applied by the next Reset
+    void SetDecodingLevel(size_t level) override {
+        NextDecodingLevel_ = std::min(level, MaxDecodingLevel);
+        if (NextDecodingLevel_ != DecodingLevel_ && !Decoder_->NumFramesDecoded()) {
+            ApplyDecodingLevel();
+            Decoder_->InitDecoding(FrameOffset_);
+        }
+    }
+
+    size_t GetMaxDecodingLevel() const override {
+        return MaxDecodingLevel;
     }
 
-    bool Update(const float* data, size_t dataSize, int32_t sampleRate, std::vector<int64_t>* tokensOut) override {
+    // Fst keeps the states expanded by earlier sessions, everything else starts over
+    bool Recycle() override {
+        Decoder_.reset();
+        FeaturePipeline_ = Core_->CreateFeaturePipeline();
+        SilenceWeighting_.reset();
+        Vad_.reset();
+        FrameOffset_ = 0;
+        AcceptedSeconds_ = 0;
+        DecodingLevel_ = 0;
+        NextDecodingLevel_ = 0;
+        Decoder_ = CreateDecoder(Core_->GetDecodingConfig(LatencyProfile_));
+        ResetStablePhones();
+        return true;
+    }
+
+    // Phones come from the lattice, which lags decoding by the determinization delay, except in best path mode
+    double GetUndecodedSeconds() const override {
+        const int32_t frames = Core_->GetPhonesMode() == NTruePrompter::NRecognition::TKaldiModelCore::EPhonesMode::BestPath
+            ? Decoder_->NumFramesDecoded()
+            : Decoder_->NumFramesInLattice();
+        return std::max(AcceptedSeconds_ - (FrameOffset_ + frames) * (double)Core_->GetFrameSeconds(), 0.0);
+    }
+
+    // Replaces phones, keeping their capacity. Phones of a finalized utterance cover every decoded frame
+    void GetPhones(std::vector<NTruePrompter::NRecognition::TPhoneme>* phones, bool finalized = false) {
+        phones->clear();
+        switch (Core_->GetPhonesMode()) {
+            case NTruePrompter::NRecognition::TKaldiModelCore::EPhonesMode::Mbr:
+                GetMbrPhones(phones, finalized);
+                break;
+            case NTruePrompter::NRecognition::TKaldiModelCore::EPhonesMode::IncrementalMbr:
+                GetIncrementalMbrPhones(phones, finalized);
+                break;
+            case NTruePrompter::NRecognition::TKaldiModelCore::EPhonesMode::BestPath:
+                GetBestPathPhones(phones, finalized);
+                break;
+        }
+    }
+
+private:
+    using TStateId = kaldi::CompactLattice::StateId;
+
+    template <typename TSample>
+    bool UpdateImpl(const TSample* data, size_t dataSize, int32_t sampleRate, std::vector<NTruePrompter::NRecognition::TPhoneme>* tokensOut) {
         if (!SilenceWeighting_) {
-            SilenceWeighting_ = Model_->CreateSilenceWeighting();
+            SilenceWeighting_ = Core_->CreateSilenceWeighting();
         }
 
-        size_t chunkSize = sampleRate * 0.2f;
+        const size_t chunkSize = std::max<size_t>(sampleRate * Core_->GetLatencyConfig(LatencyProfile_).AudioChunkSeconds, 1);
+        if ((size_t)Chunk_.Dim() != chunkSize) {
+            Chunk_.Resize(chunkSize, kaldi::kUndefined);
+        }
 
-        kaldi::Vector<kaldi::BaseFloat> vec;
-        vec.Resize(chunkSize, kaldi::kUndefined);
+        if (const auto vadConfig = Core_->GetVadConfig(); vadConfig && (!Vad_ || Vad_->GetSampleRate() != sampleRate)) {
+            Vad_ = std::make_unique<NTruePrompter::NRecognition::TVoiceActivityDetector>(*vadConfig, sampleRate);
+        }
 
         for (size_t i = 0; i < dataSize; i += chunkSize) {
-            size_t currentChunkSize = 0;
-            for ( ; currentChunkSize < chunkSize && i + currentChunkSize < dataSize; ++currentChunkSize) {
-                vec(currentChunkSize) = data[i + currentChunkSize] * 32767.0f; // Kaldi wants it
+            const size_t currentChunkSize = std::min(chunkSize, dataSize - i);
+            ConvertSamples(data + i, currentChunkSize, Chunk_.Data());
+            if (!Vad_) {
+                AcceptSamples(Chunk_.Data(), currentChunkSize, sampleRate);
+                continue;
             }
-            vec.Resize(currentChunkSize, kaldi::MatrixResizeType::kCopyData);
 
-            FeaturePipeline_->AcceptWaveform(sampleRate, vec);
-
-            if (SilenceWeighting_->Active() && FeaturePipeline_->NumFramesReady() > 0
-                && FeaturePipeline_->IvectorFeature() != nullptr)
-            {
-                std::vector<std::pair<int32_t, kaldi::BaseFloat>> deltaWeights;
-                SilenceWeighting_->ComputeCurrentTraceback(Decoder_->Decoder());
-                SilenceWeighting_->GetDeltaWeights(FeaturePipeline_->NumFramesReady(), FrameOffset_ * 3, &deltaWeights);
-                FeaturePipeline_->UpdateFrameWeights(deltaWeights);
+            VadOutput_.clear();
+            Vad_->Accept(Chunk_.Data(), currentChunkSize, &VadOutput_);
+            if (!VadOutput_.empty()) {
+                AcceptSamples(VadOutput_.data(), VadOutput_.size(), sampleRate);
             }
-
-            Decoder_->AdvanceDecoding();
         }
 
-        if (Decoder_->EndpointDetected(Model_->GetEndpointConfig())) {
+        // Skipped pause never reaches the decoder to be detected as an endpoint, so it is one by itself.
+        // Skipped samples are not in the feature pipeline, frame offsets count passed frames only
+        if (Decoder_->EndpointDetected(Core_->GetEndpointConfig()) || (Vad_ && Vad_->IsSkipping() && Decoder_->NumFramesDecoded() > 0)) {
             Reset();
+            tokensOut->clear();
             return true;
         }
 
-        // TODO
-        *tokensOut = GetPhones();
+        // Lattice and tokens grow with the utterance, long monologues without endpoints are cut into bounded ones.
+        // Unlike on endpoints, phones of the cut utterance are returned to be committed, so they are taken from the finalized
+        // lattice, the next utterance starts right after its last decoded frame. Feature pipeline keeps going
+        if (ShouldSoftCommit()) {
+            Decoder_->FinalizeDecoding();
+            GetPhones(tokensOut, true);
+            StartNextUtterance();
+            return true;
+        }
 
+        // TODO
+        GetPhones(tokensOut);
         return false;
     }
 
-    void Reset() override {
-        Decoder_->FinalizeDecoding();
-        FrameOffset_ += Decoder_->NumFramesDecoded();
-        Decoder_->InitDecoding(FrameOffset_);
-        SilenceWeighting_.reset();
+    void AcceptSamples(kaldi::BaseFloat* data, size_t size, int32_t sampleRate) {
+        FeaturePipeline_->AcceptWaveform(sampleRate, kaldi::SubVector<kaldi::BaseFloat>(data, size));
+        AcceptedSeconds_ += (double)size / sampleRate;
+
+        if (SilenceWeighting_->Active() && FeaturePipeline_->NumFramesReady() > 0
+            && FeaturePipeline_->IvectorFeature() != nullptr)
+        {
+            DeltaWeights_.clear();
+            SilenceWeighting_->ComputeCurrentTraceback(Decoder_->Decoder());
+            SilenceWeighting_->GetDeltaWeights(FeaturePipeline_->NumFramesReady(), FrameOffset_ * 3, &DeltaWeights_);
+            FeaturePipeline_->UpdateFrameWeights(DeltaWeights_);
+        }
+
+        Decoder_->AdvanceDecoding();
+    }
+
+    // Kaldi wants samples in 16-bit range, plain loops over raw pointers are vectorized by the compiler
+    static void ConvertSamples(const float* from, size_t size, kaldi::BaseFloat* to) {
+        for (size_t i = 0; i < size; ++i) {
+            to[i] = from[i] * 32767.0f;
+        }
+    }
+
+    static void ConvertSamples(const int16_t* from, size_t size, kaldi::BaseFloat* to) {
+        for (size_t i = 0; i < size; ++i) {
+            to[i] = from[i];
+        }
+    }
+
+    void GetMbrPhones(std::vector<NTruePrompter::NRecognition::TPhoneme>* phones, bool finalized) const {
+        const int32_t frames = GetLatticeFrames(finalized);
+        if (!frames) {
+            return;
+        }
+
+        const kaldi::CompactLattice& compactLattice = Decoder_->GetLattice(frames, finalized);
+        AppendMbrPhones(compactLattice, phones);
+    }
+
+    /**
+     * Phones before the stable state are kept from previous updates, only the lattice after it is phone aligned and decoded with MBR.
+     * Stable state moves along the best path in chunks of at least phones-stable-delay frames, so every update handles a bounded tail.
+     */
+    void GetIncrementalMbrPhones(std::vector<NTruePrompter::NRecognition::TPhoneme>* phones, bool finalized) {
+        const int32_t frames = GetLatticeFrames(finalized);
+        if (!frames) {
+            return;
+        }
+
+        const kaldi::CompactLattice& compactLattice = Decoder_->GetLattice(frames, finalized);
+        // Incremental determinization only rebuilds states within its delay, which the model keeps below the stable delay.
+        // The id is checked against the frame it was taken at anyway, a renumbered state would corrupt stable phones
+        kaldi::CompactLattice tail;
+        std::vector<TStateId> tailToLattice;
+        bool stable = StableState_ != fst::kNoStateId && StableState_ < compactLattice.NumStates();
+        if (stable) {
+            CopyTail(compactLattice, StableState_, &tail, &tailToLattice);
+            stable = frames - GetFramesToEnd(tail) == StableFrames_;
+        }
+        if (!stable) {
+            ResetStablePhones();
+            StableState_ = compactLattice.Start();
+            tail.DeleteStates();
+            tailToLattice.clear();
+            CopyTail(compactLattice, StableState_, &tail, &tailToLattice);
+        }
+
+        phones->assign(StablePhones_.begin(), StablePhones_.end());
+        AppendMbrPhones(tail, phones);
+
+        if (!finalized && frames - StableFrames_ >= 2 * Core_->GetPhonesStableDelay()) {
+            AdvanceStableState(tail, tailToLattice, frames - Core_->GetPhonesStableDelay());
+        }
     }
 
-    std::vector<int64_t> GetPhones() const {
-        if (!Decoder_->NumFramesInLattice()) {
-            return {};
+    /**
+     * Traces the best path back to the last stable frame only, phones before it are kept from previous updates.
+     */
+    void GetBestPathPhones(std::vector<NTruePrompter::NRecognition::TPhoneme>* phones, bool finalized) {
+        const int32_t frames = Decoder_->NumFramesDecoded();
+        std::vector<int32_t>& transitionIds = TransitionIds_;
+        transitionIds.clear();
+        if (frames > StableFrames_) {
+            const auto& decoder = Decoder_->Decoder();
+            for (auto it = decoder.BestPathEnd(finalized); !it.Done() && it.frame >= StableFrames_; ) {
+                kaldi::LatticeArc arc;
+                it = decoder.TraceBackBestPath(it, &arc);
+                if (arc.ilabel != 0) {
+                    transitionIds.push_back(arc.ilabel);
+                }
+            }
+            std::reverse(transitionIds.begin(), transitionIds.end());
+        }
+
+        // Every transition id is one frame, the stable part ends on the last phone boundary old enough
+        size_t stableSize = 0;
+        for (size_t i = 0; i < transitionIds.size() && StableFrames_ + (int32_t)i + 1 <= frames - Core_->GetPhonesStableDelay(); ++i) {
+            if (Core_->GetTransitionModel()->IsFinal(transitionIds[i])) {
+                stableSize = i + 1;
+            }
         }
+        AppendTransitionPhones(transitionIds, 0, stableSize, &StablePhones_);
+        StableFrames_ += stableSize;
 
-        const kaldi::CompactLattice& compactLattice = Decoder_->GetLattice(Decoder_->NumFramesInLattice(), false);
+        phones->assign(StablePhones_.begin(), StablePhones_.end());
+        AppendTransitionPhones(transitionIds, stableSize, transitionIds.size(), phones);
+    }
 
+    void AppendMbrPhones(const kaldi::CompactLattice& compactLattice, std::vector<NTruePrompter::NRecognition::TPhoneme>* phones) const {
         kaldi::CompactLattice phoneAlignedLattice;
         kaldi::PhoneAlignLatticeOptions opts;
         opts.replace_output_symbols = true;
 
         fst::ScaleLattice(fst::GraphLatticeScale(0.0), &phoneAlignedLattice);
-        kaldi::PhoneAlignLattice(compactLattice, *Model_->GetTransitionModel(), opts, &phoneAlignedLattice);
+        kaldi::PhoneAlignLattice(compactLattice, *Core_->GetTransitionModel(), opts, &phoneAlignedLattice);
 
         kaldi::MinimumBayesRisk mbr(phoneAlignedLattice);
 
         auto rawRes = mbr.GetOneBest();
 
-        std::vector<int64_t> res;
-        res.reserve(rawRes.size());
+        phones->reserve(phones->size() + rawRes.size());
 
         for (auto phone : rawRes) {
             auto remappedPhone = Model_->RemapPhone(phone);
             if (remappedPhone) {
-                res.emplace_back(*remappedPhone);
+                phones->emplace_back(*remappedPhone);
             }
         }
+    }
 
-        return res;
+    // Transition ids [from, to) must start on a phone boundary, every phone ends with a final transition
+    void AppendTransitionPhones(const std::vector<int32_t>& transitionIds, size_t from, size_t to, std::vector<NTruePrompter::NRecognition::TPhoneme>* phones) const {
+        const kaldi::TransitionModel& transitionModel = *Core_->GetTransitionModel();
+        bool phoneStart = true;
+        for (size_t i = from; i < to; ++i) {
+            if (phoneStart) {
+                auto remappedPhone = Model_->RemapPhone(transitionModel.TransitionIdToPhone(transitionIds[i]));
+                if (remappedPhone) {
+                    phones->emplace_back(*remappedPhone);
+                }
+            }
+            phoneStart = transitionModel.IsFinal(transitionIds[i]);
+        }
+    }
+
+    // States reachable from the given one, which becomes the start state of the tail
+    static void CopyTail(const kaldi::CompactLattice& compactLattice, TStateId from, kaldi::CompactLattice* tail, std::vector<TStateId>* tailToLattice) {
+        std::unordered_map<TStateId, TStateId> latticeToTail;
+        latticeToTail.emplace(from, tail->AddState());
+        tailToLattice->push_back(from);
+
+        for (size_t i = 0; i < tailToLattice->size(); ++i) {
+            const TStateId state = (*tailToLattice)[i];
+            tail->SetFinal(i, compactLattice.Final(state));
+            for (fst::ArcIterator<kaldi::CompactLattice> it(compactLattice, state); !it.Done(); it.Next()) {
+                kaldi::CompactLatticeArc arc = it.Value();
+                auto [next, inserted] = latticeToTail.emplace(arc.nextstate, 0);
+                if (inserted) {
+                    next->second = tail->AddState();
+                    tailToLattice->push_back(arc.nextstate);
+                }
+                arc.nextstate = next->second;
+                tail->AddArc(i, arc);
+            }
+        }
+        tail->SetStart(0);
+    }
+
+    // Lattice paths of a state to the end are equally long, so any one gives the frames after the state
+    static int32_t GetFramesToEnd(const kaldi::CompactLattice& compactLattice) {
+        int32_t frames = 0;
+        TStateId state = compactLattice.Start();
+        while (state != fst::kNoStateId && compactLattice.Final(state) == kaldi::CompactLatticeWeight::Zero()) {
+            fst::ArcIterator<kaldi::CompactLattice> it(compactLattice, state);
+            if (it.Done()) {
+                return -1;
+            }
+            frames += it.Value().weight.String().size();
+            state = it.Value().nextstate;
+        }
+        return frames;
+    }
+
+    /**
+     * Moves the stable state along the best path of the tail up to the last phone boundary not later than the frame,
+     * phones of the passed path become stable.
+     */
+    void AdvanceStableState(const kaldi::CompactLattice& tail, const std::vector<TStateId>& tailToLattice, int32_t frame) {
+        std::vector<TStateId> order;
+        bool acyclic = false;
+        fst::DfsVisit(tail, fst::TopOrderVisitor<kaldi::CompactLatticeArc>(&order, &acyclic));
+        if (!acyclic) {
+            return;
+        }
+
+        // Costs of the best paths from states to the end
+        std::vector<TStateId> sorted(order.size());
+        for (size_t state = 0; state < order.size(); ++state) {
+            sorted[order[state]] = state;
+        }
+        std::vector<double> costs(order.size());
+        for (auto state = sorted.rbegin(); state != sorted.rend(); ++state) {
+            double cost = kaldi::ConvertToCost(tail.Final(*state).Weight());
+            for (fst::ArcIterator<kaldi::CompactLattice> it(tail, *state); !it.Done(); it.Next()) {
+                cost = std::min(cost, kaldi::ConvertToCost(it.Value().weight.Weight()) + costs[it.Value().nextstate]);
+            }
+            costs[*state] = cost;
+        }
+
+        const kaldi::TransitionModel& transitionModel = *Core_->GetTransitionModel();
+        std::vector<int32_t> transitionIds;
+        size_t stableSize = 0;
+        TStateId stableState = fst::kNoStateId;
+        int32_t stableFrames = StableFrames_;
+
+        TStateId state = tail.Start();
+        int32_t time = StableFrames_;
+        while (true) {
+            const kaldi::CompactLatticeArc* bestArc = nullptr;
+            double bestCost = kaldi::ConvertToCost(tail.Final(state).Weight());
+            for (fst::ArcIterator<kaldi::CompactLattice> it(tail, state); !it.Done(); it.Next()) {
+                const double cost = kaldi::ConvertToCost(it.Value().weight.Weight()) + costs[it.Value().nextstate];
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestArc = &it.Value();
+                }
+            }
+            if (!bestArc || time + (int32_t)bestArc->weight.String().size() > frame) {
+                break;
+            }
+
+            const std::vector<int32_t>& arcTransitionIds = bestArc->weight.String();
+            transitionIds.insert(transitionIds.end(), arcTransitionIds.begin(), arcTransitionIds.end());
+            time += arcTransitionIds.size();
+            state = bestArc->nextstate;
+            if (!arcTransitionIds.empty() && transitionModel.IsFinal(arcTransitionIds.back())) {
+                stableSize = transitionIds.size();
+                stableState = state;
+                stableFrames = time;
+            }
+        }
+
+        if (stableState != fst::kNoStateId) {
+            AppendTransitionPhones(transitionIds, 0, stableSize, &StablePhones_);
+            StableState_ = tailToLattice[stableState];
+            StableFrames_ = stableFrames;
+        }
+    }
+
+    // Utterance is cut after silence once it is long enough, later after any phone, and unconditionally after that
+    bool ShouldSoftCommit() const {
+        const int32_t maxFrames = Core_->GetMaxUtteranceFrames();
+        const int32_t frames = Decoder_->NumFramesDecoded();
+        if (!maxFrames || frames < maxFrames) {
+            return false;
+        }
+        if (frames >= maxFrames + 2 * SoftCommitGrace) {
+            return true;
+        }
+
+        const auto& decoder = Decoder_->Decoder();
+        for (auto it = decoder.BestPathEnd(false); !it.Done(); ) {
+            kaldi::LatticeArc arc;
+            it = decoder.TraceBackBestPath(it, &arc);
+            if (arc.ilabel != 0) {
+                const kaldi::TransitionModel& transitionModel = *Core_->GetTransitionModel();
+                return Core_->IsSilencePhone(transitionModel.TransitionIdToPhone(arc.ilabel))
+                    || (frames >= maxFrames + SoftCommitGrace && transitionModel.IsFinal(arc.ilabel));
+            }
+        }
+        return false;
+    }
+
+    // Lattice lags decoding by the determinization delay until the utterance is finalized, final probs need every decoded frame
+    int32_t GetLatticeFrames(bool finalized) const {
+        return finalized ? Decoder_->NumFramesDecoded() : Decoder_->NumFramesInLattice();
+    }
+
+    // Current utterance must be finalized, the next one continues the feature pipeline after its last decoded frame
+    void StartNextUtterance() {
+        FrameOffset_ += Decoder_->NumFramesDecoded();
+        if (DecodingLevel_ != NextDecodingLevel_) {
+            ApplyDecodingLevel();
+        }
+        Decoder_->InitDecoding(FrameOffset_);
+        SilenceWeighting_.reset();
+        ResetStablePhones();
+    }
+
+    void ResetStablePhones() {
+        StableState_ = fst::kNoStateId;
+        StableFrames_ = 0;
+        StablePhones_.clear();
+    }
+
+    void ApplyDecodingLevel() {
+        DecodingLevel_ = NextDecodingLevel_;
+
+        const auto& modelConfig = Core_->GetDecodingConfig(LatencyProfile_);
+        auto config = modelConfig;
+        for (size_t i = 0; i < DecodingLevel_; ++i) {
+            config.beam *= BeamStep;
+            config.lattice_beam *= BeamStep;
+            config.max_active = std::max<int32_t>(config.max_active * MaxActiveStep, config.min_active);
+        }
+        config.beam = std::max(config.beam, std::min(Floors_.Beam, modelConfig.beam));
+        config.max_active = std::max(config.max_active, std::min(Floors_.MaxActive, modelConfig.max_active));
+
+        // Feature pipeline keeps going, the new decoder continues from FrameOffset_
+        Decoder_ = CreateDecoder(config);
+    }
+
+    std::unique_ptr<TDecoder> CreateDecoder(const kaldi::LatticeIncrementalDecoderConfig& config) const {
+        if constexpr (std::is_same_v<TDecoder, NTruePrompter::NRecognition::TBatchedDecoder>) {
+            return Core_->CreateBatchedDecoder(config, LatencyProfile_, *Fst_, FeaturePipeline_.get());
+        } else {
+            return Core_->CreateDecoder(config, LatencyProfile_, *Fst_, FeaturePipeline_.get());
+        }
     }
 
 private:
     std::shared_ptr<NTruePrompter::NRecognition::TKaldiModel> Model_;
+    // Acoustic model and graph, shared with other variants of the model
+    std::shared_ptr<const NTruePrompter::NRecognition::TKaldiModelCore> Core_;
+    NTruePrompter::NRecognition::ELatencyProfile LatencyProfile_;
+    NTruePrompter::NRecognition::TKaldiDecodingFloors Floors_;
+    // Own copy, sessions are decoded on different threads
+    std::unique_ptr<fst::Fst<fst::StdArc>> Fst_;
 
     std::unique_ptr<kaldi::OnlineNnet2FeaturePipeline> FeaturePipeline_;
     std::unique_ptr<kaldi::OnlineSilenceWeighting> SilenceWeighting_;
-    std::unique_ptr<kaldi::SingleUtteranceNnet3IncrementalDecoder> Decoder_;
+    std::unique_ptr<TDecoder> Decoder_;
     int32_t FrameOffset_ = 0;
+    // Audio passed to the feature pipeline, frame offsets count the same audio
+    double AcceptedSeconds_ = 0;
+    size_t DecodingLevel_ = 0;
+    size_t NextDecodingLevel_ = 0;
+
+    // Phones of the utterance up to StableFrames_, which are not recomputed anymore
+    std::vector<NTruePrompter::NRecognition::TPhoneme> StablePhones_;
+    int32_t StableFrames_ = 0;
+    // Lattice state at StableFrames_, incremental MBR mode only
+    TStateId StableState_ = fst::kNoStateId;
+
+    std::unique_ptr<NTruePrompter::NRecognition::TVoiceActivityDetector> Vad_;
+
+    // Buffers reused between updates
+    kaldi::Vector<kaldi::BaseFloat> Chunk_;
+    std::vector<kaldi::BaseFloat> VadOutput_;
+    std::vector<std::pair<int32_t, kaldi::BaseFloat>> DeltaWeights_;
+    std::vector<int32_t> TransitionIds_;
 };
 
 class TKaldiRecognizerFactory : public NTruePrompter::NRecognition::IRecognizerFactory {
 public:
-    TKaldiRecognizerFactory(std::unordered_map<std::string, std::shared_ptr<NTruePrompter::NRecognition::TKaldiModel>> models)
+    TKaldiRecognizerFactory(std::unordered_map<std::string, std::shared_ptr<NTruePrompter::NRecognition::TKaldiModel>> models, NTruePrompter::NRecognition::TKaldiDecodingFloors floors)
         : Models_(std::move(models))
+        , Floors_(floors)
     {}
 
-    std::shared_ptr<NTruePrompter::NRecognition::IRecognizer> New(const std::string& modelName) const override {
-        return std::make_shared<TKaldiRecognizer>(Models_.at(modelName));
+    std::shared_ptr<NTruePrompter::NRecognition::IRecognizer> New(const std::string& modelName, NTruePrompter::NRecognition::ELatencyProfile latencyProfile) const override {
+        const auto& model = Models_.at(modelName);
+        if (model->GetCore()->IsNnetBatched()) {
+            return std::make_shared<TKaldiRecognizer<NTruePrompter::NRecognition::TBatchedDecoder>>(model, latencyProfile, Floors_);
+        }
+        return std::make_shared<TKaldiRecognizer<kaldi::SingleUtteranceNnet3IncrementalDecoder>>(model, latencyProfile, Floors_);
     }
 
 private:
     std::unordered_map<std::string, std::shared_ptr<NTruePrompter::NRecognition::TKaldiModel>> Models_;
+    NTruePrompter::NRecognition::TKaldiDecodingFloors Floors_;
 };
 
 } // namespace
 
 namespace NTruePrompter::NRecognition {
 
-std::shared_ptr<IRecognizerFactory> NewKaldiRecognizerFactory(std::unordered_map<std::string, std::shared_ptr<TKaldiModel>> models) {
-    return std::make_shared<TKaldiRecognizerFactory>(std::move(models));
+std::shared_ptr<IRecognizerFactory> NewKaldiRecognizerFactory(std::unordered_map<std::string, std::shared_ptr<TKaldiModel>> models, TKaldiDecodingFloors floors) {
+    return std::make_shared<TKaldiRecognizerFactory>(std::move(models), floors);
 }
 
 } // NTruePrompter::NRecognition
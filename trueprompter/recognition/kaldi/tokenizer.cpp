@@ -3,42 +3,102 @@
 
 #include <trueprompter/recognition/tokenizer.hpp>
 
+#include <boost/asio/post.hpp>
+#include <boost/asio/thread_pool.hpp>
+
 #include <utf8.h>
 
 #include <filesystem>
+#include <functional>
+#include <future>
+#include <thread>
 
 namespace {
 
 class TKaldiTokenizer : public NTruePrompter::NRecognition::ITokenizer {
 public:
-    TKaldiTokenizer(std::shared_ptr<NTruePrompter::NRecognition::TKaldiModel> model)
-        : Model_(std::move(model))
+    // Words per pool task, big enough to amortize task overhead on cache hits
+    static constexpr size_t BatchSize = 256;
+
+    /**
+     * Words are phoneticized on the pool when it is provided, so phoneticizer must be thread-safe then.
+     */
+    TKaldiTokenizer(std::shared_ptr<const NTruePrompter::NRecognition::IPhoneticizer> phoneticizer, std::shared_ptr<boost::asio::thread_pool> pool = nullptr)
+        : Phoneticizer_(std::move(phoneticizer))
+        , Pool_(std::move(pool))
     {}
 
-    bool Apply(const std::string& text, std::vector<int64_t>* tokensOut, std::vector<size_t>* tokensOffsetsOut) override {
+    bool Apply(const std::string& text, std::vector<NTruePrompter::NRecognition::TPhoneme>* tokensOut, NTruePrompter::NRecognition::TPhonemeOffsets* tokensOffsetsOut) override {
         if (!utf8::is_valid(text.begin(), text.end())) {
             throw std::runtime_error("Text is not valid utf-8 string");
         }
 
         tokensOut->clear();
         if (tokensOffsetsOut) {
-            tokensOffsetsOut->clear();
+            tokensOffsetsOut->Clear();
         }
 
-        auto isWordSymbol = [](uint32_t c) {
-            // TODO proper spaces tracking
-            return c > std::numeric_limits<unsigned char>::max() || !std::isspace((unsigned char)c);
-        };
+        const std::vector<TWord> words = SplitWords(text);
+        const std::vector<std::vector<NTruePrompter::NRecognition::TPhoneme>> phonemes = Phoneticize(words);
 
-        auto flush = [this, &tokensOut, &tokensOffsetsOut](const std::string& s, size_t from, size_t to) {
-            auto ret = Model_->Phoneticize(s);
+        // Merge in text order, so the result does not depend on how words were scheduled
+        for (size_t i = 0; i < words.size(); ++i) {
+            const size_t from = words[i].From;
+            const size_t to = words[i].To;
+            const auto& ret = phonemes[i];
             for (size_t j = 0; j < ret.size(); ++j) {
                 tokensOut->emplace_back(ret[j]);
                 if (tokensOffsetsOut) {
-                    tokensOffsetsOut->emplace_back(std::min<size_t>(to - from - 1, (to - from) * j / ret.size()) + from);
+                    tokensOffsetsOut->PushBack(std::min<size_t>(to - from - 1, (to - from) * j / ret.size()) + from);
                 }
             }
-        };
+        }
+
+        return true;
+    }
+
+    std::string GetId() const override {
+        // Bump the prefix whenever splitting or offsets assignment changes
+        return "kaldi-tokenizer-1/" + Phoneticizer_->GetVersion();
+    }
+
+    // Words are phoneticized independently, so the range only has to be widened to whole words
+    std::pair<size_t, size_t> GetRetokenizeRange(const std::string& text, size_t from, size_t to) const override {
+        if (!utf8::is_valid(text.begin(), text.end())) {
+            throw std::runtime_error("Text is not valid utf-8 string");
+        }
+
+        size_t begin = 0;
+        size_t pos = 0;
+        auto it = text.begin();
+        while (it != text.end() && pos < from) {
+            ++pos;
+            if (!IsWordSymbol(utf8::next(it, text.end()))) {
+                begin = pos;
+            }
+        }
+        while (it != text.end() && (pos < to || IsWordSymbol(utf8::peek_next(it, text.end())))) {
+            utf8::next(it, text.end());
+            ++pos;
+        }
+        return { begin, pos };
+    }
+
+private:
+    struct TWord {
+        std::string Text;
+        // Unicode characters range in text
+        size_t From;
+        size_t To;
+    };
+
+    static bool IsWordSymbol(uint32_t c) {
+        // TODO proper spaces tracking
+        return c > std::numeric_limits<unsigned char>::max() || !std::isspace((unsigned char)c);
+    }
+
+    static std::vector<TWord> SplitWords(const std::string& text) {
+        std::vector<TWord> words;
 
         size_t wordPos = 0;
         size_t currentPos = 0;
@@ -46,16 +106,16 @@ public:
         auto currentIt = text.begin();
         while (currentIt != text.end()) {
             uint32_t c = utf8::peek_next(currentIt, text.end());
-            if (isWordSymbol(c)) {
+            if (IsWordSymbol(c)) {
                 utf8::next(currentIt, text.end());
                 currentPos++;
             } else {
-                flush(std::string(wordIt, currentIt), wordPos, currentPos);
+                words.push_back({ std::string(wordIt, currentIt), wordPos, currentPos });
                 wordPos = currentPos;
                 wordIt = currentIt;
                 while (currentIt != text.end()) {
                     currentPos++;
-                    if (isWordSymbol(utf8::next(currentIt, text.end()))) {
+                    if (IsWordSymbol(utf8::next(currentIt, text.end()))) {
                         break;
                     }
                     wordPos = currentPos;
@@ -63,21 +123,52 @@ public:
                 }
             }
         }
-        flush(std::string(wordIt, currentIt), wordPos, currentPos);
+        words.push_back({ std::string(wordIt, currentIt), wordPos, currentPos });
 
-        return true;
+        return words;
+    }
+
+    std::vector<std::vector<NTruePrompter::NRecognition::TPhoneme>> Phoneticize(const std::vector<TWord>& words) const {
+        std::vector<std::vector<NTruePrompter::NRecognition::TPhoneme>> phonemes(words.size());
+        auto phoneticizeBatch = [this, &words, &phonemes](size_t from, size_t to) {
+            for (size_t i = from; i < to; ++i) {
+                phonemes[i] = Phoneticizer_->Phoneticize(words[i].Text);
+            }
+        };
+
+        if (!Pool_ || words.size() <= BatchSize) {
+            phoneticizeBatch(0, words.size());
+            return phonemes;
+        }
+
+        std::vector<std::future<void>> batches;
+        for (size_t from = 0; from < words.size(); from += BatchSize) {
+            std::packaged_task<void()> batch(std::bind(phoneticizeBatch, from, std::min(from + BatchSize, words.size())));
+            batches.push_back(batch.get_future());
+            boost::asio::post(*Pool_, std::move(batch));
+        }
+        // Wait for all batches before rethrowing anything, they reference locals
+        for (auto& batch : batches) {
+            batch.wait();
+        }
+        for (auto& batch : batches) {
+            batch.get();
+        }
+        return phonemes;
     }
 
 private:
-    std::shared_ptr<NTruePrompter::NRecognition::TKaldiModel> Model_;
+    std::shared_ptr<const NTruePrompter::NRecognition::IPhoneticizer> Phoneticizer_;
+    std::shared_ptr<boost::asio::thread_pool> Pool_;
 };
 
 class TKaldiTokenizerFactory : public NTruePrompter::NRecognition::ITokenizerFactory {
 public:
-    TKaldiTokenizerFactory(std::unordered_map<std::string, std::shared_ptr<NTruePrompter::NRecognition::TKaldiModel>> models) 
+    TKaldiTokenizerFactory(std::unordered_map<std::string, std::shared_ptr<NTruePrompter::NRecognition::TKaldiModel>> models, size_t threads)
+        : Pool_(threads > 1 ? std::make_shared<boost::asio::thread_pool>(threads) : nullptr)
     {
         for (auto& [modelName, model] : models) {
-            Tokenizers_[modelName] = std::make_shared<TKaldiTokenizer>(std::move(model));
+            Tokenizers_[modelName] = std::make_shared<TKaldiTokenizer>(std::move(model), Pool_);
         }
     }
 
@@ -86,6 +177,7 @@ public:
     }
 
 private:
+    std::shared_ptr<boost::asio::thread_pool> Pool_;
     std::unordered_map<std::string, std::shared_ptr<TKaldiTokenizer>> Tokenizers_;
 };
 
@@ -93,8 +185,15 @@ private:
 
 namespace NTruePrompter::NRecognition {
 
-std::shared_ptr<ITokenizerFactory> NewKaldiTokenizerFactory(std::unordered_map<std::string, std::shared_ptr<TKaldiModel>> models) {
-    return std::make_shared<TKaldiTokenizerFactory>(std::move(models));
+std::shared_ptr<ITokenizerFactory> NewKaldiTokenizerFactory(std::unordered_map<std::string, std::shared_ptr<TKaldiModel>> models, size_t threads) {
+    if (threads == 0) {
+        threads = std::thread::hardware_concurrency();
+    }
+    return std::make_shared<TKaldiTokenizerFactory>(std::move(models), threads);
+}
+
+std::shared_ptr<ITokenizer> NewKaldiTokenizer(std::shared_ptr<const IPhoneticizer> phoneticizer, size_t threads) {
+    return std::make_shared<TKaldiTokenizer>(std::move(phoneticizer), threads > 1 ? std::make_shared<boost::asio::thread_pool>(threads) : nullptr);
 }
 
 } // namespace NTruePrompter::NRecognition
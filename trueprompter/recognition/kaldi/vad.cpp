@@ -0,0 +1,143 @@
+#include "vad.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+
+namespace NTruePrompter::NRecognition {
+
+TVoiceActivityDetector::TVoiceActivityDetector(const TConfig& config, int32_t sampleRate)
+    : Config_(config)
+    , SampleRate_(sampleRate)
+    , FrameSize_(std::max<size_t>(sampleRate * config.FrameSeconds, 1))
+    , HangoverFrames_(config.HangoverSeconds / config.FrameSeconds)
+    , NoiseFloorRiseDb_(config.NoiseFloorRiseDbPerSecond * config.FrameSeconds)
+    , PreRoll_(std::max<size_t>(sampleRate * config.PreRollSeconds, 1))
+    , NoiseFloorDb_(config.InitialNoiseFloorDb)
+{
+    Window_.resize(FrameSize_);
+    for (size_t i = 0; i < FrameSize_; ++i) {
+        Window_[i] = 0.5f - 0.5f * std::cos(2.0f * (float)M_PI * i / FrameSize_);
+    }
+
+    size_t fftSize = 1;
+    while (fftSize < FrameSize_) {
+        fftSize *= 2;
+    }
+    Spectrum_.resize(fftSize);
+    Twiddles_.resize(fftSize / 2);
+    for (size_t i = 0; i < Twiddles_.size(); ++i) {
+        Twiddles_[i] = std::polar(1.0f, -2.0f * (float)M_PI * i / fftSize);
+    }
+
+    // Speech band, 300-4000 Hz
+    BandBegin_ = std::clamp<size_t>(300 * fftSize / sampleRate, 1, fftSize / 2);
+    BandEnd_ = std::clamp<size_t>(4000 * fftSize / sampleRate, BandBegin_, fftSize / 2);
+
+    Frame_.reserve(FrameSize_);
+}
+
+void TVoiceActivityDetector::Accept(const float* data, size_t size, std::vector<float>* output) {
+    Stats_.Samples += size;
+    while (size) {
+        const size_t count = std::min(size, FrameSize_ - Frame_.size());
+        Frame_.insert(Frame_.end(), data, data + count);
+        data += count;
+        size -= count;
+        if (Frame_.size() == FrameSize_) {
+            AcceptFrame(output);
+            Frame_.clear();
+        }
+    }
+}
+
+void TVoiceActivityDetector::AcceptFrame(std::vector<float>* output) {
+    if (IsSpeech()) {
+        NonSpeechFrames_ = 0;
+    } else {
+        ++NonSpeechFrames_;
+    }
+
+    if (NonSpeechFrames_ <= HangoverFrames_) {
+        if (Skipping_) {
+            // Oldest pre-roll samples first
+            const size_t begin = (PreRollPos_ + PreRoll_.size() - PreRollSize_) % PreRoll_.size();
+            for (size_t i = 0; i < PreRollSize_; ++i) {
+                output->push_back(PreRoll_[(begin + i) % PreRoll_.size()]);
+            }
+            Stats_.SkippedSamples -= PreRollSize_;
+            PreRollSize_ = 0;
+            Skipping_ = false;
+        }
+        output->insert(output->end(), Frame_.begin(), Frame_.end());
+        return;
+    }
+
+    Skipping_ = true;
+    Stats_.SkippedSamples += Frame_.size();
+    for (float sample : Frame_) {
+        PreRoll_[PreRollPos_] = sample;
+        PreRollPos_ = (PreRollPos_ + 1) % PreRoll_.size();
+    }
+    PreRollSize_ = std::min(PreRollSize_ + Frame_.size(), PreRoll_.size());
+}
+
+bool TVoiceActivityDetector::IsSpeech() {
+    double energy = 0;
+    for (float sample : Frame_) {
+        energy += sample * sample;
+    }
+    const float energyDb = 10.0f * std::log10(energy / Frame_.size() + 1e-10);
+
+    const float noiseFloorDb = NoiseFloorDb_;
+    NoiseFloorDb_ = std::min(energyDb, NoiseFloorDb_ + NoiseFloorRiseDb_);
+
+    if (energyDb < noiseFloorDb + Config_.EnergyThresholdDb) {
+        return false;
+    }
+    // Loud but flat frames are noise bursts, voiced speech has formants and harmonics.
+    // Unvoiced sounds are flat too, but they are within the hangover or the pre-roll of voiced ones
+    return GetFlatnessDb() < Config_.FlatnessThresholdDb;
+}
+
+float TVoiceActivityDetector::GetFlatnessDb() {
+    const size_t size = Spectrum_.size();
+    for (size_t i = 0; i < size; ++i) {
+        Spectrum_[i] = i < FrameSize_ ? Frame_[i] * Window_[i] : 0.0f;
+    }
+
+    // Iterative radix-2 FFT
+    for (size_t i = 1, j = 0; i < size; ++i) {
+        size_t bit = size >> 1;
+        for ( ; j & bit; bit >>= 1) {
+            j ^= bit;
+        }
+        j ^= bit;
+        if (i < j) {
+            std::swap(Spectrum_[i], Spectrum_[j]);
+        }
+    }
+    for (size_t len = 2; len <= size; len *= 2) {
+        const size_t step = size / len;
+        for (size_t i = 0; i < size; i += len) {
+            for (size_t k = 0; k < len / 2; ++k) {
+                const std::complex<float> odd = Spectrum_[i + k + len / 2] * Twiddles_[k * step];
+                Spectrum_[i + k + len / 2] = Spectrum_[i + k] - odd;
+                Spectrum_[i + k] += odd;
+            }
+        }
+    }
+
+    double logSum = 0;
+    double sum = 0;
+    for (size_t i = BandBegin_; i < BandEnd_; ++i) {
+        const double power = std::norm(Spectrum_[i]) + 1e-10;
+        logSum += std::log(power);
+        sum += power;
+    }
+    const size_t count = std::max<size_t>(BandEnd_ - BandBegin_, 1);
+    // Geometric to arithmetic mean, in dB
+    return 10.0f * (logSum / count - std::log(sum / count)) / std::log(10.0);
+}
+
+} // namespace NTruePrompter::NRecognition
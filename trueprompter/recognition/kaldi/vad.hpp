@@ -0,0 +1,87 @@
+#pragma once
+
+#include <complex>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+
+namespace NTruePrompter::NRecognition {
+
+/**
+ * Streaming voice activity detector, log energy over an adaptive noise floor and spectral flatness.
+ * Passes speech with a hangover after it and a pre-roll before it, longer pauses are skipped.
+ */
+class TVoiceActivityDetector {
+public:
+    struct TConfig {
+        float FrameSeconds = 0.02f;
+        // Frame energy over the noise floor to be speech at all
+        float EnergyThresholdDb = 12.0f;
+        // Geometric to arithmetic mean of power spectrum, close to 1 for noise and much lower for voiced speech
+        float FlatnessThresholdDb = -6.0f;
+        // Noise floor follows quieter frames at once and louder ones at this rate
+        float NoiseFloorRiseDbPerSecond = 2.0f;
+        // Noise floor to start with, samples are in 16-bit range
+        float InitialNoiseFloorDb = 40.0f;
+        float HangoverSeconds = 1.0f;
+        float PreRollSeconds = 0.3f;
+    };
+
+    struct TStats {
+        uint64_t Samples = 0;
+        uint64_t SkippedSamples = 0;
+    };
+
+    TVoiceActivityDetector(const TConfig& config, int32_t sampleRate);
+
+    /**
+     * Appends samples worth recognizing to output, the rest is skipped. Output lags input by less than a frame.
+     */
+    void Accept(const float* data, size_t size, std::vector<float>* output);
+
+    // Pause is longer than the hangover, so audio is being skipped
+    bool IsSkipping() const {
+        return Skipping_;
+    }
+
+    int32_t GetSampleRate() const {
+        return SampleRate_;
+    }
+
+    const TStats& GetStats() const {
+        return Stats_;
+    }
+
+private:
+    void AcceptFrame(std::vector<float>* output);
+    bool IsSpeech();
+    float GetFlatnessDb();
+
+private:
+    TConfig Config_;
+    int32_t SampleRate_;
+    size_t FrameSize_;
+    size_t HangoverFrames_;
+    float NoiseFloorRiseDb_;
+
+    // Hann window and FFT of the frame zero padded to a power of 2, over the speech band only
+    std::vector<float> Window_;
+    std::vector<std::complex<float>> Twiddles_;
+    std::vector<std::complex<float>> Spectrum_;
+    size_t BandBegin_ = 0;
+    size_t BandEnd_ = 0;
+
+    std::vector<float> Frame_;
+    // Ring of the last skipped samples, passed when speech starts
+    std::vector<float> PreRoll_;
+    size_t PreRollPos_ = 0;
+    size_t PreRollSize_ = 0;
+
+    float NoiseFloorDb_;
+    size_t NonSpeechFrames_ = 0;
+    bool Skipping_ = false;
+    TStats Stats_;
+};
+
+} // namespace NTruePrompter::NRecognition
@@ -1,65 +1,101 @@
 #pragma once
 
+#include "phoneme_index.hpp"
 #include "smith_waterman.hpp"
 #include "recognizer.hpp"
+#include "tokenized_script.hpp"
 #include "tokenizer.hpp"
 
 #include <vector>
 #include <string>
 #include <memory>
 #include <optional>
+#include <tuple>
 
 
 namespace NTruePrompter::NRecognition {
 
+/**
+ * Recent speech phonemes in a fixed-capacity ring, absolute positions only grow until Reset.
+ * Every phoneme is stored twice, at slot and slot + capacity, so any capacity-long window is contiguous
+ * and GetUnmatched() is a plain span without any moves or allocations after construction.
+ * When unmatched phonemes don't fit, the oldest of them are dropped as if matched.
+ */
 class TSpeechPhonemesBuffer {
 public:
-    explicit TSpeechPhonemesBuffer(size_t fitThreshold = 150)
-        : FitThreshold_(fitThreshold)
+    struct TStats {
+        // Max number of phonemes held at once
+        size_t HighWaterMark = 0;
+        // Unmatched phonemes dropped because of capacity
+        size_t Dropped = 0;
+    };
+
+    explicit TSpeechPhonemesBuffer(size_t capacity = 1024)
+        : Capacity_(std::max<size_t>(capacity, 1))
+        , Phonemes_(Capacity_ * 2)
     {}
 
-    void Update(const std::span<const int64_t>& phonemes) {
-        Phonemes_.resize(CommittedPos_);
-        Phonemes_.insert(Phonemes_.end(), phonemes.begin(), phonemes.end());
-        MatchedPos_ = std::min<size_t>(MatchedPos_, Phonemes_.size());
+    void Update(const std::span<const TPhoneme>& phonemes) {
+        EndPos_ = CommittedPos_ + phonemes.size();
+        // Phonemes before the last capacity ones are overwritten anyway
+        const size_t skip = phonemes.size() > Capacity_ ? phonemes.size() - Capacity_ : 0;
+        for (size_t i = skip; i < phonemes.size(); ++i) {
+            const size_t slot = (CommittedPos_ + i) % Capacity_;
+            Phonemes_[slot] = phonemes[i];
+            Phonemes_[slot + Capacity_] = phonemes[i];
+        }
+
+        // Committed slots before it could be overwritten by a longer partial result, so it never moves back over them.
+        // Uncommitted ones are written again by every update, a shorter partial result takes them back
+        BeginPos_ = std::max({ std::min(BeginPos_, CommittedPos_), std::min(MatchedPos_, CommittedPos_), EndPos_ - std::min(EndPos_, Capacity_) });
+        if (MatchedPos_ < BeginPos_) {
+            Stats_.Dropped += BeginPos_ - MatchedPos_;
+            MatchedPos_ = BeginPos_;
+        }
+        MatchedPos_ = std::min<size_t>(MatchedPos_, EndPos_);
+        Stats_.HighWaterMark = std::max(Stats_.HighWaterMark, EndPos_ - BeginPos_);
     }
 
     void Commit() {
-        CommittedPos_ = Phonemes_.size();
-        Fit();
+        CommittedPos_ = EndPos_;
+    }
+
+    std::span<const TPhoneme> GetUnmatched() const {
+        return std::span<const TPhoneme>(Phonemes_.data() + MatchedPos_ % Capacity_, EndPos_ - MatchedPos_);
     }
 
-    std::span<const int64_t> GetUnmatched() const {
-        return std::span<const int64_t>(Phonemes_.data() + MatchedPos_, Phonemes_.size() - MatchedPos_);
+    // Leading part of GetUnmatched() that is committed and won't be rewritten by Update
+    size_t GetUnmatchedCommittedSize() const {
+        return CommittedPos_ > MatchedPos_ ? CommittedPos_ - MatchedPos_ : 0;
     }
 
     void Match(size_t count) {
-        MatchedPos_ = std::min<size_t>(MatchedPos_ + count, Phonemes_.size());
-        Fit();
+        MatchedPos_ = std::min<size_t>(MatchedPos_ + count, EndPos_);
     }
 
     void Reset() {
-        Phonemes_.clear();
+        BeginPos_ = 0;
         CommittedPos_ = 0;
         MatchedPos_ = 0;
+        EndPos_ = 0;
     }
 
-private:
-    void Fit() {
-        size_t count = std::min<size_t>(CommittedPos_, MatchedPos_);
-        if (count < FitThreshold_) {
-            return;
-        }
-        Phonemes_.erase(Phonemes_.begin(), Phonemes_.begin() + count);
-        CommittedPos_ -= count;
-        MatchedPos_ -= count;
+    size_t GetCapacity() const {
+        return Capacity_;
+    }
+
+    const TStats& GetStats() const {
+        return Stats_;
     }
 
 private:
-    const size_t FitThreshold_;
-    std::vector<int64_t> Phonemes_;
+    const size_t Capacity_;
+    std::vector<TPhoneme> Phonemes_;
+    size_t BeginPos_ = 0;
     size_t CommittedPos_ = 0;
     size_t MatchedPos_ = 0;
+    size_t EndPos_ = 0;
+    TStats Stats_;
 };
 
 class TPhonemesMatcher {
@@ -72,43 +108,65 @@ public:
         double SourceSkipWeight = -1.0;
         double TargetSkipWeight = -1.0;
         double MinMatchWeight = 3.0;
+        // Jumps over the whole script when speech is not found in the window, unset keeps within LookAhead
+        std::optional<double> RelocationMinMatchWeight;
+        // Adaptive window mode, window starts from InitialLookAhead and grows up to LookAhead
+        std::optional<size_t> InitialLookAhead;
+        double LookAheadGrowth = 2.0;
+        size_t MaxCellsPerUpdate = 1 << 24;
     };
 
-    explicit TPhonemesMatcher(std::vector<int64_t> phonemes)
-        : Phonemes_(std::move(phonemes))
+    explicit TPhonemesMatcher(std::vector<TPhoneme> phonemes)
+        : TPhonemesMatcher(MakeScript(std::move(phonemes)))
+    {
+    }
+
+    /**
+     * Script is only read, so one script can be shared by any number of matchers.
+     */
+    explicit TPhonemesMatcher(std::shared_ptr<const TTokenizedScript> script)
+        : Script_(std::move(script))
+        , Phonemes_(Script_->GetPhonemes())
+        , Index_(&Script_->GetIndex())
     {
     }
 
     void Match(TSpeechPhonemesBuffer& speechPhonemesBuffer, const TMatchParameters& matchParameters) {
         auto speechPhonemes = speechPhonemesBuffer.GetUnmatched();
-        auto phonemes = std::span<const int64_t>(Phonemes_.data() + CurrentPos_, std::min<size_t>(Phonemes_.size() - CurrentPos_, matchParameters.LookAhead.value_or((size_t)-1)));
-
-        // Slightly decrease weight at the end of lookahead window - prioritize closer matches
-        auto weightMultiplier = [&phonemes, &matchParameters](const int64_t* targetPos) {
-            return 1.0 - matchParameters.FadeOverLookAhead * (double)(targetPos - phonemes.data()) / (double)phonemes.size();
-        };
+        if ((double)speechPhonemes.size() * matchParameters.SimilarScore < matchParameters.MinMatchWeight) {
+            // Too few speech phonemes to reach the min weight anywhere, don't grow the window for nothing
+            return;
+        }
+        const size_t maxWindow = std::min<size_t>(Phonemes_.size() - CurrentPos_, matchParameters.LookAhead.value_or((size_t)-1));
 
-        // TODO match last N speech phonemes
-        const auto [speechPhonemesMatched, phonemesMatched, score] = SmithWaterman<const int64_t, double>(
-            speechPhonemes,
-            phonemes,
-            [&weightMultiplier, &matchParameters](const int64_t*, const int64_t* targetPos) {
-                return matchParameters.SourceSkipWeight * weightMultiplier(targetPos);
-            },
-            [&weightMultiplier, &matchParameters](const int64_t*, const int64_t* targetPos) {
-                return matchParameters.TargetSkipWeight * weightMultiplier(targetPos);
-            },
-            [&weightMultiplier, &matchParameters](const int64_t* sourcePos, const int64_t* targetPos) {
-                return (*sourcePos == *targetPos ? matchParameters.SimilarScore : matchParameters.DifferentScore) * weightMultiplier(targetPos);
+        // Adaptive window starts small and grows only while nothing is found, within the cpu budget of the update
+        size_t window = maxWindow;
+        if (matchParameters.InitialLookAhead) {
+            window = std::min(std::max(AdaptiveLookAhead_, *matchParameters.InitialLookAhead), maxWindow);
+        }
+        size_t cells = 0;
+        while (true) {
+            auto phonemes = std::span<const TPhoneme>(Phonemes_.data() + CurrentPos_, window);
+            cells += speechPhonemes.size() * window;
+            if (MatchWindow(speechPhonemesBuffer, phonemes, matchParameters)) {
+                AdaptiveLookAhead_ = 0;
+                return;
             }
-        );
-
-        if (score < matchParameters.MinMatchWeight) {
-            return;
+            if (!matchParameters.InitialLookAhead || window >= maxWindow) {
+                break;
+            }
+            const size_t next = std::min(std::max(window + 1, (size_t)(window * matchParameters.LookAheadGrowth)), maxWindow);
+            if (cells + speechPhonemes.size() * next > matchParameters.MaxCellsPerUpdate) {
+                break;
+            }
+            window = next;
         }
+        // Speaker is probably further than the initial window, keep searching from where we stopped
+        AdaptiveLookAhead_ = window;
 
-        speechPhonemesBuffer.Match(speechPhonemesMatched.end() - speechPhonemes.begin());
-        CurrentPos_ += phonemesMatched.end() - phonemes.begin();
+        if (matchParameters.RelocationMinMatchWeight && window < Phonemes_.size()) {
+            Relocate(speechPhonemesBuffer, matchParameters);
+        }
     }
 
     size_t GetCurrentPos() const {
@@ -117,91 +175,186 @@ public:
 
     void SetCurrentPos(size_t pos) {
         CurrentPos_ = std::min<size_t>(pos, Phonemes_.size());
+        AdaptiveLookAhead_ = 0;
+    }
+
+    const std::shared_ptr<const TTokenizedScript>& GetScript() const {
+        return Script_;
+    }
+
+    /**
+     * Switches to another (edited) script, speech phonemes state is kept.
+     */
+    void SetScript(std::shared_ptr<const TTokenizedScript> script, size_t pos) {
+        Script_ = std::move(script);
+        Phonemes_ = Script_->GetPhonemes();
+        Index_ = &Script_->GetIndex();
+        CurrentPos_ = std::min<size_t>(pos, Phonemes_.size());
+        AdaptiveLookAhead_ = 0;
+        // New phonemes may be allocated right where the old ones were, so the key can't tell them apart
+        TargetKey_ = {};
     }
 
 private:
-    std::vector<int64_t> Phonemes_;
+    static std::shared_ptr<const TTokenizedScript> MakeScript(std::vector<TPhoneme> phonemes) {
+        TPhonemeOffsets offsets;
+        for (size_t i = 0; i < phonemes.size(); ++i) {
+            offsets.PushBack(i);
+        }
+        return TTokenizedScript::FromTokens({}, {}, std::move(phonemes), std::move(offsets));
+    }
+
+    bool MatchWindow(TSpeechPhonemesBuffer& speechPhonemesBuffer, std::span<const TPhoneme> phonemes, const TMatchParameters& matchParameters) {
+        auto speechPhonemes = speechPhonemesBuffer.GetUnmatched();
+
+        // Target profile is rebuilt only when window or scores change, otherwise alignment rows of
+        // previous calls are reused and only rows of changed speech phonemes are recomputed
+        const TProfiledSmithWaterman::TScores scores = {
+            .SimilarScore = matchParameters.SimilarScore,
+            .DifferentScore = matchParameters.DifferentScore,
+            .SourceSkipWeight = matchParameters.SourceSkipWeight,
+            .TargetSkipWeight = matchParameters.TargetSkipWeight,
+        };
+        const auto targetKey = std::tuple(phonemes.data(), phonemes.size(), matchParameters.FadeOverLookAhead, scores.SimilarScore, scores.DifferentScore, scores.SourceSkipWeight, scores.TargetSkipWeight);
+        if (targetKey != TargetKey_) {
+            // Slightly decrease weight at the end of lookahead window - prioritize closer matches
+            SmithWaterman_.SetTarget(phonemes, scores, [&phonemes, &matchParameters](size_t targetPos) {
+                return 1.0 - matchParameters.FadeOverLookAhead * (double)targetPos / (double)phonemes.size();
+            });
+            TargetKey_ = targetKey;
+        }
+
+        const auto [speechPhonemesMatched, phonemesMatched, score] = SmithWaterman_.Align(speechPhonemes, speechPhonemesBuffer.GetUnmatchedCommittedSize());
+
+        if (score < matchParameters.MinMatchWeight) {
+            return false;
+        }
+
+        speechPhonemesBuffer.Match(speechPhonemesMatched.end() - speechPhonemes.begin());
+        CurrentPos_ += phonemesMatched.end() - phonemes.begin();
+        return true;
+    }
+
+    /**
+     * Looks for the recent speech over the whole text when it is not found in the window, e.g. after a page skip.
+     * Only with RelocationMinMatchWeight set.
+     * Only regions seeded from the index are aligned, so the cost does not depend on text size.
+     */
+    void Relocate(TSpeechPhonemesBuffer& speechPhonemesBuffer, const TMatchParameters& matchParameters) {
+        constexpr size_t queryLength = 48;
+        constexpr size_t maxCandidates = 4;
+        constexpr size_t minHits = 3;
+        constexpr size_t maxDrift = 8;
+
+        auto speechPhonemes = speechPhonemesBuffer.GetUnmatched();
+        auto query = speechPhonemes.last(std::min(speechPhonemes.size(), queryLength));
+
+        const TProfiledSmithWaterman::TScores scores = {
+            .SimilarScore = matchParameters.SimilarScore,
+            .DifferentScore = matchParameters.DifferentScore,
+            .SourceSkipWeight = matchParameters.SourceSkipWeight,
+            .TargetSkipWeight = matchParameters.TargetSkipWeight,
+        };
+
+        double bestScore = *matchParameters.RelocationMinMatchWeight;
+        std::optional<std::pair<size_t, size_t>> best;
+        for (const TPhonemeIndex::TCandidate& candidate : Index_->FindCandidates(query, maxCandidates, minHits, maxDrift)) {
+            auto region = std::span<const TPhoneme>(Phonemes_.data() + candidate.Begin, Phonemes_.data() + candidate.End);
+            // No fade here: there is no preferred direction for a jump
+            RelocationSmithWaterman_.SetTarget(region, scores, [](size_t) {
+                return 1.0;
+            });
+            const auto [speechPhonemesMatched, phonemesMatched, score] = RelocationSmithWaterman_.Align(query);
+            if (score >= bestScore) {
+                bestScore = score;
+                best.emplace(speechPhonemesMatched.end() - speechPhonemes.begin(), phonemesMatched.data() + phonemesMatched.size() - Phonemes_.data());
+            }
+        }
+
+        if (!best) {
+            return;
+        }
+
+        speechPhonemesBuffer.Match(best->first);
+        CurrentPos_ = best->second;
+        // Speaker is found, reading goes on from the new position with the initial window
+        AdaptiveLookAhead_ = 0;
+    }
+
+private:
+    std::shared_ptr<const TTokenizedScript> Script_;
+    std::span<const TPhoneme> Phonemes_;
+    const TPhonemeIndex* Index_;
     size_t CurrentPos_ = 0;
+    size_t AdaptiveLookAhead_ = 0;
+    TProfiledSmithWaterman SmithWaterman_;
+    TProfiledSmithWaterman RelocationSmithWaterman_;
+    std::tuple<const TPhoneme*, size_t, double, double, double, double, double> TargetKey_;
 };
 
 class TWordsMatcher {
 public:
-    TWordsMatcher(const std::string& text, std::shared_ptr<IRecognizer> recognizer, std::shared_ptr<ITokenizer> tokenizer)
+    TWordsMatcher(std::shared_ptr<const TTokenizedScript> script, std::shared_ptr<IRecognizer> recognizer, size_t speechBufferCapacity = 1024)
         : Recognizer_(std::move(recognizer))
-        , Tokenizer_(std::move(tokenizer))
-        , SpeechPhonemesBuffer_(std::make_unique<TSpeechPhonemesBuffer>())
+        , SpeechPhonemesBuffer_(std::make_unique<TSpeechPhonemesBuffer>(speechBufferCapacity))
+        , PhonemesMatcher_(std::make_unique<TPhonemesMatcher>(script))
+        , PhonemeIndexToTextIndex_(script->GetOffsets())
     {
-        std::vector<int64_t> phones;
-        std::vector<size_t> phoneToWord;
-        Tokenizer_->Apply(text, &phones, &phoneToWord);
+    }
 
-        PhonemesMatcher_ = std::make_unique<TPhonemesMatcher>(std::move(phones));
-        PhonemeIndexToTextIndex_ = std::move(phoneToWord);
+    TWordsMatcher(const std::string& text, std::shared_ptr<IRecognizer> recognizer, std::shared_ptr<ITokenizer> tokenizer, size_t speechBufferCapacity = 1024)
+        : TWordsMatcher(TTokenizedScript::FromText(text, *tokenizer), std::move(recognizer), speechBufferCapacity)
+    {
     }
 
     void AcceptWaveform(const float* data, size_t dataSize, int32_t sampleRate) {
-        std::vector<int64_t> phonemes;
-        bool shouldCommit = Recognizer_->Update(data, dataSize, sampleRate, &phonemes);
-        SpeechPhonemesBuffer_->Update(phonemes);
-
-        TPhonemesMatcher::TMatchParameters matchParameters = MatchParameters_;
-        if (matchParameters.LookAhead) {
-            size_t currentPos = PhonemesMatcher_->GetCurrentPos();
-            if (currentPos < PhonemeIndexToTextIndex_.size()) {
-                auto it = std::upper_bound(
-                    PhonemeIndexToTextIndex_.begin() + currentPos,
-                    PhonemeIndexToTextIndex_.end(),
-                    PhonemeIndexToTextIndex_[currentPos] + matchParameters.LookAhead.value()
-                );
-                if (it != PhonemeIndexToTextIndex_.end()) {
-                    // Convert N-characters to N-phonemes lookahead
-                    matchParameters.LookAhead = it - (PhonemeIndexToTextIndex_.begin() + currentPos);
-                }
-            }
-        }
-
-        PhonemesMatcher_->Match(*SpeechPhonemesBuffer_, matchParameters);
+        AcceptPhonemes(Recognizer_->Update(data, dataSize, sampleRate, &RecognizedPhonemes_));
+    }
 
-        if (shouldCommit) {
-            SpeechPhonemesBuffer_->Commit();
-        }
+    void AcceptWaveform(const int16_t* data, size_t dataSize, int32_t sampleRate) {
+        AcceptPhonemes(Recognizer_->Update(data, dataSize, sampleRate, &RecognizedPhonemes_));
     }
 
     void SetCurrentPos(size_t pos) {
         Recognizer_->Reset();
         SpeechPhonemesBuffer_->Reset();
 
-        if (PhonemeIndexToTextIndex_.empty() || PhonemeIndexToTextIndex_.back() < pos) {
-            PhonemesMatcher_->SetCurrentPos(PhonemeIndexToTextIndex_.size());
+        if (PhonemeIndexToTextIndex_.Empty() || PhonemeIndexToTextIndex_.Back() < pos) {
+            PhonemesMatcher_->SetCurrentPos(PhonemeIndexToTextIndex_.Size());
             return;
         }
 
-        auto range = std::equal_range(PhonemeIndexToTextIndex_.begin(), PhonemeIndexToTextIndex_.end(), pos, [](auto& w, auto& p) {
-            return w < p;
-        });
-        if (range.first == range.second) {
+        const size_t index = PhonemeIndexToTextIndex_.LowerBound(0, pos);
+        if (PhonemeIndexToTextIndex_[index] != pos) {
             return;
         }
 
-        auto it = std::lower_bound(range.first, range.second, pos);
-        if (it == range.second) {
-            return;
-        }
-
-        PhonemesMatcher_->SetCurrentPos(it - PhonemeIndexToTextIndex_.begin());
+        PhonemesMatcher_->SetCurrentPos(index);
     }
 
     size_t GetCurrentPos() const {
-        if (PhonemeIndexToTextIndex_.empty()) {
+        if (PhonemeIndexToTextIndex_.Empty()) {
             return 0;
         }
         size_t pos = PhonemesMatcher_->GetCurrentPos();
-        if (pos >= PhonemeIndexToTextIndex_.size()) {
-            return PhonemeIndexToTextIndex_.back() + 1;
+        if (pos >= PhonemeIndexToTextIndex_.Size()) {
+            return PhonemeIndexToTextIndex_.Back() + 1;
         }
         return PhonemeIndexToTextIndex_[pos];
     }
 
+    const std::shared_ptr<const TTokenizedScript>& GetScript() const {
+        return PhonemesMatcher_->GetScript();
+    }
+
+    /**
+     * Switches to an edited script keeping recognizer and speech state, textPos is the position in the new text.
+     */
+    void SetScript(std::shared_ptr<const TTokenizedScript> script, size_t textPos) {
+        PhonemeIndexToTextIndex_ = script->GetOffsets();
+        PhonemesMatcher_->SetScript(std::move(script), PhonemeIndexToTextIndex_.LowerBound(0, textPos));
+    }
+
     void SetMatchParameters(const TPhonemesMatcher::TMatchParameters& matchParameters) {
         MatchParameters_ = matchParameters;
     }
@@ -210,15 +363,49 @@ public:
         return MatchParameters_;
     }
 
+    const TSpeechPhonemesBuffer::TStats& GetSpeechBufferStats() const {
+        return SpeechPhonemesBuffer_->GetStats();
+    }
+
+private:
+    void AcceptPhonemes(bool shouldCommit) {
+        SpeechPhonemesBuffer_->Update(RecognizedPhonemes_);
+
+        TPhonemesMatcher::TMatchParameters matchParameters = MatchParameters_;
+        if (matchParameters.LookAhead) {
+            matchParameters.LookAhead = CharsToPhonemes(*matchParameters.LookAhead);
+        }
+        if (matchParameters.InitialLookAhead) {
+            matchParameters.InitialLookAhead = CharsToPhonemes(*matchParameters.InitialLookAhead);
+        }
+
+        PhonemesMatcher_->Match(*SpeechPhonemesBuffer_, matchParameters);
+
+        if (shouldCommit) {
+            SpeechPhonemesBuffer_->Commit();
+        }
+    }
+
+    // Converts N-characters to N-phonemes lookahead from the current position
+    size_t CharsToPhonemes(size_t chars) const {
+        const size_t currentPos = PhonemesMatcher_->GetCurrentPos();
+        if (currentPos >= PhonemeIndexToTextIndex_.Size()) {
+            return 0;
+        }
+        return PhonemeIndexToTextIndex_.UpperBound(currentPos, PhonemeIndexToTextIndex_[currentPos] + chars) - currentPos;
+    }
+
 private:
     TPhonemesMatcher::TMatchParameters MatchParameters_;
 
     std::shared_ptr<IRecognizer> Recognizer_;
-    std::shared_ptr<ITokenizer> Tokenizer_;
+    // Reused between updates, so feeding audio does not allocate once it is large enough
+    std::vector<TPhoneme> RecognizedPhonemes_;
 
     std::unique_ptr<TSpeechPhonemesBuffer> SpeechPhonemesBuffer_;
+    // Script is kept alive by the phonemes matcher
     std::unique_ptr<TPhonemesMatcher> PhonemesMatcher_;
-    std::vector<size_t> PhonemeIndexToTextIndex_;
+    TPhonemeOffsetsView PhonemeIndexToTextIndex_;
 };
 
 } // namespace NTruePrompter::NRecognition
@@ -23,7 +23,7 @@ public:
             : Parent_(parent)
         {}
 
-        bool Update(const float* data, size_t dataSize, int32_t sampleRate, std::vector<int64_t>* tokensOut) override {
+        bool Update(const float* data, size_t dataSize, int32_t sampleRate, std::vector<TPhoneme>* tokensOut) override {
             double mean = 0.0;
             double variance = 0.0;
             for (size_t i = 0; i < dataSize; ++i) {
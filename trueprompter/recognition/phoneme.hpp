@@ -0,0 +1,213 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+
+namespace NTruePrompter::NRecognition {
+
+/**
+ * Phoneme id in the tokenizer (Phonetisaurus) symbol table.
+ */
+using TPhoneme = uint16_t;
+
+/**
+ * Non-decreasing sequence of phoneme text offsets, about 2.25 bytes per phoneme.
+ * Offsets are stored in blocks of BlockSize as uint16 deltas from the block base with O(1) random access.
+ * Blocks spanning more than uint16 range of text (huge runs of non-word symbols) keep full values aside.
+ * The view does not own its arrays, they live in TPhonemeOffsets or in a mapped file.
+ */
+class TPhonemeOffsetsView {
+public:
+    static constexpr size_t BlockSize = 64;
+
+    struct TBlock {
+        uint64_t Base;
+        // Index of the first full value of the block, NoWide if the block keeps deltas
+        uint64_t Wide;
+    };
+
+    static constexpr uint64_t NoWide = std::numeric_limits<uint64_t>::max();
+
+    TPhonemeOffsetsView() = default;
+
+    // Deltas hold BlockSize values for every one of BlocksCount(size) blocks, including the last one
+    TPhonemeOffsetsView(const TBlock* blocks, const uint16_t* deltas, const uint64_t* wideValues, size_t wideValuesCount, size_t size)
+        : Blocks_(blocks)
+        , Deltas_(deltas)
+        , WideValues_(wideValues)
+        , WideValuesCount_(wideValuesCount)
+        , Size_(size)
+    {}
+
+    static size_t BlocksCount(size_t size) {
+        return (size + BlockSize - 1) / BlockSize;
+    }
+
+    size_t operator[](size_t i) const {
+        const TBlock& block = Blocks_[i / BlockSize];
+        if (block.Wide != NoWide) {
+            return WideValues_[block.Wide + i % BlockSize];
+        }
+        return block.Base + Deltas_[i];
+    }
+
+    size_t Size() const {
+        return Size_;
+    }
+
+    bool Empty() const {
+        return Size_ == 0;
+    }
+
+    size_t Back() const {
+        return (*this)[Size_ - 1];
+    }
+
+    // First index in [from, Size()) with offset greater than value, Size() if none
+    size_t UpperBound(size_t from, size_t value) const {
+        return PartitionPoint(from, [value](size_t offset) {
+            return offset <= value;
+        });
+    }
+
+    // First index in [from, Size()) with offset not less than value, Size() if none
+    size_t LowerBound(size_t from, size_t value) const {
+        return PartitionPoint(from, [value](size_t offset) {
+            return offset < value;
+        });
+    }
+
+    std::pair<size_t, size_t> EqualRange(size_t from, size_t value) const {
+        const size_t lower = LowerBound(from, value);
+        return { lower, UpperBound(lower, value) };
+    }
+
+    const TBlock* GetBlocks() const {
+        return Blocks_;
+    }
+
+    const uint16_t* GetDeltas() const {
+        return Deltas_;
+    }
+
+    const uint64_t* GetWideValues() const {
+        return WideValues_;
+    }
+
+    size_t GetWideValuesCount() const {
+        return WideValuesCount_;
+    }
+
+private:
+    template<typename TPredicate>
+    size_t PartitionPoint(size_t from, TPredicate&& predicate) const {
+        if (from >= Size_) {
+            return Size_;
+        }
+
+        // Block bases are the first offsets of blocks, so the point is inside the last block whose base still passes
+        const size_t firstBlock = from / BlockSize;
+        auto it = std::partition_point(Blocks_ + firstBlock + 1, Blocks_ + BlocksCount(Size_), [&predicate](const TBlock& block) {
+            return predicate(block.Base);
+        });
+        const size_t block = it - Blocks_ - 1;
+
+        size_t begin = std::max(from, block * BlockSize);
+        size_t end = std::min(Size_, (block + 1) * BlockSize);
+        while (begin < end) {
+            const size_t middle = begin + (end - begin) / 2;
+            if (predicate((*this)[middle])) {
+                begin = middle + 1;
+            } else {
+                end = middle;
+            }
+        }
+        return begin;
+    }
+
+private:
+    const TBlock* Blocks_ = nullptr;
+    const uint16_t* Deltas_ = nullptr;
+    const uint64_t* WideValues_ = nullptr;
+    size_t WideValuesCount_ = 0;
+    size_t Size_ = 0;
+};
+
+/**
+ * Owning, appendable TPhonemeOffsetsView storage.
+ */
+class TPhonemeOffsets {
+public:
+    static constexpr size_t BlockSize = TPhonemeOffsetsView::BlockSize;
+
+    TPhonemeOffsetsView View() const {
+        return TPhonemeOffsetsView(Blocks_.data(), Deltas_.data(), WideValues_.data(), WideValues_.size(), Size_);
+    }
+
+    size_t operator[](size_t i) const {
+        return View()[i];
+    }
+
+    size_t Size() const {
+        return Size_;
+    }
+
+    bool Empty() const {
+        return Size_ == 0;
+    }
+
+    size_t Back() const {
+        return View().Back();
+    }
+
+    void PushBack(size_t value) {
+        if (Size_ > 0 && value < Back()) {
+            throw std::runtime_error("Phoneme offsets must be non-decreasing");
+        }
+
+        if (Size_ % BlockSize == 0) {
+            Blocks_.push_back({ value, TPhonemeOffsetsView::NoWide });
+            Deltas_.resize(Deltas_.size() + BlockSize);
+        }
+
+        TPhonemeOffsetsView::TBlock& block = Blocks_.back();
+        if (block.Wide == TPhonemeOffsetsView::NoWide && value - block.Base > std::numeric_limits<uint16_t>::max()) {
+            // Only the last block can grow, so its full values are always at the end
+            block.Wide = WideValues_.size();
+            for (size_t i = Size_ - Size_ % BlockSize; i < Size_; ++i) {
+                WideValues_.push_back(block.Base + Deltas_[i]);
+            }
+        }
+        if (block.Wide != TPhonemeOffsetsView::NoWide) {
+            WideValues_.push_back(value);
+        } else {
+            Deltas_[Size_] = (uint16_t)(value - block.Base);
+        }
+        ++Size_;
+    }
+
+    void Clear() {
+        Blocks_.clear();
+        Deltas_.clear();
+        WideValues_.clear();
+        Size_ = 0;
+    }
+
+    void ShrinkToFit() {
+        Blocks_.shrink_to_fit();
+        Deltas_.shrink_to_fit();
+        WideValues_.shrink_to_fit();
+    }
+
+private:
+    std::vector<TPhonemeOffsetsView::TBlock> Blocks_;
+    std::vector<uint16_t> Deltas_;
+    std::vector<uint64_t> WideValues_;
+    size_t Size_ = 0;
+};
+
+} // namespace NTruePrompter::NRecognition
@@ -0,0 +1,124 @@
+#include "phoneme_index.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <limits>
+#include <stdexcept>
+
+
+namespace NTruePrompter::NRecognition {
+
+TPhonemeIndex::TPhonemeIndex(std::span<const TPhoneme> phonemes, size_t k, size_t maxOccurrences)
+    : Phonemes_(phonemes)
+    , K_(std::max<size_t>(k, 1))
+    , MaxOccurrences_(maxOccurrences)
+{
+    if (phonemes.size() > std::numeric_limits<uint32_t>::max()) {
+        throw std::runtime_error("Too many phonemes to index");
+    }
+
+    const size_t kmers = phonemes.size() >= K_ ? phonemes.size() - K_ + 1 : 0;
+    const size_t buckets = std::bit_ceil(std::max<size_t>(kmers, 1));
+    BucketMask_ = buckets - 1;
+
+    // Counting sort of k-mer positions into buckets
+    BucketOffsets_.assign(buckets + 1, 0);
+    for (size_t pos = 0; pos < kmers; ++pos) {
+        ++BucketOffsets_[(Hash(phonemes.data() + pos) & BucketMask_) + 1];
+    }
+    for (size_t bucket = 0; bucket < buckets; ++bucket) {
+        BucketOffsets_[bucket + 1] += BucketOffsets_[bucket];
+    }
+    Positions_.resize(kmers);
+    std::vector<uint32_t> fill(BucketOffsets_.begin(), BucketOffsets_.end() - 1);
+    for (size_t pos = 0; pos < kmers; ++pos) {
+        Positions_[fill[Hash(phonemes.data() + pos) & BucketMask_]++] = (uint32_t)pos;
+    }
+
+    // Group equal k-mers inside buckets and drop the too frequent ones
+    auto less = [this](uint32_t a, uint32_t b) {
+        const TPhoneme* lhs = Phonemes_.data() + a;
+        const TPhoneme* rhs = Phonemes_.data() + b;
+        const auto [lhsEnd, rhsEnd] = std::mismatch(lhs, lhs + K_, rhs);
+        return lhsEnd != lhs + K_ ? *lhsEnd < *rhsEnd : a < b;
+    };
+    auto equal = [this](uint32_t a, uint32_t b) {
+        return std::equal(Phonemes_.data() + a, Phonemes_.data() + a + K_, Phonemes_.data() + b);
+    };
+    size_t out = 0;
+    for (size_t bucket = 0; bucket < buckets; ++bucket) {
+        const size_t begin = BucketOffsets_[bucket];
+        const size_t end = BucketOffsets_[bucket + 1];
+        BucketOffsets_[bucket] = (uint32_t)out;
+        std::sort(Positions_.begin() + begin, Positions_.begin() + end, less);
+        for (size_t group = begin; group < end; ) {
+            size_t groupEnd = group + 1;
+            while (groupEnd < end && equal(Positions_[group], Positions_[groupEnd])) {
+                ++groupEnd;
+            }
+            if (groupEnd - group <= MaxOccurrences_) {
+                out = std::copy(Positions_.begin() + group, Positions_.begin() + groupEnd, Positions_.begin() + out) - Positions_.begin();
+            }
+            group = groupEnd;
+        }
+    }
+    BucketOffsets_[buckets] = (uint32_t)out;
+    Positions_.resize(out);
+    Positions_.shrink_to_fit();
+}
+
+uint64_t TPhonemeIndex::Hash(const TPhoneme* kmer) const {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < K_; ++i) {
+        hash = (hash ^ (uint64_t)kmer[i]) * 1099511628211ull;
+    }
+    return hash ^ (hash >> 29);
+}
+
+std::vector<TPhonemeIndex::TCandidate> TPhonemeIndex::FindCandidates(std::span<const TPhoneme> query, size_t maxCandidates, size_t minHits, size_t maxDrift) const {
+    std::vector<TCandidate> candidates;
+    if (query.size() < K_ || Positions_.empty()) {
+        return candidates;
+    }
+
+    // Seed hits as diagonals
+    std::vector<int64_t> diagonals;
+    for (size_t queryPos = 0; queryPos + K_ <= query.size(); ++queryPos) {
+        const uint64_t bucket = Hash(query.data() + queryPos) & BucketMask_;
+        for (size_t i = BucketOffsets_[bucket]; i < BucketOffsets_[bucket + 1]; ++i) {
+            const uint32_t pos = Positions_[i];
+            if (std::equal(query.data() + queryPos, query.data() + queryPos + K_, Phonemes_.data() + pos)) {
+                diagonals.push_back((int64_t)pos - (int64_t)queryPos);
+            }
+        }
+    }
+    std::sort(diagonals.begin(), diagonals.end());
+
+    // Chains of close diagonals are one candidate alignment
+    for (size_t begin = 0; begin < diagonals.size(); ) {
+        size_t end = begin + 1;
+        while (end < diagonals.size() && diagonals[end] - diagonals[end - 1] <= (int64_t)maxDrift) {
+            ++end;
+        }
+        if (end - begin >= minHits) {
+            const int64_t first = diagonals[begin] - (int64_t)maxDrift;
+            const int64_t last = diagonals[end - 1] + (int64_t)query.size() + (int64_t)maxDrift;
+            candidates.push_back({
+                .Begin = (size_t)std::max<int64_t>(first, 0),
+                .End = (size_t)std::min<int64_t>(last, (int64_t)Phonemes_.size()),
+                .Hits = end - begin,
+            });
+        }
+        begin = end;
+    }
+
+    std::stable_sort(candidates.begin(), candidates.end(), [](const TCandidate& a, const TCandidate& b) {
+        return a.Hits > b.Hits;
+    });
+    if (candidates.size() > maxCandidates) {
+        candidates.resize(maxCandidates);
+    }
+    return candidates;
+}
+
+} // namespace NTruePrompter::NRecognition
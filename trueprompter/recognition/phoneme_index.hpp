@@ -0,0 +1,53 @@
+#pragma once
+
+#include "phoneme.hpp"
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+
+namespace NTruePrompter::NRecognition {
+
+/**
+ * K-mer index over script phonemes for seed-and-extend relocation.
+ * Positions of every k-mer are kept in hash buckets laid out as one flat array (CSR),
+ * lookups verify the actual phonemes, so bucket collisions never produce false seeds.
+ * Indexed phonemes must outlive the index.
+ */
+class TPhonemeIndex {
+public:
+    struct TCandidate {
+        // Script region [Begin, End) to run alignment in
+        size_t Begin = 0;
+        size_t End = 0;
+        size_t Hits = 0;
+    };
+
+    explicit TPhonemeIndex(std::span<const TPhoneme> phonemes, size_t k = 5, size_t maxOccurrences = 64);
+
+    /**
+     * Seeds query k-mers and groups hits by alignment diagonal (script position - query position),
+     * allowing diagonals to drift by maxDrift to tolerate insertions and deletions.
+     * Returns at most maxCandidates regions with at least minHits seeds, most hits first.
+     */
+    std::vector<TCandidate> FindCandidates(std::span<const TPhoneme> query, size_t maxCandidates, size_t minHits, size_t maxDrift) const;
+
+    size_t GetK() const {
+        return K_;
+    }
+
+private:
+    uint64_t Hash(const TPhoneme* kmer) const;
+
+private:
+    std::span<const TPhoneme> Phonemes_;
+    size_t K_;
+    // K-mers more frequent than this carry no position information and are not indexed
+    size_t MaxOccurrences_;
+    uint64_t BucketMask_ = 0;
+    std::vector<uint32_t> BucketOffsets_;
+    std::vector<uint32_t> Positions_;
+};
+
+} // namespace NTruePrompter::NRecognition
@@ -1,5 +1,8 @@
 #pragma once
 
+#include "phoneme.hpp"
+
+#include <cstdint>
 #include <memory>
 #include <string>
 #include <vector>
@@ -8,15 +11,66 @@
 
 namespace NTruePrompter::NRecognition {
 
+/**
+ * Trade-off between speech to tokens latency and CPU per second of audio, fixed for the recognizer lifetime.
+ */
+enum class ELatencyProfile {
+    Balanced,
+    // Smaller chunks and shorter delays, for live shows
+    Live,
+    // Larger chunks, fewer decoding steps per second of audio, for rehearsals
+    Rehearsal,
+};
+
 class IRecognizer {
 public:
-    virtual bool Update(const float* data, size_t dataSize, int32_t sampleRate, std::vector<int64_t>* tokensOut) = 0;
+    /**
+     * Feeds samples in [-1, 1] and replaces tokensOut with phonemes of the current utterance.
+     * Returns true if the utterance is over and its phonemes won't change anymore.
+     */
+    virtual bool Update(const float* data, size_t dataSize, int32_t sampleRate, std::vector<TPhoneme>* tokensOut) = 0;
+
+    // 16-bit samples, converted to float unless a recognizer takes them as is
+    virtual bool Update(const int16_t* data, size_t dataSize, int32_t sampleRate, std::vector<TPhoneme>* tokensOut) {
+        std::vector<float> samples(dataSize);
+        for (size_t i = 0; i < dataSize; ++i) {
+            samples[i] = data[i] / 32767.0f;
+        }
+        return Update(samples.data(), dataSize, sampleRate, tokensOut);
+    }
+
     virtual void Reset() = 0;
+
+    /**
+     * Trades accuracy for speed on loaded servers, 0 is the most accurate decoding and the default.
+     * Levels over GetMaxDecodingLevel() are clamped, recognizer may apply a new level from the next utterance only.
+     */
+    virtual void SetDecodingLevel(size_t /*level*/) {
+    }
+
+    virtual size_t GetMaxDecodingLevel() const {
+        return 0;
+    }
+
+    /**
+     * Accepted audio not reflected in tokensOut yet, in seconds. Silence a recognizer skips is not counted.
+     */
+    virtual double GetUndecodedSeconds() const {
+        return 0;
+    }
+
+    /**
+     * Brings the recognizer to the state of a new one of the same factory call, so that it serves another session.
+     * Caches may be kept. Returns false if the recognizer can't be reused.
+     */
+    virtual bool Recycle() {
+        return false;
+    }
 };
 
 class IRecognizerFactory {
 public:
-    virtual std::shared_ptr<IRecognizer> New(const std::string& modelName) const = 0;
+    virtual std::shared_ptr<IRecognizer> New(const std::string& modelName, ELatencyProfile latencyProfile) const = 0;
 };
 
 } // NTruePrompter::NRecognition
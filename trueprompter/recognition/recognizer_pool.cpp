@@ -0,0 +1,125 @@
+#include "recognizer_pool.hpp"
+
+#include <optional>
+
+
+namespace NTruePrompter::NRecognition {
+
+TRecognizerPool::TRecognizerPool(std::shared_ptr<IRecognizerFactory> factory, size_t size)
+    : Factory_(std::move(factory))
+    , Size_(size)
+    , Thread_([this]() {
+        Run();
+    })
+{}
+
+TRecognizerPool::~TRecognizerPool() {
+    {
+        std::lock_guard<std::mutex> guard(Mutex_);
+        Stopped_ = true;
+    }
+    Changed_.notify_one();
+    Thread_.join();
+}
+
+void TRecognizerPool::Prepare(const std::string& modelName, ELatencyProfile latencyProfile) {
+    {
+        std::lock_guard<std::mutex> guard(Mutex_);
+        Free_.try_emplace(TKey(modelName, latencyProfile));
+    }
+    Changed_.notify_one();
+}
+
+std::shared_ptr<IRecognizer> TRecognizerPool::New(const std::string& modelName, ELatencyProfile latencyProfile) const {
+    TKey key(modelName, latencyProfile);
+    std::shared_ptr<IRecognizer> recognizer;
+    {
+        std::lock_guard<std::mutex> guard(Mutex_);
+        auto& free = Free_[key];
+        if (!free.empty()) {
+            recognizer = std::move(free.back());
+            free.pop_back();
+        }
+    }
+    // Refill starts as soon as the pool goes below its size
+    Changed_.notify_one();
+
+    if (!recognizer) {
+        recognizer = Factory_->New(modelName, latencyProfile);
+    }
+
+    IRecognizer* raw = recognizer.get();
+    return std::shared_ptr<IRecognizer>(raw, [pool = weak_from_this(), key = std::move(key), recognizer = std::move(recognizer)](IRecognizer*) mutable {
+        if (auto locked = pool.lock()) {
+            locked->Return(key, std::move(recognizer));
+        }
+    });
+}
+
+// Recycling may be as slow as construction, so it is done by the pool thread rather than the one dropping the recognizer
+void TRecognizerPool::Return(const TKey& key, std::shared_ptr<IRecognizer> recognizer) const {
+    {
+        std::lock_guard<std::mutex> guard(Mutex_);
+        if (Stopped_) {
+            return;
+        }
+        Returned_.emplace_back(key, std::move(recognizer));
+    }
+    Changed_.notify_one();
+}
+
+void TRecognizerPool::Run() {
+    std::unique_lock<std::mutex> lock(Mutex_);
+    while (true) {
+        std::optional<TKey> refill;
+        Changed_.wait(lock, [&]() {
+            if (Stopped_ || !Returned_.empty()) {
+                return true;
+            }
+            for (const auto& [key, free] : Free_) {
+                if (free.size() < Size_) {
+                    refill = key;
+                    return true;
+                }
+            }
+            return false;
+        });
+        if (Stopped_) {
+            return;
+        }
+
+        // Recognizers are built and recycled without the lock, New keeps serving meanwhile
+        if (!Returned_.empty()) {
+            auto [key, recognizer] = std::move(Returned_.front());
+            Returned_.pop_front();
+            if (Free_[key].size() >= Size_) {
+                lock.unlock();
+                recognizer.reset();
+                lock.lock();
+                continue;
+            }
+            lock.unlock();
+            const bool recycled = recognizer->Recycle();
+            lock.lock();
+            if (recycled) {
+                Free_[key].push_back(std::move(recognizer));
+            }
+            continue;
+        }
+
+        lock.unlock();
+        std::shared_ptr<IRecognizer> recognizer;
+        try {
+            recognizer = Factory_->New(refill->first, refill->second);
+        } catch (...) {
+            // Unknown model, New will throw to the session on its own
+            lock.lock();
+            Free_.erase(*refill);
+            continue;
+        }
+        lock.lock();
+        Free_[*refill].push_back(std::move(recognizer));
+    }
+}
+
+} // namespace NTruePrompter::NRecognition
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "recognizer.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+
+namespace NTruePrompter::NRecognition {
+
+/**
+ * Recognizers of another factory built ahead of time, so sessions don't wait for construction and start with warm caches.
+ * Recognizers come back when their last user drops them, are recycled by IRecognizer::Recycle and handed out again.
+ * A background thread recycles returned recognizers and refills every model and profile ever requested up to the pool size,
+ * an empty pool builds on the caller thread. Safe to share between threads, must be owned by a shared_ptr.
+ */
+class TRecognizerPool : public IRecognizerFactory, public std::enable_shared_from_this<TRecognizerPool> {
+public:
+    TRecognizerPool(std::shared_ptr<IRecognizerFactory> factory, size_t size);
+    ~TRecognizerPool();
+
+    // Starts filling the pool of the model and profile, doesn't wait for it
+    void Prepare(const std::string& modelName, ELatencyProfile latencyProfile);
+
+    std::shared_ptr<IRecognizer> New(const std::string& modelName, ELatencyProfile latencyProfile) const override;
+
+private:
+    using TKey = std::pair<std::string, ELatencyProfile>;
+
+    void Return(const TKey& key, std::shared_ptr<IRecognizer> recognizer) const;
+    void Run();
+
+private:
+    std::shared_ptr<IRecognizerFactory> Factory_;
+    size_t Size_;
+
+    mutable std::mutex Mutex_;
+    mutable std::condition_variable Changed_;
+    mutable std::map<TKey, std::vector<std::shared_ptr<IRecognizer>>> Free_;
+    mutable std::deque<std::pair<TKey, std::shared_ptr<IRecognizer>>> Returned_;
+    bool Stopped_ = false;
+    std::thread Thread_;
+};
+
+} // namespace NTruePrompter::NRecognition
@@ -0,0 +1,61 @@
+#include "script_cache.hpp"
+
+#include <cstdio>
+#include <stdexcept>
+
+
+namespace NTruePrompter::NRecognition {
+
+TScriptCache::TScriptCache(std::optional<std::filesystem::path> dir)
+    : Dir_(std::move(dir))
+{}
+
+std::shared_ptr<const TTokenizedScript> TScriptCache::Find(const std::string& language, const std::string& text, const std::string& tokenizerId) const {
+    if (!Dir_) {
+        return nullptr;
+    }
+
+    const std::filesystem::path path = GetPath(language, HashScriptText(text));
+    std::error_code ec;
+    if (!std::filesystem::is_regular_file(path, ec)) {
+        return nullptr;
+    }
+
+    std::shared_ptr<const TTokenizedScript> script;
+    try {
+        script = TTokenizedScript::Load(path);
+    } catch (const std::exception&) {
+        return nullptr;
+    }
+    // Texts are compared as a whole, colliding hashes must never hand out another text's phonemes
+    if (script->GetTokenizerId() != tokenizerId || script->GetText() != text) {
+        return nullptr;
+    }
+    return script;
+}
+
+void TScriptCache::Store(const std::string& language, const TTokenizedScript& script) const {
+    if (!Dir_) {
+        return;
+    }
+
+    const std::filesystem::path path = GetPath(language, script.GetTextHash());
+    std::filesystem::create_directories(path.parent_path());
+    script.Save(path);
+}
+
+std::filesystem::path TScriptCache::GetPath(const std::string& language, uint64_t textHash) const {
+    if (!Dir_) {
+        throw std::runtime_error("Script cache has no directory");
+    }
+    // Language comes from clients, it must stay a single path component inside the cache
+    if (language.empty() || language == "." || language == ".." || language.find('/') != std::string::npos) {
+        throw std::runtime_error("Bad script language " + language);
+    }
+
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.tps", (unsigned long long)textHash);
+    return *Dir_ / language / name;
+}
+
+} // namespace NTruePrompter::NRecognition
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "tokenized_script.hpp"
+
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <string>
+
+
+namespace NTruePrompter::NRecognition {
+
+/**
+ * Directory of tokenized script files, dir/<language>/<text hash>.tps, safe to share between threads.
+ * Without a directory nothing is ever found or stored.
+ */
+class TScriptCache {
+public:
+    explicit TScriptCache(std::optional<std::filesystem::path> dir = std::nullopt);
+
+    /**
+     * Maps the saved script of the text, nullptr if there is none or it was made by another tokenizer.
+     * Unreadable files are treated as missing, the next Store overwrites them.
+     */
+    std::shared_ptr<const TTokenizedScript> Find(const std::string& language, const std::string& text, const std::string& tokenizerId) const;
+
+    void Store(const std::string& language, const TTokenizedScript& script) const;
+
+    std::filesystem::path GetPath(const std::string& language, uint64_t textHash) const;
+
+private:
+    std::optional<std::filesystem::path> Dir_;
+};
+
+} // namespace NTruePrompter::NRecognition
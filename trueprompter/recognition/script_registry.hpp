@@ -0,0 +1,114 @@
+#pragma once
+
+#include "tokenized_script.hpp"
+
+#include <algorithm>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+
+
+namespace NTruePrompter::NRecognition {
+
+/**
+ * Interns tokenized scripts in memory, so sessions reading the same script share one copy of it and its index.
+ * Scripts are held weakly and die with their last user, memory scales with distinct scripts in use.
+ * Concurrent requests for the same script wait for a single creation, safe to share between threads.
+ */
+class TScriptRegistry {
+public:
+    struct TStats {
+        uint64_t Hits = 0;
+        uint64_t Misses = 0;
+        // Scripts alive at the moment
+        size_t Size = 0;
+    };
+
+    /**
+     * Returns the live script of the text or the one made by create(), which is called without the lock held.
+     * Script made by create() must be of the same text and tokenizer id.
+     */
+    template<typename TCreate>
+    std::shared_ptr<const TTokenizedScript> GetOrCreate(const std::string& language, const std::string& text, const std::string& tokenizerId, TCreate&& create) {
+        const TKey key(language, tokenizerId, HashScriptText(text));
+
+        std::unique_lock<std::mutex> lock(Mutex_);
+        if (auto it = Scripts_.find(key); it != Scripts_.end()) {
+            if (auto script = it->second.lock(); script && script->GetText() == text) {
+                ++Hits_;
+                return script;
+            }
+        }
+        if (auto it = Pending_.find(key); it != Pending_.end()) {
+            auto pending = it->second;
+            lock.unlock();
+            auto script = pending.get();
+            if (script->GetText() == text) {
+                std::lock_guard<std::mutex> guard(Mutex_);
+                ++Hits_;
+                return script;
+            }
+            // Colliding text hash, such scripts are rare enough to just stay private
+            return create();
+        }
+
+        ++Misses_;
+        std::promise<std::shared_ptr<const TTokenizedScript>> promise;
+        Pending_.emplace(key, promise.get_future().share());
+        lock.unlock();
+
+        std::shared_ptr<const TTokenizedScript> script;
+        try {
+            script = create();
+        } catch (...) {
+            lock.lock();
+            Pending_.erase(key);
+            lock.unlock();
+            promise.set_exception(std::current_exception());
+            throw;
+        }
+
+        lock.lock();
+        Pending_.erase(key);
+        Scripts_[key] = script;
+        // Amortized cleanup of dead entries, so the map does not grow with every script ever seen
+        if (Scripts_.size() >= SweepSize_) {
+            std::erase_if(Scripts_, [](const auto& entry) {
+                return entry.second.expired();
+            });
+            SweepSize_ = std::max<size_t>(Scripts_.size() * 2, MinSweepSize);
+        }
+        lock.unlock();
+        promise.set_value(script);
+        return script;
+    }
+
+    TStats GetStats() const {
+        std::lock_guard<std::mutex> guard(Mutex_);
+        TStats stats;
+        stats.Hits = Hits_;
+        stats.Misses = Misses_;
+        for (const auto& [key, script] : Scripts_) {
+            stats.Size += !script.expired();
+        }
+        return stats;
+    }
+
+private:
+    static constexpr size_t MinSweepSize = 64;
+
+    // Language, tokenizer id and text hash
+    using TKey = std::tuple<std::string, std::string, uint64_t>;
+
+    mutable std::mutex Mutex_;
+    std::map<TKey, std::weak_ptr<const TTokenizedScript>> Scripts_;
+    std::map<TKey, std::shared_future<std::shared_ptr<const TTokenizedScript>>> Pending_;
+    size_t SweepSize_ = MinSweepSize;
+    uint64_t Hits_ = 0;
+    uint64_t Misses_ = 0;
+};
+
+} // namespace NTruePrompter::NRecognition
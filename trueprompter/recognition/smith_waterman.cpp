@@ -0,0 +1,247 @@
+#include "smith_waterman.hpp"
+#include "smith_waterman_kernel.hpp"
+
+#include <cstring>
+#include <stdexcept>
+
+
+namespace NTruePrompter::NRecognition {
+
+namespace {
+
+// Single lane instantiation of the striped kernel: plain row by row DP with exact left moves
+struct TScalarTraits {
+    using TVector = int64_t;
+    using TValue = int64_t;
+    static constexpr size_t Lanes = 1;
+    static constexpr TValue MinValue = -(int64_t(1) << 62);
+
+    static TVector Load(const TValue* p) { return *p; }
+    static void Store(TValue* p, TVector v) { *p = v; }
+    static TVector Set1(TValue x) { return x; }
+    static TVector Zero() { return 0; }
+    static TVector Add(TVector a, TVector b) { return a + b; }
+    static TVector Max(TVector a, TVector b) { return std::max(a, b); }
+    static TVector CmpGt(TVector a, TVector b) { return a > b ? -1 : 0; }
+    static TVector CmpEq(TVector a, TVector b) { return a == b ? -1 : 0; }
+    static TVector AndNot(TVector a, TVector b) { return ~a & b; }
+    static TVector Or(TVector a, TVector b) { return a | b; }
+    static TVector Blend(TVector a, TVector b, TVector mask) { return mask ? b : a; }
+    static TVector ShiftUp(TVector) { return 0; }
+    static uint32_t MoveMask(TVector mask) { return mask ? 1 : 0; }
+    static bool Any(TVector mask) { return mask != 0; }
+};
+
+const NSmithWatermanKernel::TKernel ScalarKernel = {
+    TScalarTraits::Lanes, sizeof(TScalarTraits::TValue), 1, TScalarTraits::MinValue, -TScalarTraits::MinValue - 1, &NSmithWatermanKernel::AlignStriped<TScalarTraits>,
+};
+
+} // namespace
+
+TProfiledSmithWaterman::TProfiledSmithWaterman(EKernel kernel) {
+    if (kernel == EKernel::Scalar) {
+        return;
+    }
+
+#if defined(TRUEPROMPTER_SIMD_X86)
+    static const bool hasAvx2 = __builtin_cpu_supports("avx2");
+    static const bool hasSse41 = __builtin_cpu_supports("sse4.1");
+
+    if ((kernel == EKernel::Auto || kernel == EKernel::Avx2) && hasAvx2) {
+        Int16Kernel_ = &NSmithWatermanKernel::Int16Avx2Kernel;
+        Int32Kernel_ = &NSmithWatermanKernel::Int32Avx2Kernel;
+        return;
+    }
+    if ((kernel == EKernel::Auto || kernel == EKernel::Sse41) && hasSse41) {
+        Int16Kernel_ = &NSmithWatermanKernel::Int16Sse41Kernel;
+        Int32Kernel_ = &NSmithWatermanKernel::Int32Sse41Kernel;
+        return;
+    }
+#endif
+
+    if (kernel != EKernel::Auto) {
+        throw std::runtime_error("Requested Smith-Waterman kernel is not supported on this CPU");
+    }
+}
+
+void TProfiledSmithWaterman::OnTargetChanged() {
+    MaxGain_ = 0;
+    TargetSkipGains_ = false;
+    for (size_t j = 0; j < Target_.size(); ++j) {
+        MaxGain_ = std::max({ MaxGain_, Match_[j], Mismatch_[j], SourceSkip_[j] });
+        TargetSkipGains_ = TargetSkipGains_ || TargetSkip_[j] > 0;
+    }
+
+    MaxSymbol_ = Target_.empty() ? 0 : *std::max_element(Target_.begin(), Target_.end());
+
+    ProfileKernel_ = nullptr;
+}
+
+const NSmithWatermanKernel::TKernel& TProfiledSmithWaterman::SelectKernel(size_t rows) const {
+    // Striped kernels rely on left moves never gaining score (lazy-F loop termination)
+    if (TargetSkipGains_) {
+        return ScalarKernel;
+    }
+    for (const NSmithWatermanKernel::TKernel* kernel : { Int16Kernel_, Int32Kernel_ }) {
+        if (!kernel) {
+            continue;
+        }
+        // Scores are non-negative and grow by at most MaxGain_ per row, so they never saturate on the positive side.
+        // Negative sums saturating at MinValue lose to zero anyway, same as exact ones.
+        // Target symbols must fit lanes, then wider source symbols wrap to negative values and match nothing.
+        if (MaxGain_ <= kernel->MaxValue && (int64_t)rows * MaxGain_ <= kernel->MaxValue && MaxSymbol_ <= kernel->MaxValue) {
+            return *kernel;
+        }
+    }
+    return ScalarKernel;
+}
+
+template<typename TValue>
+void TProfiledSmithWaterman::BuildProfile(const NSmithWatermanKernel::TKernel& kernel) {
+    const size_t lanes = kernel.Lanes;
+    const size_t cols = Target_.size();
+    Segments_ = (cols + lanes - 1) / lanes;
+    const size_t rowSize = Segments_ * lanes;
+    RowBytes_ = rowSize * sizeof(TValue);
+
+    Profile_.resize(RowBytes_ * 5);
+    TValue* symbols = reinterpret_cast<TValue*>(Profile_.data());
+    TValue* match = symbols + rowSize;
+    TValue* mismatch = match + rowSize;
+    TValue* sourceSkip = mismatch + rowSize;
+    TValue* targetSkip = sourceSkip + rowSize;
+
+    auto narrow = [&kernel](int64_t score) {
+        return (TValue)std::clamp<int64_t>(score, kernel.MinValue, kernel.MaxValue);
+    };
+
+    for (size_t lane = 0; lane < lanes; ++lane) {
+        for (size_t s = 0; s < Segments_; ++s) {
+            const size_t i = s * lanes + lane;
+            const size_t j = lane * Segments_ + s;
+            if (j < cols) {
+                symbols[i] = (TValue)Target_[j];
+                match[i] = narrow(Match_[j]);
+                mismatch[i] = narrow(Mismatch_[j]);
+                sourceSkip[i] = narrow(SourceSkip_[j]);
+                targetSkip[i] = narrow(TargetSkip_[j]);
+            } else {
+                // Padding columns never score above zero, so they never affect real ones
+                symbols[i] = (TValue)kernel.MinValue;
+                match[i] = (TValue)kernel.MinValue;
+                mismatch[i] = (TValue)kernel.MinValue;
+                sourceSkip[i] = (TValue)kernel.MinValue;
+                targetSkip[i] = (TValue)kernel.MinValue;
+            }
+        }
+    }
+
+    Rows_.resize(RowBytes_ * 4);
+    Checkpoint_.resize(RowBytes_);
+    ProfileKernel_ = &kernel;
+    CachedRows_ = 0;
+    CachedMax_ = {};
+    CheckpointRow_ = 0;
+    CheckpointMax_ = {};
+}
+
+void TProfiledSmithWaterman::RunKernel(size_t firstRow, size_t lastRow, TMax& max) {
+    if (firstRow >= lastRow) {
+        return;
+    }
+
+    NSmithWatermanKernel::TArgs args;
+    args.Symbols = Profile_.data();
+    args.Match = Profile_.data() + RowBytes_;
+    args.Mismatch = Profile_.data() + RowBytes_ * 2;
+    args.SourceSkip = Profile_.data() + RowBytes_ * 3;
+    args.TargetSkip = Profile_.data() + RowBytes_ * 4;
+    args.Segments = Segments_;
+    args.Source = Source_.data();
+    args.FirstRow = firstRow;
+    args.LastRow = lastRow;
+    args.Scores = Rows_.data();
+    args.Scratch = Rows_.data() + RowBytes_;
+    args.Directions = Directions_.data();
+    args.MaxScore = max.Score;
+    args.MaxRow = max.Row;
+    args.MaxCol = max.Col;
+
+    ProfileKernel_->Align(args);
+
+    max = { args.MaxScore, args.MaxRow, args.MaxCol };
+}
+
+std::tuple<std::span<const TPhoneme>, std::span<const TPhoneme>, double> TProfiledSmithWaterman::Align(std::span<const TPhoneme> source, size_t stableRows) {
+    if (source.empty() || Target_.empty()) {
+        return { source.subspan(0, 0), Target_.subspan(0, 0), 0.0 };
+    }
+
+    const NSmithWatermanKernel::TKernel& kernel = SelectKernel(source.size());
+    if (ProfileKernel_ != &kernel) {
+        switch (kernel.ValueSize) {
+            case sizeof(int16_t):
+                BuildProfile<int16_t>(kernel);
+                break;
+            case sizeof(int32_t):
+                BuildProfile<int32_t>(kernel);
+                break;
+            default:
+                BuildProfile<int64_t>(kernel);
+                break;
+        }
+    }
+
+    const size_t rows = source.size();
+    stableRows = std::min(stableRows, rows);
+
+    // Rows only depend on the source prefix, so the longest common prefix decides what can be reused
+    const size_t commonRows = std::mismatch(source.begin(), source.begin() + std::min(rows, CachedRows_), Source_.begin()).first - source.begin();
+    Source_.assign(source.begin(), source.end());
+    Directions_.resize(rows * Segments_ * 2);
+
+    size_t firstRow = 0;
+    TMax max;
+    if (CachedRows_ > 0 && commonRows == CachedRows_) {
+        firstRow = CachedRows_;
+        max = CachedMax_;
+    } else if (commonRows >= CheckpointRow_ && CheckpointRow_ > 0) {
+        firstRow = CheckpointRow_;
+        max = CheckpointMax_;
+        std::memcpy(Rows_.data(), Checkpoint_.data(), RowBytes_);
+    } else {
+        std::memset(Rows_.data(), 0, RowBytes_);
+    }
+
+    if (CheckpointRow_ > commonRows) {
+        CheckpointRow_ = 0;
+        CheckpointMax_ = {};
+    }
+    if (firstRow < stableRows && stableRows > CheckpointRow_) {
+        RunKernel(firstRow, stableRows, max);
+        firstRow = stableRows;
+        CheckpointRow_ = stableRows;
+        CheckpointMax_ = max;
+        std::memcpy(Checkpoint_.data(), Rows_.data(), RowBytes_);
+    }
+    RunKernel(firstRow, rows, max);
+
+    CachedRows_ = rows;
+    CachedMax_ = max;
+
+    const size_t segments = Segments_;
+    const unsigned maskBitsPerLane = kernel.MaskBitsPerLane;
+    const auto [beginI, beginJ] = SmithWatermanTraceback(max.Row, max.Col, [this, segments, maskBitsPerLane](size_t i, size_t j) {
+        const uint32_t* masks = Directions_.data() + (i * segments + j % segments) * 2;
+        const unsigned shift = j / segments * maskBitsPerLane;
+        return static_cast<ESmithWatermanDirection>(((masks[0] >> shift) & 1) | (((masks[1] >> shift) & 1) << 1));
+    });
+
+    return {
+        std::span<const TPhoneme>(source.data() + beginI, source.data() + max.Row),
+        std::span<const TPhoneme>(Target_.data() + beginJ, Target_.data() + max.Col),
+        (double)max.Score / Scale,
+    };
+}
+
+} // namespace NTruePrompter::NRecognition
@@ -1,68 +1,274 @@
 #pragma once
 
-#include <functional>
-#include <vector>
+#include "phoneme.hpp"
+
 #include <algorithm>
-#include <array>
-#include <tuple>
+#include <cmath>
+#include <cstdint>
 #include <span>
+#include <tuple>
+#include <vector>
 
 
 namespace NTruePrompter::NRecognition {
 
-template<typename T, typename V>
-std::tuple<std::span<T>, std::span<T>, V> SmithWaterman(
-    std::span<T> source,
-    std::span<T> target,
-    const std::function<V(const T*, const T*)>& sourceSkip,
-    const std::function<V(const T*, const T*)>& targetSkip,
-    const std::function<V(const T*, const T*)>& similarityScore)
-{
-    std::vector<std::vector<V>> score(source.size() + 1, std::vector<V>(target.size() + 1));
-    std::vector<std::vector<std::pair<size_t, size_t>>> traceback(source.size() + 1, std::vector<std::pair<size_t, size_t>>(target.size() + 1));
-
-    for (size_t i = 1; i <= source.size(); ++i) {
-        for(size_t j = 1; j <= target.size(); ++j) {
-            std::array<std::tuple<size_t, size_t, V>, 4> alts {{
-                { 1, 1, score[i - 1][j - 1] + similarityScore(source.data() + i, target.data() + j) },
-                { 1, 0, score[i - 1][j] + sourceSkip(source.data() + i, target.data() + j) },
-                { 0, 1, score[i][j - 1] + targetSkip(source.data() + i, target.data() + j) },
-                { 0, 0, V() },
-            }};
-
-            auto it = std::max_element(alts.begin(), alts.end(), [](const auto& a, const auto& b) {
-                return std::get<2>(a) < std::get<2>(b);
-            });
-
-            auto& [is, js, v] = *it;
-
-            score[i][j] = v;
-            traceback[i][j] = { i - is, j - js };
+enum class ESmithWatermanDirection : uint8_t {
+    Stop = 0,
+    Diagonal = 1,
+    Up = 2,
+    Left = 3,
+};
+
+/**
+ * Walks back from 1-based cell (i, j) to the first cell of the local alignment.
+ * getDirection(i, j) takes 0-based cell, returns 0-based begin positions.
+ */
+template<typename TGetDirection>
+std::pair<size_t, size_t> SmithWatermanTraceback(size_t i, size_t j, TGetDirection&& getDirection) {
+    std::pair<size_t, size_t> begin = { i, j };
+    while (i > 0 && j > 0) {
+        const ESmithWatermanDirection direction = getDirection(i - 1, j - 1);
+        if (direction == ESmithWatermanDirection::Stop) {
+            break;
+        }
+        begin = { i - 1, j - 1 };
+        if (direction != ESmithWatermanDirection::Left) {
+            --i;
+        }
+        if (direction != ESmithWatermanDirection::Up) {
+            --j;
         }
     }
+    return begin;
+}
+
+/**
+ * Local alignment engine with linear skip scores.
+ * Keeps only two score rows and a 2-bit traceback direction per cell,
+ * buffers are reused between calls, so steady state alignment does not allocate.
+ * Scorers are called as scorer(const T* sourcePos, const T* targetPos) and are expected to be inlinable callables.
+ */
+template<typename V>
+class TSmithWaterman {
+public:
+    using EDirection = ESmithWatermanDirection;
 
-    std::pair<size_t, size_t> maxElem;
-    for (size_t i = 1; i <= source.size(); ++i) {
-        for (size_t j = 1; j <= target.size(); ++j) {
-            if (score[i][j] > score[maxElem.first][maxElem.second]) {
-                maxElem = { i, j };
+    template<typename T, typename TSourceSkip, typename TTargetSkip, typename TSimilarityScore>
+    std::tuple<std::span<T>, std::span<T>, V> Align(
+        std::span<T> source,
+        std::span<T> target,
+        TSourceSkip&& sourceSkip,
+        TTargetSkip&& targetSkip,
+        TSimilarityScore&& similarityScore)
+    {
+        const size_t rows = source.size();
+        const size_t cols = target.size();
+
+        Prev_.assign(cols + 1, V());
+        Curr_.assign(cols + 1, V());
+        Directions_.resize((rows * cols + 3) / 4);
+        Cols_ = cols;
+
+        size_t maxI = 0;
+        size_t maxJ = 0;
+        V maxScore = V();
+
+        for (size_t i = 1; i <= rows; ++i) {
+            const T* sourcePos = source.data() + i - 1;
+            Curr_[0] = V();
+            for (size_t j = 1; j <= cols; ++j) {
+                const T* targetPos = target.data() + j - 1;
+
+                // Preference order on ties: diagonal, source skip, target skip, restart
+                V best = Prev_[j - 1] + similarityScore(sourcePos, targetPos);
+                EDirection direction = EDirection::Diagonal;
+
+                const V up = Prev_[j] + sourceSkip(sourcePos, targetPos);
+                if (best < up) {
+                    best = up;
+                    direction = EDirection::Up;
+                }
+
+                const V left = Curr_[j - 1] + targetSkip(sourcePos, targetPos);
+                if (best < left) {
+                    best = left;
+                    direction = EDirection::Left;
+                }
+
+                if (best < V()) {
+                    best = V();
+                }
+                if (best == V()) {
+                    direction = EDirection::Stop;
+                }
+
+                Curr_[j] = best;
+                SetDirection(i - 1, j - 1, direction);
+
+                if (maxScore < best) {
+                    maxScore = best;
+                    maxI = i;
+                    maxJ = j;
+                }
             }
+            std::swap(Prev_, Curr_);
         }
+
+        auto [beginI, beginJ] = SmithWatermanTraceback(maxI, maxJ, [this](size_t i, size_t j) {
+            return GetDirection(i, j);
+        });
+
+        return {
+            std::span<T>(source.data() + beginI, source.data() + maxI),
+            std::span<T>(target.data() + beginJ, target.data() + maxJ),
+            maxScore,
+        };
     }
 
-    std::pair<size_t, size_t> prev = { maxElem.first + 1, maxElem.second + 1 };
-    std::pair<size_t, size_t> curr = maxElem;
+    EDirection GetDirection(size_t i, size_t j) const {
+        const size_t cell = i * Cols_ + j;
+        return static_cast<EDirection>((Directions_[cell / 4] >> (cell % 4 * 2)) & 3);
+    }
 
-    while (score[curr.first][curr.second] != V()) {
-        prev = curr;
-        curr = traceback[curr.first][curr.second];
+private:
+    void SetDirection(size_t i, size_t j, EDirection direction) {
+        const size_t cell = i * Cols_ + j;
+        const unsigned shift = cell % 4 * 2;
+        uint8_t& byte = Directions_[cell / 4];
+        byte = (byte & ~(3u << shift)) | (static_cast<uint8_t>(direction) << shift);
     }
 
-    return {
-        std::span<T>(source.data() + prev.first, source.data() + maxElem.first + 1),
-        std::span<T>(target.data() + prev.second, target.data() + maxElem.second + 1),
-        score[maxElem.first][maxElem.second],
-    };
+private:
+    std::vector<V> Prev_;
+    std::vector<V> Curr_;
+    std::vector<uint8_t> Directions_;
+    size_t Cols_ = 0;
+};
+
+template<typename T, typename V, typename TSourceSkip, typename TTargetSkip, typename TSimilarityScore>
+std::tuple<std::span<T>, std::span<T>, V> SmithWaterman(
+    std::span<T> source,
+    std::span<T> target,
+    TSourceSkip&& sourceSkip,
+    TTargetSkip&& targetSkip,
+    TSimilarityScore&& similarityScore)
+{
+    TSmithWaterman<V> smithWaterman;
+    return smithWaterman.Align(source, target, sourceSkip, targetSkip, similarityScore);
 }
 
+namespace NSmithWatermanKernel {
+
+struct TKernel;
+
+} // namespace NSmithWatermanKernel
+
+/**
+ * Smith-Waterman over a fixed target with per-position fixed-point scores.
+ * Target position multiplier is folded into the profile once per SetTarget.
+ * Runs striped SIMD kernels (AVX2 or SSE4.1, picked at runtime) when scores are known to fit their lanes,
+ * otherwise falls back to the same kernel over scalar int64 scores, so results do not depend on the kernel.
+ *
+ * Alignment is incremental: score rows of the previous source prefix are kept as long as the target does not change,
+ * so aligning a source that only differs from the previous one in its tail recomputes just the tail rows.
+ */
+class TProfiledSmithWaterman {
+public:
+    enum class EKernel {
+        Auto,
+        Scalar,
+        Sse41,
+        Avx2,
+    };
+
+    struct TScores {
+        double SimilarScore = 1.0;
+        double DifferentScore = -1.0;
+        double SourceSkipWeight = -1.0;
+        double TargetSkipWeight = -1.0;
+    };
+
+    // Scores are stored with 8 fractional bits
+    static constexpr double Scale = 256.0;
+
+    explicit TProfiledSmithWaterman(EKernel kernel = EKernel::Auto);
+
+    /**
+     * Target must outlive alignments against it.
+     * multiplier(j) is applied to all scores at target position j.
+     */
+    template<typename TMultiplier>
+    void SetTarget(std::span<const TPhoneme> target, const TScores& scores, TMultiplier&& multiplier) {
+        Target_ = target;
+        Match_.resize(target.size());
+        Mismatch_.resize(target.size());
+        SourceSkip_.resize(target.size());
+        TargetSkip_.resize(target.size());
+        for (size_t j = 0; j < target.size(); ++j) {
+            const double weight = multiplier(j);
+            Match_[j] = Quantize(scores.SimilarScore * weight);
+            Mismatch_[j] = Quantize(scores.DifferentScore * weight);
+            SourceSkip_[j] = Quantize(scores.SourceSkipWeight * weight);
+            TargetSkip_[j] = Quantize(scores.TargetSkipWeight * weight);
+        }
+        OnTargetChanged();
+    }
+
+    /**
+     * First stableRows of source are not expected to change in the following calls,
+     * rows up to there are checkpointed and reused even if the rest of the source is rewritten.
+     */
+    std::tuple<std::span<const TPhoneme>, std::span<const TPhoneme>, double> Align(std::span<const TPhoneme> source, size_t stableRows = 0);
+
+private:
+    struct TMax {
+        int64_t Score = 0;
+        size_t Row = 0;
+        size_t Col = 0;
+    };
+
+    static int64_t Quantize(double score) {
+        // Anything beyond this range is effectively infinite for alignment purposes
+        constexpr double limit = (double)(int64_t(1) << 40);
+        return std::llround(std::clamp(score * Scale, -limit, limit));
+    }
+
+    void OnTargetChanged();
+    const NSmithWatermanKernel::TKernel& SelectKernel(size_t rows) const;
+
+    template<typename TValue>
+    void BuildProfile(const NSmithWatermanKernel::TKernel& kernel);
+
+    void RunKernel(size_t firstRow, size_t lastRow, TMax& max);
+
+private:
+    const NSmithWatermanKernel::TKernel* Int16Kernel_ = nullptr;
+    const NSmithWatermanKernel::TKernel* Int32Kernel_ = nullptr;
+
+    std::span<const TPhoneme> Target_;
+    std::vector<int64_t> Match_;
+    std::vector<int64_t> Mismatch_;
+    std::vector<int64_t> SourceSkip_;
+    std::vector<int64_t> TargetSkip_;
+    int64_t MaxGain_ = 0;
+    bool TargetSkipGains_ = false;
+    TPhoneme MaxSymbol_ = 0;
+
+    // Striped profile and scratch of the kernel it was last built for
+    const NSmithWatermanKernel::TKernel* ProfileKernel_ = nullptr;
+    size_t Segments_ = 0;
+    size_t RowBytes_ = 0;
+    std::vector<uint8_t> Profile_;
+    std::vector<uint8_t> Rows_;
+    std::vector<uint32_t> Directions_;
+    std::vector<TPhoneme> Source_;
+
+    // Rows computed by the previous call, valid while the profile stays the same
+    size_t CachedRows_ = 0;
+    TMax CachedMax_;
+    size_t CheckpointRow_ = 0;
+    TMax CheckpointMax_;
+    std::vector<uint8_t> Checkpoint_;
+};
+
 } // namespace NTruePrompter::NRecognition
@@ -0,0 +1,66 @@
+#include "smith_waterman_kernel.hpp"
+
+#include <immintrin.h>
+
+
+namespace NTruePrompter::NRecognition::NSmithWatermanKernel {
+
+namespace {
+
+struct TAvx2Traits {
+    using TVector = __m256i;
+
+    static TVector Load(const void* p) { return _mm256_loadu_si256(static_cast<const __m256i*>(p)); }
+    static void Store(void* p, TVector v) { _mm256_storeu_si256(static_cast<__m256i*>(p), v); }
+    static TVector Zero() { return _mm256_setzero_si256(); }
+    static TVector AndNot(TVector a, TVector b) { return _mm256_andnot_si256(a, b); }
+    static TVector Or(TVector a, TVector b) { return _mm256_or_si256(a, b); }
+    static TVector Blend(TVector a, TVector b, TVector mask) { return _mm256_blendv_epi8(a, b, mask); }
+    static bool Any(TVector mask) { return _mm256_movemask_epi8(mask) != 0; }
+
+    // Shifts the whole register by N bytes towards the higher lanes, filling with zeros
+    template<int N>
+    static TVector ShiftBytesUp(TVector v) {
+        return _mm256_alignr_epi8(v, _mm256_permute2x128_si256(v, v, 0x08), 16 - N);
+    }
+};
+
+struct TInt16Avx2Traits : TAvx2Traits {
+    using TValue = int16_t;
+    static constexpr size_t Lanes = 16;
+    static constexpr TValue MinValue = INT16_MIN;
+
+    static TVector Set1(TValue x) { return _mm256_set1_epi16(x); }
+    static TVector Add(TVector a, TVector b) { return _mm256_adds_epi16(a, b); }
+    static TVector Max(TVector a, TVector b) { return _mm256_max_epi16(a, b); }
+    static TVector CmpGt(TVector a, TVector b) { return _mm256_cmpgt_epi16(a, b); }
+    static TVector CmpEq(TVector a, TVector b) { return _mm256_cmpeq_epi16(a, b); }
+    static TVector ShiftUp(TVector v) { return ShiftBytesUp<sizeof(TValue)>(v); }
+    static uint32_t MoveMask(TVector mask) { return _mm256_movemask_epi8(mask); }
+};
+
+struct TInt32Avx2Traits : TAvx2Traits {
+    using TValue = int32_t;
+    static constexpr size_t Lanes = 8;
+    static constexpr TValue MinValue = -(1 << 30);
+
+    static TVector Set1(TValue x) { return _mm256_set1_epi32(x); }
+    static TVector Add(TVector a, TVector b) { return _mm256_add_epi32(a, b); }
+    static TVector Max(TVector a, TVector b) { return _mm256_max_epi32(a, b); }
+    static TVector CmpGt(TVector a, TVector b) { return _mm256_cmpgt_epi32(a, b); }
+    static TVector CmpEq(TVector a, TVector b) { return _mm256_cmpeq_epi32(a, b); }
+    static TVector ShiftUp(TVector v) { return ShiftBytesUp<sizeof(TValue)>(v); }
+    static uint32_t MoveMask(TVector mask) { return _mm256_movemask_ps(_mm256_castsi256_ps(mask)); }
+};
+
+} // namespace
+
+const TKernel Int16Avx2Kernel = {
+    TInt16Avx2Traits::Lanes, sizeof(TInt16Avx2Traits::TValue), 2, TInt16Avx2Traits::MinValue, INT16_MAX, &AlignStriped<TInt16Avx2Traits>,
+};
+
+const TKernel Int32Avx2Kernel = {
+    TInt32Avx2Traits::Lanes, sizeof(TInt32Avx2Traits::TValue), 1, TInt32Avx2Traits::MinValue, -TInt32Avx2Traits::MinValue - 1, &AlignStriped<TInt32Avx2Traits>,
+};
+
+} // namespace NTruePrompter::NRecognition::NSmithWatermanKernel
@@ -0,0 +1,197 @@
+#pragma once
+
+#include "phoneme.hpp"
+
+#include <cstddef>
+#include <cstdint>
+
+
+/**
+ * Striped (Farrar-style) Smith-Waterman kernels over a fixed-point target profile.
+ * Target column j lives in segment j % Segments, lane j / Segments.
+ * Every kernel translation unit is built with its own instruction set flags,
+ * so this header only holds plain data types and the kernel template itself.
+ */
+namespace NTruePrompter::NRecognition::NSmithWatermanKernel {
+
+struct TArgs {
+    // Striped target profile, Segments * Lanes values of the kernel value type each
+    const void* Symbols = nullptr;
+    const void* Match = nullptr;
+    const void* Mismatch = nullptr;
+    const void* SourceSkip = nullptr;
+    const void* TargetSkip = nullptr;
+    size_t Segments = 0;
+
+    // Source symbols, values out of the kernel range never equal target symbols, which are checked to fit
+    const TPhoneme* Source = nullptr;
+    size_t FirstRow = 0;
+    size_t LastRow = 0;
+
+    // Score row FirstRow - 1 on input (zeros for the first row), row LastRow - 1 on output
+    void* Scores = nullptr;
+    // Three more rows of the same size
+    void* Scratch = nullptr;
+    // Two masks per row and segment, see TKernel::MaskBitsPerLane
+    uint32_t* Directions = nullptr;
+
+    // Running maximum, 1-based row and column of the first maximal cell in row-major order
+    int64_t MaxScore = 0;
+    size_t MaxRow = 0;
+    size_t MaxCol = 0;
+};
+
+struct TKernel {
+    size_t Lanes;
+    size_t ValueSize;
+    unsigned MaskBitsPerLane;
+    int64_t MinValue;
+    int64_t MaxValue;
+    void (*Align)(TArgs& args);
+};
+
+#if defined(TRUEPROMPTER_SIMD_X86)
+extern const TKernel Int16Sse41Kernel;
+extern const TKernel Int32Sse41Kernel;
+extern const TKernel Int16Avx2Kernel;
+extern const TKernel Int32Avx2Kernel;
+#endif
+
+namespace {
+
+/**
+ * TTraits provides vector type TVector, value type TValue, Lanes and
+ * Load, Store, Set1, Zero, Add, Max, CmpGt, CmpEq, AndNot, Or, Blend, ShiftUp, MoveMask, Any.
+ * Add must saturate or never overflow within the bounds checked by the caller.
+ * Directions are two masks per segment: bit 0 is set for diagonal and left moves, bit 1 for up and left moves,
+ * none for cells with zero score.
+ */
+template<typename TTraits>
+void AlignStriped(TArgs& args) {
+    using TVector = typename TTraits::TVector;
+    using TValue = typename TTraits::TValue;
+    constexpr size_t lanes = TTraits::Lanes;
+
+    const size_t segments = args.Segments;
+    const size_t rowSize = segments * lanes;
+
+    const TValue* symbols = static_cast<const TValue*>(args.Symbols);
+    const TValue* match = static_cast<const TValue*>(args.Match);
+    const TValue* mismatch = static_cast<const TValue*>(args.Mismatch);
+    const TValue* sourceSkip = static_cast<const TValue*>(args.SourceSkip);
+    const TValue* targetSkip = static_cast<const TValue*>(args.TargetSkip);
+
+    TValue* prev = static_cast<TValue*>(args.Scores);
+    TValue* curr = static_cast<TValue*>(args.Scratch);
+    TValue* diagonalOrUp = curr + rowSize;
+    TValue* upWins = diagonalOrUp + rowSize;
+
+    const TVector zero = TTraits::Zero();
+    const TVector allOnes = TTraits::CmpEq(zero, zero);
+    const TVector minValue = TTraits::Set1(TTraits::MinValue);
+
+    for (size_t row = args.FirstRow; row < args.LastRow; ++row) {
+        const TVector symbol = TTraits::Set1(static_cast<TValue>(args.Source[row]));
+
+        // First pass: everything but the horizontal dependency inside a stripe
+        TVector diagonal = TTraits::ShiftUp(TTraits::Load(prev + (segments - 1) * lanes));
+        TVector left = minValue;
+        for (size_t s = 0; s < segments; ++s) {
+            const size_t offset = s * lanes;
+            const TVector up = TTraits::Load(prev + offset);
+            const TVector equal = TTraits::CmpEq(TTraits::Load(symbols + offset), symbol);
+            const TVector similarity = TTraits::Blend(TTraits::Load(mismatch + offset), TTraits::Load(match + offset), equal);
+            const TVector fromDiagonal = TTraits::Add(diagonal, similarity);
+            const TVector fromUp = TTraits::Add(up, TTraits::Load(sourceSkip + offset));
+            const TVector best = TTraits::Max(fromDiagonal, fromUp);
+            TTraits::Store(diagonalOrUp + offset, best);
+            TTraits::Store(upWins + offset, TTraits::CmpGt(fromUp, fromDiagonal));
+
+            const TVector score = TTraits::Max(TTraits::Max(best, left), zero);
+            TTraits::Store(curr + offset, score);
+            if (s + 1 < segments) {
+                left = TTraits::Add(score, TTraits::Load(targetSkip + offset + lanes));
+            }
+            diagonal = up;
+        }
+
+        // Lazy-F loop: carry left moves across stripes until they stop improving anything
+        TVector carry = TTraits::Add(TTraits::ShiftUp(TTraits::Load(curr + (segments - 1) * lanes)), TTraits::Load(targetSkip));
+        for (size_t s = 0; ; ) {
+            const size_t offset = s * lanes;
+            TVector score = TTraits::Load(curr + offset);
+            if (!TTraits::Any(TTraits::CmpGt(carry, score))) {
+                break;
+            }
+            score = TTraits::Max(score, carry);
+            TTraits::Store(curr + offset, score);
+            if (++s == segments) {
+                s = 0;
+                carry = TTraits::Add(TTraits::ShiftUp(score), TTraits::Load(targetSkip));
+            } else {
+                carry = TTraits::Add(score, TTraits::Load(targetSkip + s * lanes));
+            }
+        }
+
+        // Final pass: directions and row maximum over the settled row
+        uint32_t* directions = args.Directions + row * segments * 2;
+        TVector leftScore = TTraits::ShiftUp(TTraits::Load(curr + (segments - 1) * lanes));
+        TVector rowMax = zero;
+        for (size_t s = 0; s < segments; ++s) {
+            const size_t offset = s * lanes;
+            const TVector score = TTraits::Load(curr + offset);
+            const TVector fromLeft = TTraits::Add(leftScore, TTraits::Load(targetSkip + offset));
+            const TVector leftWins = TTraits::CmpGt(fromLeft, TTraits::Load(diagonalOrUp + offset));
+            const TVector up = TTraits::Load(upWins + offset);
+            const TVector stop = TTraits::CmpEq(score, zero);
+            directions[s * 2] = TTraits::MoveMask(TTraits::AndNot(stop, TTraits::Or(leftWins, TTraits::AndNot(up, allOnes))));
+            directions[s * 2 + 1] = TTraits::MoveMask(TTraits::AndNot(stop, TTraits::Or(leftWins, up)));
+            rowMax = TTraits::Max(rowMax, score);
+            leftScore = score;
+        }
+
+        TValue rowMaxValues[lanes];
+        TTraits::Store(rowMaxValues, rowMax);
+        TValue rowMaxValue = 0;
+        for (size_t k = 0; k < lanes; ++k) {
+            rowMaxValue = rowMaxValues[k] > rowMaxValue ? rowMaxValues[k] : rowMaxValue;
+        }
+
+        if (rowMaxValue > args.MaxScore) {
+            // First maximal column of the row: lowest lane holding the maximum, then lowest segment within it
+            const TVector target = TTraits::Set1(rowMaxValue);
+            TVector found = zero;
+            for (size_t s = 0; s < segments; ++s) {
+                found = TTraits::Or(found, TTraits::CmpEq(TTraits::Load(curr + s * lanes), target));
+            }
+            TValue foundValues[lanes];
+            TTraits::Store(foundValues, found);
+            size_t lane = 0;
+            while (!foundValues[lane]) {
+                ++lane;
+            }
+            size_t segment = 0;
+            while (curr[segment * lanes + lane] != rowMaxValue) {
+                ++segment;
+            }
+            args.MaxScore = rowMaxValue;
+            args.MaxRow = row + 1;
+            args.MaxCol = lane * segments + segment + 1;
+        }
+
+        TValue* tmp = prev;
+        prev = curr;
+        curr = tmp;
+    }
+
+    if (prev != args.Scores) {
+        TValue* scores = static_cast<TValue*>(args.Scores);
+        for (size_t i = 0; i < rowSize; ++i) {
+            scores[i] = prev[i];
+        }
+    }
+}
+
+} // namespace
+
+} // namespace NTruePrompter::NRecognition::NSmithWatermanKernel
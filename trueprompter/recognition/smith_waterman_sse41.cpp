@@ -0,0 +1,60 @@
+#include "smith_waterman_kernel.hpp"
+
+#include <immintrin.h>
+
+
+namespace NTruePrompter::NRecognition::NSmithWatermanKernel {
+
+namespace {
+
+struct TSse41Traits {
+    using TVector = __m128i;
+
+    static TVector Load(const void* p) { return _mm_loadu_si128(static_cast<const __m128i*>(p)); }
+    static void Store(void* p, TVector v) { _mm_storeu_si128(static_cast<__m128i*>(p), v); }
+    static TVector Zero() { return _mm_setzero_si128(); }
+    static TVector AndNot(TVector a, TVector b) { return _mm_andnot_si128(a, b); }
+    static TVector Or(TVector a, TVector b) { return _mm_or_si128(a, b); }
+    static TVector Blend(TVector a, TVector b, TVector mask) { return _mm_blendv_epi8(a, b, mask); }
+    static bool Any(TVector mask) { return _mm_movemask_epi8(mask) != 0; }
+};
+
+struct TInt16Sse41Traits : TSse41Traits {
+    using TValue = int16_t;
+    static constexpr size_t Lanes = 8;
+    static constexpr TValue MinValue = INT16_MIN;
+
+    static TVector Set1(TValue x) { return _mm_set1_epi16(x); }
+    static TVector Add(TVector a, TVector b) { return _mm_adds_epi16(a, b); }
+    static TVector Max(TVector a, TVector b) { return _mm_max_epi16(a, b); }
+    static TVector CmpGt(TVector a, TVector b) { return _mm_cmpgt_epi16(a, b); }
+    static TVector CmpEq(TVector a, TVector b) { return _mm_cmpeq_epi16(a, b); }
+    static TVector ShiftUp(TVector v) { return _mm_slli_si128(v, sizeof(TValue)); }
+    static uint32_t MoveMask(TVector mask) { return _mm_movemask_epi8(mask); }
+};
+
+struct TInt32Sse41Traits : TSse41Traits {
+    using TValue = int32_t;
+    static constexpr size_t Lanes = 4;
+    static constexpr TValue MinValue = -(1 << 30);
+
+    static TVector Set1(TValue x) { return _mm_set1_epi32(x); }
+    static TVector Add(TVector a, TVector b) { return _mm_add_epi32(a, b); }
+    static TVector Max(TVector a, TVector b) { return _mm_max_epi32(a, b); }
+    static TVector CmpGt(TVector a, TVector b) { return _mm_cmpgt_epi32(a, b); }
+    static TVector CmpEq(TVector a, TVector b) { return _mm_cmpeq_epi32(a, b); }
+    static TVector ShiftUp(TVector v) { return _mm_slli_si128(v, sizeof(TValue)); }
+    static uint32_t MoveMask(TVector mask) { return _mm_movemask_ps(_mm_castsi128_ps(mask)); }
+};
+
+} // namespace
+
+const TKernel Int16Sse41Kernel = {
+    TInt16Sse41Traits::Lanes, sizeof(TInt16Sse41Traits::TValue), 2, TInt16Sse41Traits::MinValue, INT16_MAX, &AlignStriped<TInt16Sse41Traits>,
+};
+
+const TKernel Int32Sse41Kernel = {
+    TInt32Sse41Traits::Lanes, sizeof(TInt32Sse41Traits::TValue), 1, TInt32Sse41Traits::MinValue, -TInt32Sse41Traits::MinValue - 1, &AlignStriped<TInt32Sse41Traits>,
+};
+
+} // namespace NTruePrompter::NRecognition::NSmithWatermanKernel
@@ -0,0 +1,313 @@
+#include "tokenized_script.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+namespace NTruePrompter::NRecognition {
+
+namespace {
+
+constexpr char Magic[8] = { 'T', 'P', 'S', 'C', 'R', 'I', 'P', 'T' };
+constexpr uint32_t Version = 1;
+// Files are read in native byte order, this one tells foreign files apart
+constexpr uint32_t ByteOrderMark = 0x01020304;
+
+struct THeader {
+    char Magic[8];
+    uint32_t Version;
+    uint32_t ByteOrderMark;
+    uint64_t TextHash;
+    uint64_t TextSize;
+    uint64_t TokenizerIdSize;
+    uint64_t PhonemesCount;
+    uint64_t WideValuesCount;
+};
+
+static_assert(sizeof(THeader) % 8 == 0);
+
+// Byte offsets of file sections, every section starts 8-aligned and wider arrays go first
+struct TLayout {
+    size_t Blocks;
+    size_t WideValues;
+    size_t Deltas;
+    size_t Phonemes;
+    size_t Text;
+    size_t TokenizerId;
+    size_t Size;
+};
+
+size_t Align(size_t size) {
+    return (size + 7) & ~(size_t)7;
+}
+
+TLayout MakeLayout(const THeader& header) {
+    const size_t blocks = TPhonemeOffsetsView::BlocksCount(header.PhonemesCount);
+    TLayout layout;
+    layout.Blocks = sizeof(THeader);
+    layout.WideValues = layout.Blocks + Align(blocks * sizeof(TPhonemeOffsetsView::TBlock));
+    layout.Deltas = layout.WideValues + Align(header.WideValuesCount * sizeof(uint64_t));
+    layout.Phonemes = layout.Deltas + Align(blocks * TPhonemeOffsetsView::BlockSize * sizeof(uint16_t));
+    layout.Text = layout.Phonemes + Align(header.PhonemesCount * sizeof(TPhoneme));
+    layout.TokenizerId = layout.Text + Align(header.TextSize);
+    layout.Size = layout.TokenizerId + Align(header.TokenizerIdSize);
+    return layout;
+}
+
+void WriteSection(std::ofstream& out, const void* data, size_t size) {
+    static const char padding[8] = {};
+    out.write(static_cast<const char*>(data), size);
+    out.write(padding, Align(size) - size);
+}
+
+// Byte offset of unicode character pos in utf-8 text, text size for pos at the end
+size_t GetByteOffset(std::string_view text, size_t pos) {
+    size_t chars = 0;
+    for (size_t i = 0; i < text.size(); ++i) {
+        if (((uint8_t)text[i] & 0xC0) != 0x80) {
+            if (chars == pos) {
+                return i;
+            }
+            ++chars;
+        }
+    }
+    if (chars == pos) {
+        return text.size();
+    }
+    throw std::runtime_error("Text position is out of text");
+}
+
+} // namespace
+
+size_t CountTextChars(std::string_view text) {
+    return std::count_if(text.begin(), text.end(), [](char c) {
+        return ((uint8_t)c & 0xC0) != 0x80;
+    });
+}
+
+uint64_t HashScriptText(std::string_view text) {
+    uint64_t hash = 14695981039346656037ull;
+    for (char c : text) {
+        hash = (hash ^ (uint8_t)c) * 1099511628211ull;
+    }
+    return hash;
+}
+
+TTokenizedScript::~TTokenizedScript() {
+    if (Mapping_) {
+        munmap(Mapping_, MappingSize_);
+    }
+}
+
+std::shared_ptr<const TTokenizedScript> TTokenizedScript::FromText(const std::string& text, ITokenizer& tokenizer) {
+    std::shared_ptr<TTokenizedScript> script(new TTokenizedScript());
+    if (!tokenizer.Apply(text, &script->OwnedPhonemes_, &script->OwnedOffsets_)) {
+        throw std::runtime_error("Can't tokenize script text");
+    }
+    script->OwnedText_ = text;
+    script->OwnedTokenizerId_ = tokenizer.GetId();
+    script->SetOwned();
+    return script;
+}
+
+std::shared_ptr<const TTokenizedScript> TTokenizedScript::FromTokens(std::string text, std::string tokenizerId, std::vector<TPhoneme> phonemes, TPhonemeOffsets offsets) {
+    if (phonemes.size() != offsets.Size()) {
+        throw std::runtime_error("Phonemes and offsets sizes differ");
+    }
+    std::shared_ptr<TTokenizedScript> script(new TTokenizedScript());
+    script->OwnedText_ = std::move(text);
+    script->OwnedTokenizerId_ = std::move(tokenizerId);
+    script->OwnedPhonemes_ = std::move(phonemes);
+    script->OwnedOffsets_ = std::move(offsets);
+    script->SetOwned();
+    return script;
+}
+
+std::string TTokenizedScript::EditText(std::string_view text, size_t from, size_t to, std::string_view replacement) {
+    if (from > to) {
+        throw std::runtime_error("Text edit range is reversed");
+    }
+    const size_t fromByte = GetByteOffset(text, from);
+    const size_t toByte = fromByte + GetByteOffset(text.substr(fromByte), to - from);
+    std::string edited;
+    edited.reserve(text.size() - (toByte - fromByte) + replacement.size());
+    edited.append(text.substr(0, fromByte));
+    edited.append(replacement);
+    edited.append(text.substr(toByte));
+    return edited;
+}
+
+std::shared_ptr<const TTokenizedScript> TTokenizedScript::Edit(size_t from, size_t to, const std::string& replacement, ITokenizer& tokenizer) const {
+    if (tokenizer.GetId() != TokenizerId_) {
+        throw std::runtime_error("Script was tokenized by another tokenizer");
+    }
+    std::string text = EditText(Text_, from, to, replacement);
+
+    // Range to tokenize in the new text and the same range in the old one, characters around it are the same in both
+    const size_t replacementChars = CountTextChars(replacement);
+    auto [begin, end] = tokenizer.GetRetokenizeRange(text, from, from + replacementChars);
+    end = std::min(end, CountTextChars(text));
+    if (begin > from || end < from + replacementChars) {
+        throw std::runtime_error("Retokenize range does not cover the edit");
+    }
+    const size_t oldEnd = end - replacementChars + (to - from);
+
+    const size_t beginByte = GetByteOffset(text, begin);
+    const size_t endByte = beginByte + GetByteOffset(std::string_view(text).substr(beginByte), end - begin);
+    std::vector<TPhoneme> rangePhonemes;
+    TPhonemeOffsets rangeOffsets;
+    if (!tokenizer.Apply(text.substr(beginByte, endByte - beginByte), &rangePhonemes, &rangeOffsets)) {
+        throw std::runtime_error("Can't tokenize script text");
+    }
+
+    const size_t prefix = Offsets_.LowerBound(0, begin);
+    const size_t suffix = Offsets_.LowerBound(prefix, oldEnd);
+    std::vector<TPhoneme> phonemes;
+    phonemes.reserve(prefix + rangePhonemes.size() + Phonemes_.size() - suffix);
+    TPhonemeOffsets offsets;
+    for (size_t i = 0; i < prefix; ++i) {
+        phonemes.push_back(Phonemes_[i]);
+        offsets.PushBack(Offsets_[i]);
+    }
+    for (size_t i = 0; i < rangePhonemes.size(); ++i) {
+        phonemes.push_back(rangePhonemes[i]);
+        offsets.PushBack(rangeOffsets[i] + begin);
+    }
+    for (size_t i = suffix; i < Phonemes_.size(); ++i) {
+        phonemes.push_back(Phonemes_[i]);
+        offsets.PushBack(Offsets_[i] - oldEnd + end);
+    }
+
+    return FromTokens(std::move(text), std::string(TokenizerId_), std::move(phonemes), std::move(offsets));
+}
+
+void TTokenizedScript::SetOwned() {
+    OwnedPhonemes_.shrink_to_fit();
+    OwnedOffsets_.ShrinkToFit();
+
+    Text_ = OwnedText_;
+    TextHash_ = HashScriptText(OwnedText_);
+    TokenizerId_ = OwnedTokenizerId_;
+    Phonemes_ = OwnedPhonemes_;
+    Offsets_ = OwnedOffsets_.View();
+}
+
+const TPhonemeIndex& TTokenizedScript::GetIndex() const {
+    std::call_once(IndexBuilt_, [this] {
+        Index_ = std::make_unique<TPhonemeIndex>(Phonemes_);
+    });
+    return *Index_;
+}
+
+std::shared_ptr<const TTokenizedScript> TTokenizedScript::Load(const std::filesystem::path& path) {
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error("Can't open script file " + path.string());
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(THeader)) {
+        close(fd);
+        throw std::runtime_error("Script file is truncated " + path.string());
+    }
+    void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        throw std::runtime_error("Can't map script file " + path.string());
+    }
+
+    // Owns the mapping from here on, so it is released on validation errors too
+    std::shared_ptr<TTokenizedScript> script(new TTokenizedScript());
+    script->Mapping_ = mapping;
+    script->MappingSize_ = st.st_size;
+
+    const char* data = static_cast<const char*>(mapping);
+    const size_t size = st.st_size;
+    const THeader& header = *reinterpret_cast<const THeader*>(data);
+    if (std::memcmp(header.Magic, Magic, sizeof(Magic)) != 0 || header.ByteOrderMark != ByteOrderMark) {
+        throw std::runtime_error("Not a script file " + path.string());
+    }
+    if (header.Version != Version) {
+        throw std::runtime_error("Unsupported script file version " + path.string());
+    }
+    // Every count is bounded by file size first, so that layout offsets can't overflow
+    if (header.TextSize > size || header.TokenizerIdSize > size || header.PhonemesCount > size || header.WideValuesCount > size) {
+        throw std::runtime_error("Script file is corrupted " + path.string());
+    }
+    const TLayout layout = MakeLayout(header);
+    if (layout.Size != size) {
+        throw std::runtime_error("Script file is corrupted " + path.string());
+    }
+
+    const auto* blocks = reinterpret_cast<const TPhonemeOffsetsView::TBlock*>(data + layout.Blocks);
+    for (size_t block = 0; block < TPhonemeOffsetsView::BlocksCount(header.PhonemesCount); ++block) {
+        const size_t count = std::min<size_t>(TPhonemeOffsetsView::BlockSize, header.PhonemesCount - block * TPhonemeOffsetsView::BlockSize);
+        const uint64_t wide = blocks[block].Wide;
+        if (wide != TPhonemeOffsetsView::NoWide && (wide > header.WideValuesCount || header.WideValuesCount - wide < count)) {
+            throw std::runtime_error("Script file is corrupted " + path.string());
+        }
+    }
+
+    script->Text_ = std::string_view(data + layout.Text, header.TextSize);
+    script->TextHash_ = header.TextHash;
+    script->TokenizerId_ = std::string_view(data + layout.TokenizerId, header.TokenizerIdSize);
+    script->Phonemes_ = std::span<const TPhoneme>(reinterpret_cast<const TPhoneme*>(data + layout.Phonemes), header.PhonemesCount);
+    script->Offsets_ = TPhonemeOffsetsView(
+        blocks,
+        reinterpret_cast<const uint16_t*>(data + layout.Deltas),
+        reinterpret_cast<const uint64_t*>(data + layout.WideValues),
+        header.WideValuesCount,
+        header.PhonemesCount
+    );
+    return script;
+}
+
+void TTokenizedScript::Save(const std::filesystem::path& path) const {
+    static std::atomic<uint64_t> tmpCounter = 0;
+
+    THeader header = {};
+    std::memcpy(header.Magic, Magic, sizeof(Magic));
+    header.Version = Version;
+    header.ByteOrderMark = ByteOrderMark;
+    header.TextHash = TextHash_;
+    header.TextSize = Text_.size();
+    header.TokenizerIdSize = TokenizerId_.size();
+    header.PhonemesCount = Phonemes_.size();
+    header.WideValuesCount = Offsets_.GetWideValuesCount();
+    const size_t blocks = TPhonemeOffsetsView::BlocksCount(header.PhonemesCount);
+
+    std::filesystem::path tmpPath = path;
+    tmpPath += ".tmp." + std::to_string(getpid()) + "." + std::to_string(tmpCounter.fetch_add(1));
+    {
+        std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+        WriteSection(out, &header, sizeof(header));
+        WriteSection(out, Offsets_.GetBlocks(), blocks * sizeof(TPhonemeOffsetsView::TBlock));
+        WriteSection(out, Offsets_.GetWideValues(), header.WideValuesCount * sizeof(uint64_t));
+        WriteSection(out, Offsets_.GetDeltas(), blocks * TPhonemeOffsetsView::BlockSize * sizeof(uint16_t));
+        WriteSection(out, Phonemes_.data(), Phonemes_.size() * sizeof(TPhoneme));
+        WriteSection(out, Text_.data(), Text_.size());
+        WriteSection(out, TokenizerId_.data(), TokenizerId_.size());
+        out.close();
+        if (!out) {
+            std::error_code ec;
+            std::filesystem::remove(tmpPath, ec);
+            throw std::runtime_error("Can't write script file " + tmpPath.string());
+        }
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(tmpPath, path, ec);
+    if (ec) {
+        std::filesystem::remove(tmpPath, ec);
+        throw std::runtime_error("Can't write script file " + path.string());
+    }
+}
+
+} // namespace NTruePrompter::NRecognition
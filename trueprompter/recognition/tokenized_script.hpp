@@ -0,0 +1,114 @@
+#pragma once
+
+#include "phoneme.hpp"
+#include "phoneme_index.hpp"
+#include "tokenizer.hpp"
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+namespace NTruePrompter::NRecognition {
+
+uint64_t HashScriptText(std::string_view text);
+
+// Number of unicode characters in utf-8 text
+size_t CountTextChars(std::string_view text);
+
+/**
+ * Script text with its phonemes and phoneme to text offsets, immutable once built.
+ * Either owns its arrays after tokenization or reads them straight from a read-only shared file mapping,
+ * so loading a saved script costs page mapping only and sessions using the same file share physical pages.
+ */
+class TTokenizedScript {
+public:
+    TTokenizedScript(const TTokenizedScript&) = delete;
+    TTokenizedScript& operator=(const TTokenizedScript&) = delete;
+
+    ~TTokenizedScript();
+
+    static std::shared_ptr<const TTokenizedScript> FromText(const std::string& text, ITokenizer& tokenizer);
+
+    // Offsets must have one value per phoneme
+    static std::shared_ptr<const TTokenizedScript> FromTokens(std::string text, std::string tokenizerId, std::vector<TPhoneme> phonemes, TPhonemeOffsets offsets);
+
+    /**
+     * Text with unicode characters [from, to) replaced, throws if the range is out of text.
+     */
+    static std::string EditText(std::string_view text, size_t from, size_t to, std::string_view replacement);
+
+    /**
+     * Script of EditText(GetText(), from, to, replacement). Only the range widened by the tokenizer is tokenized again,
+     * tokens around it are copied with shifted offsets. Tokenizer must be the one of the script.
+     */
+    std::shared_ptr<const TTokenizedScript> Edit(size_t from, size_t to, const std::string& replacement, ITokenizer& tokenizer) const;
+
+    /**
+     * Maps a file written by Save, throws if it is not a valid script file.
+     */
+    static std::shared_ptr<const TTokenizedScript> Load(const std::filesystem::path& path);
+
+    /**
+     * Writes to a temporary file next to path and renames it, so readers never see a partial file.
+     */
+    void Save(const std::filesystem::path& path) const;
+
+    std::string_view GetText() const {
+        return Text_;
+    }
+
+    uint64_t GetTextHash() const {
+        return TextHash_;
+    }
+
+    // ITokenizer::GetId of the tokenizer that produced phonemes
+    std::string_view GetTokenizerId() const {
+        return TokenizerId_;
+    }
+
+    std::span<const TPhoneme> GetPhonemes() const {
+        return Phonemes_;
+    }
+
+    const TPhonemeOffsetsView& GetOffsets() const {
+        return Offsets_;
+    }
+
+    /**
+     * Relocation index over phonemes, built on first call and shared by all users of the script.
+     */
+    const TPhonemeIndex& GetIndex() const;
+
+private:
+    TTokenizedScript() = default;
+
+    void SetOwned();
+
+private:
+    // Owned storage, empty for mapped scripts
+    std::string OwnedText_;
+    std::string OwnedTokenizerId_;
+    std::vector<TPhoneme> OwnedPhonemes_;
+    TPhonemeOffsets OwnedOffsets_;
+
+    // Mapped storage
+    void* Mapping_ = nullptr;
+    size_t MappingSize_ = 0;
+
+    std::string_view Text_;
+    uint64_t TextHash_ = 0;
+    std::string_view TokenizerId_;
+    std::span<const TPhoneme> Phonemes_;
+    TPhonemeOffsetsView Offsets_;
+
+    mutable std::once_flag IndexBuilt_;
+    mutable std::unique_ptr<TPhonemeIndex> Index_;
+};
+
+} // namespace NTruePrompter::NRecognition
@@ -1,16 +1,45 @@
 #pragma once
 
+#include "phoneme.hpp"
+
+#include <limits>
 #include <memory>
 #include <span>
 #include <string>
+#include <utility>
 #include <vector>
 
 
 namespace NTruePrompter::NRecognition {
 
+/**
+ * Word to phonemes conversion (g2p).
+ */
+class IPhoneticizer {
+public:
+    virtual ~IPhoneticizer() = default;
+    virtual std::vector<TPhoneme> Phoneticize(const std::string& word) const = 0;
+    // Changes whenever the same word may get different phonemes, e.g. with a new g2p model
+    virtual std::string GetVersion() const = 0;
+};
+
 class ITokenizer {
 public:
-    virtual bool Apply(const std::string& text, std::vector<int64_t>* tokensOut, std::vector<size_t>* tokensOffsetsOut = nullptr) = 0;
+    virtual bool Apply(const std::string& text, std::vector<TPhoneme>* tokensOut, TPhonemeOffsets* tokensOffsetsOut = nullptr) = 0;
+    // Same id guarantees the same tokens for the same text, saved scripts are keyed by it
+    virtual std::string GetId() const = 0;
+
+    /**
+     * Widens unicode characters range [from, to) of text to the range to retokenize after the range has changed.
+     * Tokens outside of the returned range must not depend on it, tokens inside must be the same
+     * as Apply gives for the range text alone, shifted by its start. Whole text by default, max means text end.
+     */
+    virtual std::pair<size_t, size_t> GetRetokenizeRange(const std::string& text, size_t from, size_t to) const {
+        (void)text;
+        (void)from;
+        (void)to;
+        return { 0, std::numeric_limits<size_t>::max() };
+    }
 };
 
 class ITokenizerFactory {
@@ -2,6 +2,17 @@
 #include <trueprompter/common/proto/protocol.pb.h>
 #include <trueprompter/recognition/kaldi/kaldi.hpp>
 #include <trueprompter/recognition/matcher.hpp>
+#include <trueprompter/recognition/recognizer_pool.hpp>
+#include <trueprompter/recognition/script_cache.hpp>
+#include <trueprompter/recognition/script_registry.hpp>
+#include <trueprompter/server/proto/config.pb.h>
+
+#include <google/protobuf/text_format.h>
+
+#include <boost/asio/post.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/asio/thread_pool.hpp>
 
 #include <websocketpp/server.hpp>
 #include <websocketpp/config/asio.hpp>
@@ -10,11 +21,20 @@
 #include <spdlog/sinks/stdout_sinks.h>
 #include <spdlog/sinks/rotating_file_sink.h>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
 #include <cstdlib>
+#include <deque>
+#include <fstream>
 #include <functional>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <optional>
+#include <thread>
 
 
 class TClientContext {
@@ -24,24 +44,40 @@ public:
     TClientContext& operator=(const TClientContext&) = delete;
     TClientContext& operator=(TClientContext&&) noexcept = delete;
 
-    TClientContext(const std::string& clientId, std::shared_ptr<NTruePrompter::NRecognition::IRecognizerFactory> recognizerFactory, std::shared_ptr<NTruePrompter::NRecognition::ITokenizerFactory> tokenizerFactory)
+    TClientContext(const std::string& clientId, std::shared_ptr<NTruePrompter::NRecognition::IRecognizerFactory> recognizerFactory, std::shared_ptr<NTruePrompter::NRecognition::ITokenizerFactory> tokenizerFactory, std::shared_ptr<const NTruePrompter::NRecognition::TScriptCache> scriptCache, std::shared_ptr<NTruePrompter::NRecognition::TScriptRegistry> scriptRegistry)
         : ClientId_(clientId)
         , RecognizerFactory_(std::move(recognizerFactory))
         , TokenizerFactory_(std::move(tokenizerFactory))
+        , ScriptCache_(std::move(scriptCache))
+        , ScriptRegistry_(std::move(scriptRegistry))
     {
         SPDLOG_INFO("Client connected (client_id: \"{}\")", ClientId_);
     }
 
     ~TClientContext() {
+        if (Matcher_) {
+            LogSpeechBufferStats();
+        }
         SPDLOG_INFO("Client disconnected (client_id: \"{}\")", ClientId_);
     }
 
-    std::optional<NTruePrompter::NCommon::NProto::TResponse> HandleMessage(const NTruePrompter::NCommon::NProto::TRequest& request) {
+    /**
+     * Recognition results are not replied, the server pushes GetTextPos() changes on its own.
+     */
+    void HandleMessage(const NTruePrompter::NCommon::NProto::TRequest& request) {
         SPDLOG_DEBUG("Client message received (client_id: \"{}\")", ClientId_);
 
         if (!Initialized_) {
             if (request.has_handshake()) {
                 ClientName_ = request.handshake().client_name();
+                if (request.handshake().speech_buffer_capacity()) {
+                    // Clients don't get to allocate arbitrary memory on the server
+                    SpeechBufferCapacity_ = std::min<size_t>(request.handshake().speech_buffer_capacity(), 1 << 16);
+                }
+                if (!NTruePrompter::NCommon::NProto::ELatencyProfile_IsValid(request.handshake().latency_profile())) {
+                    throw std::runtime_error("Unknown latency profile");
+                }
+                LatencyProfile_ = request.handshake().latency_profile();
                 Initialized_ = true;
                 SPDLOG_INFO("Client initialized with handshake (client_id: \"{}\", handshake: {{ {} }})", ClientId_, request.handshake().ShortDebugString());
             } else {
@@ -51,10 +87,11 @@ public:
         }
 
         if (request.has_text_data()) {
-            // TODO do not recreate matcher and do not reset recognizer
+            // New text is a new session state, live changes come as text_edit and keep it
             if (!request.text_data().language().empty() && Language_ != request.text_data().language()) {
                 Language_ = request.text_data().language();
-                Recognizer_ = RecognizerFactory_->New(*Language_);
+                Recognizer_ = RecognizerFactory_->New(*Language_, GetRecognizerLatencyProfile());
+                Recognizer_->SetDecodingLevel(DecodingLevel_);
                 Tokenizer_ = TokenizerFactory_->New(*Language_);
             }
             if (!Language_.has_value()) {
@@ -62,7 +99,10 @@ public:
             }
             Recognizer_->Reset();
             auto params = Matcher_ ? Matcher_->GetMatchParameters() : NTruePrompter::NRecognition::TPhonemesMatcher::TMatchParameters();
-            Matcher_ = std::make_shared<NTruePrompter::NRecognition::TWordsMatcher>(request.text_data().text(), Recognizer_, Tokenizer_);
+            if (Matcher_) {
+                LogSpeechBufferStats();
+            }
+            Matcher_ = std::make_shared<NTruePrompter::NRecognition::TWordsMatcher>(GetScript(request.text_data().text()), Recognizer_, SpeechBufferCapacity_);
             Matcher_->SetCurrentPos(request.text_data().text_pos());
             Matcher_->SetMatchParameters(params);
             SPDLOG_DEBUG("Client text data provided (client_id: \"{}\", text_data: {{ {} }})", ClientId_, request.text_data().ShortDebugString());
@@ -72,6 +112,28 @@ public:
             throw std::runtime_error("No language was provided");
         }
 
+        if (request.has_text_edit()) {
+            if (!Matcher_) {
+                throw std::runtime_error("No text data provided");
+            }
+            const auto& edit = request.text_edit();
+            auto script = Matcher_->GetScript();
+            const std::string text = NTruePrompter::NRecognition::TTokenizedScript::EditText(script->GetText(), edit.from(), edit.to(), edit.replacement());
+            auto edited = ScriptRegistry_->GetOrCreate(*Language_, text, std::string(script->GetTokenizerId()), [&]() {
+                return script->Edit(edit.from(), edit.to(), edit.replacement(), *Tokenizer_);
+            });
+
+            // Position inside the replaced range moves to its start, after it moves with the text
+            size_t textPos = Matcher_->GetCurrentPos();
+            if (textPos >= edit.to()) {
+                textPos = textPos - edit.to() + edit.from() + NTruePrompter::NRecognition::CountTextChars(edit.replacement());
+            } else if (textPos > edit.from()) {
+                textPos = edit.from();
+            }
+            Matcher_->SetScript(std::move(edited), textPos);
+            SPDLOG_DEBUG("Client text edited (client_id: \"{}\", from: {}, to: {}, replacement_size: {})", ClientId_, edit.from(), edit.to(), edit.replacement().size());
+        }
+
         if (request.has_matcher_params()) { 
             // TODO rework parsing
             NTruePrompter::NRecognition::TPhonemesMatcher::TMatchParameters params;
@@ -96,6 +158,18 @@ public:
             if (request.matcher_params().has_min_match_weight()) {
                 params.MinMatchWeight = request.matcher_params().min_match_weight().value();
             }
+            if (request.matcher_params().has_relocation_min_match_weight()) {
+                params.RelocationMinMatchWeight = request.matcher_params().relocation_min_match_weight().value();
+            }
+            if (request.matcher_params().has_initial_look_ahead()) {
+                params.InitialLookAhead = request.matcher_params().initial_look_ahead().value();
+            }
+            if (request.matcher_params().has_look_ahead_growth()) {
+                params.LookAheadGrowth = request.matcher_params().look_ahead_growth().value();
+            }
+            if (request.matcher_params().has_max_cells_per_update()) {
+                params.MaxCellsPerUpdate = request.matcher_params().max_cells_per_update().value();
+            }
             Matcher_->SetMatchParameters(params);
             SPDLOG_DEBUG("Client matcher parameters changed (client_id: \"{}\", matcher_parameters: {{ {} }})", ClientId_, request.matcher_params().ShortDebugString());
         }
@@ -112,6 +186,13 @@ public:
                         Matcher_->AcceptWaveform(data, size, Decoder_->GetSampleRate());
                         SPDLOG_DEBUG("Client audio decoded (client_id: \"{}\", samples: [{}, ...])", ClientId_, *data);
                     });
+                    Decoder_->SetS16Callback([this](const int16_t* data, size_t size) {
+                        if (!data || !size) {
+                            return;
+                        }
+                        Matcher_->AcceptWaveform(data, size, Decoder_->GetSampleRate());
+                        SPDLOG_DEBUG("Client audio decoded (client_id: \"{}\", samples: [{}, ...])", ClientId_, *data);
+                    });
                     SPDLOG_DEBUG("Client decoder reset (client_id: \"{}\")", ClientId_);
                 }
             }
@@ -122,23 +203,96 @@ public:
                 }
                 SPDLOG_DEBUG("Client audio data provided (client_id: \"{}\", audio_data: binary)", ClientId_);
                 Decoder_->Decode(reinterpret_cast<const uint8_t*>(request.audio_data().data().data()), request.audio_data().data().size());
-                // TODO async
-                NTruePrompter::NCommon::NProto::TResponse response;
-                response.mutable_recognition_result()->set_text_pos(Matcher_->GetCurrentPos());
-                SPDLOG_DEBUG("Client sending recognition result (client_id: \"{}\", recognition_result: {{ {} }})", ClientId_, response.recognition_result().ShortDebugString());
-                return response;
             }
         }
+    }
+
+    const std::string& GetClientId() const {
+        return ClientId_;
+    }
+
+    std::optional<size_t> GetTextPos() const {
+        if (!Matcher_) {
+            return std::nullopt;
+        }
+        return Matcher_->GetCurrentPos();
+    }
+
+    size_t GetDecodingLevel() const {
+        return DecodingLevel_;
+    }
+
+    size_t GetMaxDecodingLevel() const {
+        return Recognizer_ ? Recognizer_->GetMaxDecodingLevel() : 0;
+    }
+
+    void SetDecodingLevel(size_t level) {
+        DecodingLevel_ = level;
+        if (Recognizer_) {
+            Recognizer_->SetDecodingLevel(level);
+        }
+    }
+
+    NTruePrompter::NCommon::NProto::ELatencyProfile GetLatencyProfile() const {
+        return LatencyProfile_;
+    }
+
+    double GetUndecodedSeconds() const {
+        return Recognizer_ ? Recognizer_->GetUndecodedSeconds() : 0;
+    }
+
+private:
+    NTruePrompter::NRecognition::ELatencyProfile GetRecognizerLatencyProfile() const {
+        switch (LatencyProfile_) {
+            case NTruePrompter::NCommon::NProto::LIVE:
+                return NTruePrompter::NRecognition::ELatencyProfile::Live;
+            case NTruePrompter::NCommon::NProto::REHEARSAL:
+                return NTruePrompter::NRecognition::ELatencyProfile::Rehearsal;
+            default:
+                return NTruePrompter::NRecognition::ELatencyProfile::Balanced;
+        }
+    }
+
+    // Script in use by other sessions first, then the one saved on disk, tokenization only if neither exists
+    std::shared_ptr<const NTruePrompter::NRecognition::TTokenizedScript> GetScript(const std::string& text) const {
+        const std::string tokenizerId = Tokenizer_->GetId();
+        auto script = ScriptRegistry_->GetOrCreate(*Language_, text, tokenizerId, [&]() {
+            if (auto script = ScriptCache_->Find(*Language_, text, tokenizerId)) {
+                SPDLOG_DEBUG("Client script loaded from cache (client_id: \"{}\", text_hash: {:016x})", ClientId_, script->GetTextHash());
+                return script;
+            }
+
+            auto script = NTruePrompter::NRecognition::TTokenizedScript::FromText(text, *Tokenizer_);
+            try {
+                ScriptCache_->Store(*Language_, *script);
+            } catch (const std::exception& e) {
+                // Session works without the cache, only the next load gets slower
+                SPDLOG_WARN("Client script not saved to cache (client_id: \"{}\", error: \"{}\")", ClientId_, e.what());
+            }
+            return script;
+        });
+
+        const auto stats = ScriptRegistry_->GetStats();
+        SPDLOG_DEBUG("Client script acquired (client_id: \"{}\", text_hash: {:016x}, registry_hits: {}, registry_misses: {}, registry_size: {})", ClientId_, script->GetTextHash(), stats.Hits, stats.Misses, stats.Size);
+        return script;
+    }
 
-        return std::nullopt;
+    void LogSpeechBufferStats() const {
+        const auto& stats = Matcher_->GetSpeechBufferStats();
+        SPDLOG_INFO("Client speech buffer stats (client_id: \"{}\", capacity: {}, high_water_mark: {}, dropped: {})", ClientId_, SpeechBufferCapacity_, stats.HighWaterMark, stats.Dropped);
     }
 
 private:
     bool Initialized_ = false;
     std::string ClientId_;
     std::string ClientName_;
+    size_t SpeechBufferCapacity_ = 1024;
+    size_t DecodingLevel_ = 0;
+    NTruePrompter::NCommon::NProto::ELatencyProfile LatencyProfile_ = NTruePrompter::NCommon::NProto::BALANCED;
     std::shared_ptr<NTruePrompter::NRecognition::IRecognizerFactory> RecognizerFactory_;
     std::shared_ptr<NTruePrompter::NRecognition::ITokenizerFactory> TokenizerFactory_;
+    std::shared_ptr<const NTruePrompter::NRecognition::TScriptCache> ScriptCache_;
+    std::shared_ptr<NTruePrompter::NRecognition::TScriptRegistry> ScriptRegistry_;
     std::shared_ptr<NTruePrompter::NRecognition::IRecognizer> Recognizer_;
     std::shared_ptr<NTruePrompter::NRecognition::ITokenizer> Tokenizer_;
     std::shared_ptr<NTruePrompter::NRecognition::TWordsMatcher> Matcher_;
@@ -146,90 +300,585 @@ private:
     std::optional<std::string> Language_;
 };
 
+/**
+ * Worker time spent on a session per second of wall time, averaged over the last Window.
+ * 1 means the session keeps one worker thread busy, safe to share between threads.
+ */
+class TLoadMeter {
+public:
+    void Add(std::chrono::steady_clock::duration busy, std::chrono::steady_clock::time_point now) {
+        std::lock_guard<std::mutex> guard(Mutex_);
+        Decay(now);
+        Load_ += std::chrono::duration<double>(busy).count() / Window.count();
+    }
+
+    double Get(std::chrono::steady_clock::time_point now) {
+        std::lock_guard<std::mutex> guard(Mutex_);
+        Decay(now);
+        return Load_;
+    }
+
+private:
+    static constexpr std::chrono::duration<double> Window = std::chrono::seconds(10);
+
+    void Decay(std::chrono::steady_clock::time_point now) {
+        if (now > Time_) {
+            Load_ *= std::exp(-std::chrono::duration<double>(now - Time_).count() / Window.count());
+            Time_ = now;
+        }
+    }
+
+private:
+    std::mutex Mutex_;
+    double Load_ = 0;
+    std::chrono::steady_clock::time_point Time_;
+};
+
+/**
+ * Decoding level of one session, see IRecognizer::SetDecodingLevel. Steps up while the server is loaded or the session lags,
+ * steps down when load is low again. Levels change by one at most once per HoldTime, so they don't flap around a threshold.
+ */
+class TDecodingLevelController {
+public:
+    // Server load thresholds, as a share of worker threads
+    static constexpr double HighLoad = 0.8;
+    static constexpr double LowLoad = 0.6;
+    static constexpr std::chrono::seconds HoldTime = std::chrono::seconds(2);
+
+    size_t Update(double load, bool lagging, size_t maxLevel, std::chrono::steady_clock::time_point now) {
+        if (now < ChangeTime_ + HoldTime) {
+            return Level_;
+        }
+        if ((load > HighLoad || lagging) && Level_ < maxLevel) {
+            ++Level_;
+            ChangeTime_ = now;
+        } else if (load < LowLoad && !lagging && Level_ > 0) {
+            --Level_;
+            ChangeTime_ = now;
+        }
+        MaxLevel_ = std::max(MaxLevel_, Level_);
+        return Level_;
+    }
+
+    size_t GetLevel() const {
+        return Level_;
+    }
+
+    size_t GetMaxLevel() const {
+        return MaxLevel_;
+    }
+
+private:
+    size_t Level_ = 0;
+    size_t MaxLevel_ = 0;
+    std::chrono::steady_clock::time_point ChangeTime_;
+};
+
+/**
+ * Speech to position latencies by BucketWidth, latencies over the last bucket fall into it.
+ */
+class TLatencyHistogram {
+public:
+    static constexpr std::chrono::milliseconds BucketWidth = std::chrono::milliseconds(10);
+
+    void Add(std::chrono::steady_clock::duration latency) {
+        const auto ms = std::max<int64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(latency).count(), 0);
+        ++Buckets_[std::min<size_t>(ms / BucketWidth.count(), Buckets_.size() - 1)];
+        ++Count_;
+        Max_ = std::max(Max_, std::chrono::milliseconds(ms));
+    }
+
+    uint64_t GetCount() const {
+        return Count_;
+    }
+
+    // Upper bound of the bucket with the quantile
+    std::chrono::milliseconds GetQuantile(double quantile) const {
+        uint64_t count = 0;
+        for (size_t i = 0; i < Buckets_.size(); ++i) {
+            count += Buckets_[i];
+            if (count > quantile * Count_) {
+                return std::min<std::chrono::milliseconds>(BucketWidth * (i + 1), Max_);
+            }
+        }
+        return Max_;
+    }
+
+    std::chrono::milliseconds GetMax() const {
+        return Max_;
+    }
+
+private:
+    std::array<uint64_t, 500> Buckets_{};
+    uint64_t Count_ = 0;
+    std::chrono::milliseconds Max_{};
+};
+
 class TTruePrompterServer {
 public:
     using TWebSocketServer = websocketpp::server<websocketpp::config::asio>;
 
-    TTruePrompterServer(const std::shared_ptr<NTruePrompter::NRecognition::IRecognizerFactory>& recognizerFactory, const std::shared_ptr<NTruePrompter::NRecognition::ITokenizerFactory>& tokenizerFactory)
+    struct TParameters {
+        size_t IOThreads = 1;
+        // 0 means one per core
+        size_t WorkerThreads = 0;
+        // Per latency profile
+        std::chrono::milliseconds MinResultInterval = std::chrono::milliseconds(100);
+        std::chrono::milliseconds LiveResultInterval = std::chrono::milliseconds(40);
+        std::chrono::milliseconds RehearsalResultInterval = std::chrono::milliseconds(250);
+        NTruePrompter::NServer::NProto::EOverloadPolicy OverloadPolicy = NTruePrompter::NServer::NProto::DROP;
+        std::chrono::milliseconds MaxAudioLag = std::chrono::milliseconds(2000);
+        size_t MaxQueuedMessages = 256;
+        // Share of worker threads, 0 admits everyone
+        double MaxLoad = 0.9;
+        bool AdaptiveDecoding = true;
+    };
+
+    TTruePrompterServer(const std::shared_ptr<NTruePrompter::NRecognition::IRecognizerFactory>& recognizerFactory, const std::shared_ptr<NTruePrompter::NRecognition::ITokenizerFactory>& tokenizerFactory, const std::shared_ptr<const NTruePrompter::NRecognition::TScriptCache>& scriptCache, const TParameters& params)
         : RecognizerFactory_(recognizerFactory)
         , TokenizerFactory_(tokenizerFactory)
-    {}
+        , ScriptCache_(scriptCache)
+        , ScriptRegistry_(std::make_shared<NTruePrompter::NRecognition::TScriptRegistry>())
+        , Params_(params)
+    {
+        Params_.IOThreads = std::max<size_t>(Params_.IOThreads, 1);
+        if (!Params_.WorkerThreads) {
+            Params_.WorkerThreads = std::max(std::thread::hardware_concurrency(), 1u);
+        }
+        Params_.MaxQueuedMessages = std::max<size_t>(Params_.MaxQueuedMessages, 1);
+    }
 
+    /**
+     * I/O threads only parse and send messages, everything else is done by worker threads.
+     * Messages of one client wait in its bounded queue and are handled in order on its strand, so a client context is never used concurrently.
+     */
     void Run(uint16_t port) {
         TWebSocketServer server;
+        boost::asio::thread_pool workers(Params_.WorkerThreads);
 
         try {
             server.clear_access_channels(websocketpp::log::alevel::all);
             server.clear_error_channels(websocketpp::log::elevel::all);
             server.init_asio();
 
-            server.set_open_handler([&server, this](websocketpp::connection_hdl hdl) {
-                Clients_.emplace(hdl, std::make_shared<TClientContext>(server.get_con_from_hdl(hdl)->get_remote_endpoint(), RecognizerFactory_, TokenizerFactory_));
+            server.set_open_handler([&server, &workers, this](websocketpp::connection_hdl hdl) {
+                auto client = std::make_shared<TClient>(
+                    std::make_shared<TClientContext>(server.get_con_from_hdl(hdl)->get_remote_endpoint(), RecognizerFactory_, TokenizerFactory_, ScriptCache_, ScriptRegistry_),
+                    boost::asio::make_strand(workers)
+                );
+                std::lock_guard<std::mutex> guard(ClientsMutex_);
+                Clients_.emplace(hdl, std::move(client));
             });
 
             server.set_close_handler([this](websocketpp::connection_hdl hdl) {
-                Clients_.erase(hdl);
+                std::shared_ptr<TClient> client;
+                {
+                    std::lock_guard<std::mutex> guard(ClientsMutex_);
+                    auto it = Clients_.find(hdl);
+                    if (it != Clients_.end()) {
+                        client = std::move(it->second);
+                        Clients_.erase(it);
+                    }
+                }
+                if (client) {
+                    // Backlog of a gone peer is not decoded, the scheduled drain only releases the client
+                    client->Closed = true;
+                    std::lock_guard<std::mutex> guard(client->QueueMutex);
+                    client->Queue.clear();
+                }
+                LogLatencyStats();
             });
 
             server.set_message_handler([&server, this](websocketpp::connection_hdl hdl, TWebSocketServer::message_ptr msg) {
-                std::optional<NTruePrompter::NCommon::NProto::TResponse> res;
-                bool shouldClose = false;
-
-                try {
-                    if (msg->get_opcode() != websocketpp::frame::opcode::binary) {
-                        SPDLOG_WARN("Server non-binary message received (client_id: \"{}\")", server.get_con_from_hdl(hdl)->get_remote_endpoint());
-                        throw std::runtime_error("Non-binary message received");
+                std::shared_ptr<TClient> client;
+                {
+                    std::lock_guard<std::mutex> guard(ClientsMutex_);
+                    auto it = Clients_.find(hdl);
+                    if (it == Clients_.end()) {
+                        return;
                     }
+                    client = it->second;
+                }
+                Enqueue(server, hdl, client, ParseMessage(msg));
+            });
 
-                    std::shared_ptr<TClientContext>& clientContext = Clients_.at(hdl);
+            server.listen(port);
+            server.start_accept();
 
-                    NTruePrompter::NCommon::NProto::TRequest request;
-                    if (!request.ParseFromString(msg->get_payload())) {
-                        SPDLOG_WARN("Server broken message received (client_id: \"{}\")", server.get_con_from_hdl(hdl)->get_remote_endpoint());
-                        throw std::runtime_error("Broken message received");
-                    }
+            std::vector<std::thread> ioThreads;
+            for (size_t i = 1; i < Params_.IOThreads; ++i) {
+                ioThreads.emplace_back([&server]() {
+                    RunIO(server);
+                });
+            }
+            RunIO(server);
+            for (auto& thread : ioThreads) {
+                thread.join();
+            }
+        } catch (const std::exception& e) {
+            SPDLOG_ERROR("Server received exception (error: \"{}\")", e.what());
+        }
 
-                    res = Clients_.at(hdl)->HandleMessage(request);
-                } catch (const std::exception& e) {
-                    res.emplace();
-                    res->mutable_error()->set_what(e.what());
-                    shouldClose = true;
-                } catch (...) {
-                    res.emplace();
-                    res->mutable_error()->set_what("generic error");
-                    shouldClose = true;
-                }
+        // Handlers reference the server, it must outlive them
+        workers.join();
+        std::lock_guard<std::mutex> guard(ClientsMutex_);
+        Clients_.clear();
+    }
 
-                try {
-                    if (res.has_value()) {
-                        server.send(hdl, res->SerializeAsString(), websocketpp::frame::opcode::binary);
-                    }
-                } catch (...) {
-                    shouldClose = true;
+private:
+    struct TQueuedMessage {
+        // Null if the message is broken, Error tells why
+        std::shared_ptr<const NTruePrompter::NCommon::NProto::TRequest> Request;
+        std::string Error;
+        bool AudioOnly = false;
+        std::chrono::steady_clock::time_point ReceivedAt;
+    };
+
+    // Queue fields are guarded by QueueMutex, Load and Closed are thread safe, everything else but Context is used on Strand only
+    struct TClient {
+        TClient(std::shared_ptr<TClientContext> context, boost::asio::strand<boost::asio::thread_pool::executor_type> strand)
+            : Context(std::move(context))
+            , Strand(std::move(strand))
+            , ResultTimer(Strand)
+        {}
+
+        ~TClient() {
+            SPDLOG_INFO("Client queue stats (client_id: \"{}\", max_lag_ms: {}, stale_dropped: {}, overflow_dropped: {}, max_decoding_level: {})",
+                Context->GetClientId(), std::chrono::duration_cast<std::chrono::milliseconds>(MaxLag).count(), StaleDropped, OverflowDropped, DecodingLevel.GetMaxLevel());
+            SPDLOG_INFO("Client latency stats (client_id: \"{}\", latency_profile: {}, results: {}, p50_ms: {}, p95_ms: {}, max_ms: {})",
+                Context->GetClientId(), NTruePrompter::NCommon::NProto::ELatencyProfile_Name(Context->GetLatencyProfile()), Latency.GetCount(),
+                Latency.GetQuantile(0.5).count(), Latency.GetQuantile(0.95).count(), Latency.GetMax().count());
+        }
+
+        std::shared_ptr<TClientContext> Context;
+        boost::asio::strand<boost::asio::thread_pool::executor_type> Strand;
+
+        std::mutex QueueMutex;
+        std::deque<TQueuedMessage> Queue;
+        bool DrainScheduled = false;
+        uint64_t OverflowDropped = 0;
+
+        TLoadMeter Load;
+        bool Admitted = false;
+        // Set by the close handler or on the strand once the session is over
+        std::atomic<bool> Closed = false;
+        // Time the last audio waited in the queue, i.e. how far recognition is behind the speaker
+        std::chrono::steady_clock::duration Lag{};
+        std::chrono::steady_clock::duration MaxLag{};
+        bool Lagging = false;
+        uint64_t StaleSeen = 0;
+        uint64_t StaleDropped = 0;
+        TDecodingLevelController DecodingLevel;
+
+        boost::asio::steady_timer ResultTimer;
+        bool ResultTimerArmed = false;
+        std::optional<size_t> SentTextPos;
+        std::chrono::steady_clock::time_point SentTime;
+        // When the speech that first moved the position since the last sent result was heard
+        std::optional<std::chrono::steady_clock::time_point> PendingSpeechTime;
+        TLatencyHistogram Latency;
+    };
+
+    static void RunIO(TWebSocketServer& server) {
+        try {
+            server.run();
+        } catch (const std::exception& e) {
+            SPDLOG_ERROR("Server received exception (error: \"{}\")", e.what());
+            server.stop();
+        }
+    }
+
+    // Runs on I/O threads, so workers spend their time on recognition only
+    static TQueuedMessage ParseMessage(TWebSocketServer::message_ptr msg) {
+        TQueuedMessage message;
+        message.ReceivedAt = std::chrono::steady_clock::now();
+        if (msg->get_opcode() != websocketpp::frame::opcode::binary) {
+            message.Error = "Non-binary message received";
+            return message;
+        }
+
+        auto request = std::make_shared<NTruePrompter::NCommon::NProto::TRequest>();
+        if (!request->ParseFromString(msg->get_payload())) {
+            message.Error = "Broken message received";
+            return message;
+        }
+        // Meta may reset the decoder, such messages are never shed
+        message.AudioOnly = request->has_audio_data() && !request->audio_data().has_meta() && !request->has_handshake()
+            && !request->has_text_data() && !request->has_text_edit() && !request->has_matcher_params();
+        message.Request = std::move(request);
+        return message;
+    }
+
+    /**
+     * Queues the message and schedules the queue drain on the client strand unless it is scheduled already.
+     * Full queue drops its oldest audio, other messages are always kept as they change session state.
+     * Messages racing the close of the session are dropped, nothing would handle them.
+     */
+    void Enqueue(TWebSocketServer& server, websocketpp::connection_hdl hdl, const std::shared_ptr<TClient>& client, TQueuedMessage message) {
+        {
+            std::lock_guard<std::mutex> guard(client->QueueMutex);
+            if (client->Closed) {
+                return;
+            }
+            if (client->Queue.size() >= Params_.MaxQueuedMessages) {
+                auto it = std::find_if(client->Queue.begin(), client->Queue.end(), [](const TQueuedMessage& queued) {
+                    return queued.AudioOnly;
+                });
+                if (it != client->Queue.end()) {
+                    client->Queue.erase(it);
+                    ++client->OverflowDropped;
                 }
+            }
+            client->Queue.push_back(std::move(message));
+            if (client->DrainScheduled) {
+                return;
+            }
+            client->DrainScheduled = true;
+        }
+        boost::asio::post(client->Strand, [&server, this, hdl, client]() {
+            Drain(server, hdl, client);
+        });
+    }
+
+    /**
+     * Handles one queued message and reposts itself while the queue is not empty,
+     * so a client with a long backlog does not hold a worker thread from other clients. Runs on the client strand.
+     */
+    void Drain(TWebSocketServer& server, websocketpp::connection_hdl hdl, const std::shared_ptr<TClient>& client) {
+        TQueuedMessage message;
+        {
+            std::lock_guard<std::mutex> guard(client->QueueMutex);
+            // Cleared by the close handler
+            if (client->Queue.empty()) {
+                client->DrainScheduled = false;
+                return;
+            }
+            message = std::move(client->Queue.front());
+            client->Queue.pop_front();
+        }
+
+        if (!client->Closed) {
+            HandleQueuedMessage(server, hdl, client, message);
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(client->QueueMutex);
+            if (client->Queue.empty()) {
+                client->DrainScheduled = false;
+                return;
+            }
+        }
+        boost::asio::post(client->Strand, [&server, this, hdl, client]() {
+            Drain(server, hdl, client);
+        });
+    }
+
+    // Runs on the client strand
+    void HandleQueuedMessage(TWebSocketServer& server, websocketpp::connection_hdl hdl, const std::shared_ptr<TClient>& client, const TQueuedMessage& message) {
+        const auto now = std::chrono::steady_clock::now();
+
+        if (message.AudioOnly) {
+            client->Lag = now - message.ReceivedAt;
+            client->MaxLag = std::max(client->MaxLag, client->Lag);
+            const bool lagging = client->Lag > Params_.MaxAudioLag;
+            if (lagging != client->Lagging) {
+                client->Lagging = lagging;
+                SPDLOG_INFO("Client audio lag {} (client_id: \"{}\", lag_ms: {})", lagging ? "exceeded" : "recovered",
+                    client->Context->GetClientId(), std::chrono::duration_cast<std::chrono::milliseconds>(client->Lag).count());
+            }
+            // Position must follow the speaker, fresh audio is worth more than the backlog
+            if (lagging && ShouldShedStale(*client)) {
+                ++client->StaleDropped;
+                return;
+            }
+        }
+
+        if (message.Request && message.Request->has_handshake() && !client->Admitted) {
+            if (IsOverloaded(now)) {
+                SPDLOG_WARN("Client rejected, server is overloaded (client_id: \"{}\")", client->Context->GetClientId());
+                CloseWithError(server, hdl, websocketpp::close::status::try_again_later, "Server is overloaded, try again later");
+                client->Closed = true;
+                return;
+            }
+            client->Admitted = true;
+        }
+
+        const std::optional<size_t> textPos = client->Context->GetTextPos();
+        if (!HandleMessage(server, hdl, *client->Context, message)) {
+            client->Closed = true;
+            return;
+        }
+        // Newest recognized audio arrived at the end of the message less the audio still undecoded
+        if (message.AudioOnly && !client->PendingSpeechTime && client->Context->GetTextPos() != textPos) {
+            client->PendingSpeechTime = message.ReceivedAt - std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<double>(client->Context->GetUndecodedSeconds()));
+        }
+        client->Load.Add(std::chrono::steady_clock::now() - now, now);
+        if (Params_.AdaptiveDecoding && message.AudioOnly) {
+            UpdateDecodingLevel(*client, now);
+        }
+        PushResult(server, hdl, client);
+    }
 
-                if (shouldClose) {
-                    server.close(hdl, res.has_value() ? res->error().code() : -1, res.has_value() ? res->error().what() : "");
+    // Session lagging half way to shedding decodes cheaper even if the server as a whole has headroom
+    void UpdateDecodingLevel(TClient& client, std::chrono::steady_clock::time_point now) {
+        const double load = GetLoad(now);
+        const size_t level = client.DecodingLevel.Update(load, client.Lag > Params_.MaxAudioLag / 2, client.Context->GetMaxDecodingLevel(), now);
+        if (level != client.Context->GetDecodingLevel()) {
+            SPDLOG_INFO("Client decoding level changed (client_id: \"{}\", decoding_level: {}, load: {:.2f}, lag_ms: {})",
+                client.Context->GetClientId(), level, load, std::chrono::duration_cast<std::chrono::milliseconds>(client.Lag).count());
+            client.Context->SetDecodingLevel(level);
+        }
+    }
+
+    bool ShouldShedStale(TClient& client) const {
+        switch (Params_.OverloadPolicy) {
+            case NTruePrompter::NServer::NProto::DROP:
+                return true;
+            case NTruePrompter::NServer::NProto::DECIMATE:
+                return client.StaleSeen++ % 2 == 1;
+            default:
+                return false;
+        }
+    }
+
+    // Sessions recognize in real time while their total load fits into the worker threads
+    bool IsOverloaded(std::chrono::steady_clock::time_point now) {
+        return Params_.MaxLoad > 0 && GetLoad(now) >= Params_.MaxLoad;
+    }
+
+    // Total load of sessions as a share of worker threads, recomputed at most once per LoadUpdateInterval
+    double GetLoad(std::chrono::steady_clock::time_point now) {
+        std::lock_guard<std::mutex> loadGuard(LoadMutex_);
+        if (now >= LoadTime_ + LoadUpdateInterval) {
+            double load = 0;
+            std::lock_guard<std::mutex> guard(ClientsMutex_);
+            for (const auto& [hdl, client] : Clients_) {
+                load += client->Load.Get(now);
+            }
+            Load_ = load / Params_.WorkerThreads;
+            LoadTime_ = now;
+        }
+        return Load_;
+    }
+
+    std::chrono::milliseconds GetResultInterval(NTruePrompter::NCommon::NProto::ELatencyProfile latencyProfile) const {
+        switch (latencyProfile) {
+            case NTruePrompter::NCommon::NProto::LIVE:
+                return Params_.LiveResultInterval;
+            case NTruePrompter::NCommon::NProto::REHEARSAL:
+                return Params_.RehearsalResultInterval;
+            default:
+                return Params_.MinResultInterval;
+        }
+    }
+
+    /**
+     * Sends text position if it has changed since the last sent one, at most once per result interval of the session latency profile.
+     * Changes within the interval are coalesced, only the latest position is sent when it ends. Runs on the client strand.
+     */
+    void PushResult(TWebSocketServer& server, websocketpp::connection_hdl hdl, const std::shared_ptr<TClient>& client) {
+        const std::optional<size_t> textPos = client->Context->GetTextPos();
+        if (client->ResultTimerArmed) {
+            return;
+        }
+        if (!textPos || textPos == client->SentTextPos) {
+            // Position went back to the sent one, nothing is waiting for it anymore
+            client->PendingSpeechTime.reset();
+            return;
+        }
+
+        const auto now = std::chrono::steady_clock::now();
+        const auto resultInterval = GetResultInterval(client->Context->GetLatencyProfile());
+        if (client->SentTextPos && now < client->SentTime + resultInterval) {
+            client->ResultTimerArmed = true;
+            client->ResultTimer.expires_at(client->SentTime + resultInterval);
+            client->ResultTimer.async_wait([&server, this, hdl, client](const boost::system::error_code&) {
+                client->ResultTimerArmed = false;
+                if (client->Closed) {
+                    return;
                 }
+                PushResult(server, hdl, client);
             });
+            return;
+        }
 
-            server.listen(port);
-            server.start_accept();
-            server.run();
+        NTruePrompter::NCommon::NProto::TResponse response;
+        response.mutable_recognition_result()->set_text_pos(*textPos);
+        SPDLOG_DEBUG("Client sending recognition result (client_id: \"{}\", recognition_result: {{ {} }})", client->Context->GetClientId(), response.recognition_result().ShortDebugString());
+        websocketpp::lib::error_code ec;
+        server.send(hdl, response.SerializeAsString(), websocketpp::frame::opcode::binary, ec);
+        client->SentTextPos = textPos;
+        client->SentTime = now;
+
+        if (client->PendingSpeechTime) {
+            const auto latency = now - *client->PendingSpeechTime;
+            client->Latency.Add(latency);
+            std::lock_guard<std::mutex> guard(LatencyMutex_);
+            Latency_[client->Context->GetLatencyProfile()].Add(latency);
+            client->PendingSpeechTime.reset();
+        }
+    }
+
+    // Speech to position latency of all sessions so far, per latency profile
+    void LogLatencyStats() {
+        std::lock_guard<std::mutex> guard(LatencyMutex_);
+        for (const auto& [latencyProfile, latency] : Latency_) {
+            SPDLOG_INFO("Server latency stats (latency_profile: {}, results: {}, p50_ms: {}, p95_ms: {}, max_ms: {})",
+                NTruePrompter::NCommon::NProto::ELatencyProfile_Name(latencyProfile), latency.GetCount(),
+                latency.GetQuantile(0.5).count(), latency.GetQuantile(0.95).count(), latency.GetMax().count());
+        }
+    }
+
+    // Runs on the client strand, returns false if the connection is closed because of an error
+    static bool HandleMessage(TWebSocketServer& server, websocketpp::connection_hdl hdl, TClientContext& clientContext, const TQueuedMessage& message) {
+        try {
+            if (!message.Request) {
+                SPDLOG_WARN("Server bad message received (client_id: \"{}\", error: \"{}\")", clientContext.GetClientId(), message.Error);
+                throw std::runtime_error(message.Error);
+            }
+
+            clientContext.HandleMessage(*message.Request);
         } catch (const std::exception& e) {
-            SPDLOG_ERROR("Server received exception (error: \"{}\")", e.what());
+            CloseWithError(server, hdl, 0, e.what());
+            return false;
+        } catch (...) {
+            CloseWithError(server, hdl, 0, "generic error");
+            return false;
         }
+        return true;
+    }
+
+    static void CloseWithError(TWebSocketServer& server, websocketpp::connection_hdl hdl, int64_t code, const std::string& what) {
+        NTruePrompter::NCommon::NProto::TResponse res;
+        res.mutable_error()->set_code(code);
+        res.mutable_error()->set_what(what);
+
+        // Connection may be already closed by now, errors are expected and ignored then
+        websocketpp::lib::error_code ec;
+        server.send(hdl, res.SerializeAsString(), websocketpp::frame::opcode::binary, ec);
+        server.close(hdl, code, what, ec);
     }
 
 private:
     std::shared_ptr<NTruePrompter::NRecognition::IRecognizerFactory> RecognizerFactory_;
     std::shared_ptr<NTruePrompter::NRecognition::ITokenizerFactory> TokenizerFactory_;
-    std::map<websocketpp::connection_hdl, std::shared_ptr<TClientContext>, std::owner_less<websocketpp::connection_hdl>> Clients_;
+    std::shared_ptr<const NTruePrompter::NRecognition::TScriptCache> ScriptCache_;
+    std::shared_ptr<NTruePrompter::NRecognition::TScriptRegistry> ScriptRegistry_;
+    TParameters Params_;
+    static constexpr std::chrono::milliseconds LoadUpdateInterval = std::chrono::milliseconds(500);
+    std::mutex LoadMutex_;
+    double Load_ = 0;
+    std::chrono::steady_clock::time_point LoadTime_;
+    std::mutex LatencyMutex_;
+    std::map<NTruePrompter::NCommon::NProto::ELatencyProfile, TLatencyHistogram> Latency_;
+    std::mutex ClientsMutex_;
+    std::map<websocketpp::connection_hdl, std::shared_ptr<TClient>, std::owner_less<websocketpp::connection_hdl>> Clients_;
 };
 
 int main(int argc, char* argv[]) {
     if (argc < 3) {
-        std::cerr << "Expected <port> <models_folder> [<info_log_file> [<debug_log_file>]]" << std::endl;
+        std::cerr << "Expected <port> <models_folder> [<info_log_file> [<debug_log_file> [<config_file>]]]" << std::endl;
         return -1;
     }
 
@@ -260,19 +909,63 @@ int main(int argc, char* argv[]) {
 
     SPDLOG_INFO("Initializing..");
 
-    std::unordered_map<std::string, std::shared_ptr<NTruePrompter::NRecognition::TKaldiModel>> models;
-    for (auto& entry : std::filesystem::directory_iterator(argv[2])) {
-        if (entry.is_directory()) {
-            models[entry.path().filename()] = NTruePrompter::NRecognition::LoadKaldiModel(entry.path());
-            if (entry.path().filename() == "ru") {
-                models["ru+kz"] = NTruePrompter::NRecognition::LoadKaldiModel(entry.path().parent_path() / "ru+kz");
-            }
+    NTruePrompter::NServer::NProto::TServerConfig config;
+    if (argc >= 6) {
+        std::ifstream configFile(argv[5]);
+        std::string configText((std::istreambuf_iterator<char>(configFile)), std::istreambuf_iterator<char>());
+        if (!configFile || !google::protobuf::TextFormat::ParseFromString(configText, &config)) {
+            SPDLOG_ERROR("Can't read config (path: \"{}\")", argv[5]);
+            return -1;
         }
+        SPDLOG_INFO("Config loaded (config: {{ {} }})", config.ShortDebugString());
     }
 
-    auto kaldiRecognizerFactory = NTruePrompter::NRecognition::NewKaldiRecognizerFactory(models);
+    const auto models = NTruePrompter::NRecognition::LoadKaldiModels(argv[2]);
+
+    NTruePrompter::NRecognition::TKaldiDecodingFloors decodingFloors;
+    decodingFloors.Beam = config.min_decoding_beam();
+    decodingFloors.MaxActive = config.min_decoding_max_active();
+    std::shared_ptr<NTruePrompter::NRecognition::IRecognizerFactory> kaldiRecognizerFactory = NTruePrompter::NRecognition::NewKaldiRecognizerFactory(models, decodingFloors);
+    const size_t recognizerPoolSize = config.has_recognizer_pool_size() ? config.recognizer_pool_size().value() : 4;
+    if (recognizerPoolSize) {
+        auto recognizerPool = std::make_shared<NTruePrompter::NRecognition::TRecognizerPool>(std::move(kaldiRecognizerFactory), recognizerPoolSize);
+        for (const auto& [name, model] : models) {
+            recognizerPool->Prepare(name, NTruePrompter::NRecognition::ELatencyProfile::Balanced);
+        }
+        kaldiRecognizerFactory = std::move(recognizerPool);
+    }
     auto kaldiTokenizerFactory = NTruePrompter::NRecognition::NewKaldiTokenizerFactory(models);
-    TTruePrompterServer server(kaldiRecognizerFactory, kaldiTokenizerFactory);
+    auto scriptCache = std::make_shared<NTruePrompter::NRecognition::TScriptCache>(
+        config.script_cache_dir().empty() ? std::nullopt : std::optional<std::filesystem::path>(config.script_cache_dir())
+    );
+
+    TTruePrompterServer::TParameters params;
+    params.IOThreads = config.io_threads();
+    params.WorkerThreads = config.worker_threads();
+    if (config.has_min_result_interval_ms()) {
+        params.MinResultInterval = std::chrono::milliseconds(config.min_result_interval_ms().value());
+    }
+    if (config.has_live_result_interval_ms()) {
+        params.LiveResultInterval = std::chrono::milliseconds(config.live_result_interval_ms().value());
+    }
+    if (config.has_rehearsal_result_interval_ms()) {
+        params.RehearsalResultInterval = std::chrono::milliseconds(config.rehearsal_result_interval_ms().value());
+    }
+    params.OverloadPolicy = config.overload_policy();
+    if (config.has_max_audio_lag_ms()) {
+        params.MaxAudioLag = std::chrono::milliseconds(config.max_audio_lag_ms().value());
+    }
+    if (config.has_max_queued_messages()) {
+        params.MaxQueuedMessages = config.max_queued_messages().value();
+    }
+    if (config.has_max_load()) {
+        params.MaxLoad = config.max_load().value();
+    }
+    if (config.has_adaptive_decoding()) {
+        params.AdaptiveDecoding = config.adaptive_decoding().value();
+    }
+
+    TTruePrompterServer server(kaldiRecognizerFactory, kaldiTokenizerFactory, scriptCache, params);
     SPDLOG_INFO("Started");
     server.Run(std::atoi(argv[1]));
 }
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstdlib>
+#include <iostream>
+#include <string_view>
+
+
+namespace NTruePrompter::NTest {
+
+// Test executables stop at the first failed check with a non-zero exit code, so ctest reports them
+inline void Check(bool condition, std::string_view what) {
+    if (!condition) {
+        std::cerr << "Check failed: " << what << std::endl;
+        std::exit(1);
+    }
+}
+
+} // namespace NTruePrompter::NTest
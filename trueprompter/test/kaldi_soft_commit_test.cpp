@@ -0,0 +1,113 @@
+#include "check.hpp"
+
+#include <trueprompter/recognition/kaldi/kaldi.hpp>
+#include <trueprompter/recognition/recognizer.hpp>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+
+using NTruePrompter::NTest::Check;
+using namespace NTruePrompter::NRecognition;
+
+namespace {
+
+// Model and audio are too large for the repository, the test is skipped unless both are given
+constexpr int SkipReturnCode = 77;
+constexpr int32_t SampleRate = 16000;
+// Utterances are cut after 6 seconds plus the soft commit grace, test audio should be a few times longer
+constexpr int32_t CutUtteranceFrames = 200;
+// Phones the decoder may change around a cut, compared to the same audio decoded without cuts
+constexpr size_t PhonesPerCutTolerance = 3;
+
+// Model folder with max-utterance-frames overridden, everything else is linked to the original files
+std::filesystem::path MakeModelCopy(const std::filesystem::path& model, int32_t maxUtteranceFrames) {
+    const auto copy = std::filesystem::temp_directory_path() / ("trueprompter_soft_commit_test_" + std::to_string(maxUtteranceFrames));
+    std::filesystem::remove_all(copy);
+    std::filesystem::create_directories(copy / "conf");
+    for (const auto& entry : std::filesystem::directory_iterator(model)) {
+        if (entry.path().filename() != "conf") {
+            std::filesystem::create_symlink(std::filesystem::absolute(entry.path()), copy / entry.path().filename());
+        }
+    }
+    for (const auto& entry : std::filesystem::directory_iterator(model / "conf")) {
+        if (entry.path().filename() != "model.conf") {
+            std::filesystem::create_symlink(std::filesystem::absolute(entry.path()), copy / "conf" / entry.path().filename());
+        }
+    }
+
+    std::ifstream original(model / "conf/model.conf");
+    std::ofstream conf(copy / "conf/model.conf");
+    conf << original.rdbuf() << "\n--max-utterance-frames=" << maxUtteranceFrames << "\n";
+    return copy;
+}
+
+struct TRecognized {
+    std::vector<TPhoneme> Phones;
+    size_t SoftCommits = 0;
+};
+
+// Phones of every utterance as they would be committed, the last one as its latest partial
+TRecognized Recognize(const std::filesystem::path& model, const std::vector<float>& audio) {
+    auto factory = NewKaldiRecognizerFactory({{"model", LoadKaldiModel(model)}});
+    auto recognizer = factory->New("model", ELatencyProfile::Balanced);
+
+    TRecognized recognized;
+    std::vector<TPhoneme> partial;
+    std::vector<TPhoneme> tokens;
+    const size_t step = SampleRate / 10;
+    for (size_t i = 0; i < audio.size(); i += step) {
+        const bool over = recognizer->Update(audio.data() + i, std::min(step, audio.size() - i), SampleRate, &tokens);
+        if (!over) {
+            partial = tokens;
+            continue;
+        }
+        // Endpoints return no phones, the partial before them is what gets committed
+        if (!tokens.empty()) {
+            partial = tokens;
+            ++recognized.SoftCommits;
+        }
+        recognized.Phones.insert(recognized.Phones.end(), partial.begin(), partial.end());
+        partial.clear();
+    }
+    recognized.Phones.insert(recognized.Phones.end(), partial.begin(), partial.end());
+    return recognized;
+}
+
+// Cut utterance must be committed up to its last decoded frame, phones lagging in the lattice are not lost between utterances
+void TestSoftCommitKeepsPhones(const std::filesystem::path& model, const std::vector<float>& audio) {
+    const auto whole = Recognize(MakeModelCopy(model, 0), audio);
+    const auto cut = Recognize(MakeModelCopy(model, CutUtteranceFrames), audio);
+
+    Check(whole.SoftCommits == 0, "no cuts without max utterance frames");
+    Check(cut.SoftCommits > 0, "audio is long enough to be cut");
+    std::cerr << "Phones without cuts: " << whole.Phones.size() << ", with " << cut.SoftCommits << " cuts: " << cut.Phones.size() << std::endl;
+    Check(cut.Phones.size() + cut.SoftCommits * PhonesPerCutTolerance >= whole.Phones.size(), "phones of cut utterances are kept");
+}
+
+} // namespace
+
+// Takes the model folder and raw 16 kHz float samples of speech without long pauses
+int main() {
+    const char* model = std::getenv("TRUEPROMPTER_TEST_KALDI_MODEL");
+    const char* audioPath = std::getenv("TRUEPROMPTER_TEST_AUDIO");
+    if (!model || !audioPath) {
+        std::cerr << "TRUEPROMPTER_TEST_KALDI_MODEL and TRUEPROMPTER_TEST_AUDIO are not set, skipped" << std::endl;
+        return SkipReturnCode;
+    }
+
+    std::ifstream f(audioPath, std::ios::binary);
+    Check((bool)f, "audio file opens");
+    std::vector<char> b((std::istreambuf_iterator<char>(f)), (std::istreambuf_iterator<char>()));
+    std::vector<float> audio(b.size() / sizeof(float));
+    std::memcpy(audio.data(), b.data(), audio.size() * sizeof(float));
+
+    TestSoftCommitKeepsPhones(model, audio);
+}
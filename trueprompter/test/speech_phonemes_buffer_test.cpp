@@ -0,0 +1,69 @@
+#include "check.hpp"
+
+#include <trueprompter/recognition/matcher.hpp>
+
+#include <vector>
+
+
+using NTruePrompter::NTest::Check;
+using NTruePrompter::NRecognition::TPhoneme;
+using NTruePrompter::NRecognition::TSpeechPhonemesBuffer;
+
+namespace {
+
+std::vector<TPhoneme> MakePhonemes(size_t size, TPhoneme first) {
+    std::vector<TPhoneme> phonemes(size);
+    for (size_t i = 0; i < size; ++i) {
+        phonemes[i] = first + i;
+    }
+    return phonemes;
+}
+
+// Partial result longer than capacity, then taken back by an endpoint or a vad skip
+void TestOverflowingPartialTakenBack() {
+    TSpeechPhonemesBuffer buffer(16);
+
+    buffer.Update(MakePhonemes(40, 0));
+    Check(buffer.GetUnmatched().size() == 16, "overflowing partial keeps capacity phonemes");
+    Check(buffer.GetStats().Dropped == 24, "overflowing partial drops the oldest phonemes");
+
+    buffer.Update({});
+    buffer.Commit();
+    Check(buffer.GetUnmatched().empty(), "empty update takes the partial back");
+
+    const auto next = MakePhonemes(10, 100);
+    buffer.Update(next);
+    const auto unmatched = buffer.GetUnmatched();
+    Check(unmatched.size() == next.size(), "next utterance is not swallowed");
+    for (size_t i = 0; i < next.size(); ++i) {
+        Check(unmatched[i] == next[i], "next utterance phonemes");
+    }
+    Check(buffer.GetStats().Dropped == 24, "nothing else is dropped");
+    Check(buffer.GetStats().HighWaterMark == 16, "high water mark is bounded by capacity");
+}
+
+// Shorter partial after an overflowing one, its phonemes are read from slots written again
+void TestOverflowingPartialShrunk() {
+    TSpeechPhonemesBuffer buffer(16);
+
+    buffer.Update(MakePhonemes(4, 0));
+    buffer.Commit();
+    buffer.Update(MakePhonemes(30, 10));
+    Check(buffer.GetStats().Dropped == 18, "committed and partial phonemes over capacity are dropped");
+
+    buffer.Update(MakePhonemes(20, 50));
+    const auto unmatched = buffer.GetUnmatched();
+    Check(unmatched.size() == 6, "dropped phonemes stay matched");
+    for (size_t i = 0; i < unmatched.size(); ++i) {
+        Check(unmatched[i] == 64 + i, "shrunk partial phonemes");
+    }
+    Check(buffer.GetUnmatchedCommittedSize() == 0, "no committed phonemes are left");
+    Check(buffer.GetStats().HighWaterMark == 16, "high water mark is bounded by capacity");
+}
+
+} // namespace
+
+int main() {
+    TestOverflowingPartialTakenBack();
+    TestOverflowingPartialShrunk();
+}
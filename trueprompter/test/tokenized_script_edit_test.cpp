@@ -0,0 +1,126 @@
+#include "check.hpp"
+
+#include <trueprompter/recognition/kaldi/kaldi.hpp>
+#include <trueprompter/recognition/matcher.hpp>
+#include <trueprompter/recognition/tokenized_script.hpp>
+
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+
+using NTruePrompter::NTest::Check;
+using namespace NTruePrompter::NRecognition;
+
+namespace {
+
+// One phoneme per byte, so multibyte characters get several phonemes with offsets inside one word
+class TBytesPhoneticizer : public IPhoneticizer {
+public:
+    std::vector<TPhoneme> Phoneticize(const std::string& word) const override {
+        std::vector<TPhoneme> phonemes;
+        for (size_t i = 0; i < word.size(); ++i) {
+            phonemes.push_back((unsigned char)word[i] * 7 + i % 3);
+        }
+        return phonemes;
+    }
+
+    std::string GetVersion() const override {
+        return "bytes";
+    }
+};
+
+class TSilentRecognizer : public IRecognizer {
+public:
+    bool Update(const float*, size_t, int32_t, std::vector<TPhoneme>* tokensOut) override {
+        tokensOut->clear();
+        return false;
+    }
+
+    void Reset() override {
+    }
+};
+
+void CheckSameTokens(const TTokenizedScript& edited, const TTokenizedScript& full, const std::string& what) {
+    Check(edited.GetText() == full.GetText(), what + ": text");
+    Check(edited.GetTokenizerId() == full.GetTokenizerId(), what + ": tokenizer id");
+    Check(std::ranges::equal(edited.GetPhonemes(), full.GetPhonemes()), what + ": phonemes");
+    Check(edited.GetOffsets().Size() == full.GetOffsets().Size(), what + ": offsets size");
+    for (size_t i = 0; i < full.GetOffsets().Size(); ++i) {
+        Check(edited.GetOffsets()[i] == full.GetOffsets()[i], what + ": offsets");
+    }
+}
+
+// Edited script must be the one tokenized from scratch, they share a registry key
+void TestRandomEditsMatchRetokenization() {
+    auto tokenizer = NewKaldiTokenizer(std::make_shared<TBytesPhoneticizer>());
+    TWordsMatcher matcher(TTokenizedScript::FromText("", *tokenizer), std::make_shared<TSilentRecognizer>());
+
+    const std::vector<std::string> pieces = {
+        "", " ", "  ", "\n\n", "\t", "abc", "hello", "q w e", " x", "z ", "д", "ёж ", "привет мир", "ш", "日本", " 語 ", "😀",
+    };
+    std::mt19937 rng(3);
+    auto script = TTokenizedScript::FromText("Съешь же ещё этих мягких французских булок, да выпей чаю.\nThe quick brown fox 🦊 jumps.", *tokenizer);
+    for (size_t i = 0; i < 3000; ++i) {
+        const size_t size = CountTextChars(script->GetText());
+        size_t from;
+        switch (i % 4) {
+            case 0:
+                from = 0;
+                break;
+            case 1:
+                from = size;
+                break;
+            default:
+                from = rng() % (size + 1);
+                break;
+        }
+        const size_t to = from + rng() % std::min<size_t>(size - from + 1, 8);
+        std::string replacement = pieces[rng() % pieces.size()];
+        if (i % 5 != 0) {
+            replacement += pieces[rng() % pieces.size()];
+        }
+
+        const std::string what = "edit " + std::to_string(i);
+        auto edited = script->Edit(from, to, replacement, *tokenizer);
+        Check(edited->GetText() == TTokenizedScript::EditText(script->GetText(), from, to, replacement), what + ": edited text");
+        auto full = TTokenizedScript::FromText(std::string(edited->GetText()), *tokenizer);
+        CheckSameTokens(*edited, *full, what);
+
+        // Cursor moves to the first phoneme at or after the edit start
+        matcher.SetScript(edited, from);
+        const auto& offsets = full->GetOffsets();
+        const size_t index = offsets.LowerBound(0, from);
+        const size_t expected = offsets.Empty() ? 0 : index < offsets.Size() ? offsets[index] : offsets.Back() + 1;
+        Check(matcher.GetCurrentPos() == expected, what + ": matcher position");
+
+        script = edited;
+    }
+
+    // Whole text removed and written again
+    auto emptied = script->Edit(0, CountTextChars(script->GetText()), "", *tokenizer);
+    CheckSameTokens(*emptied, *TTokenizedScript::FromText("", *tokenizer), "whole text removed");
+    auto refilled = emptied->Edit(0, 0, " ёж и 日本 ", *tokenizer);
+    CheckSameTokens(*refilled, *TTokenizedScript::FromText(" ёж и 日本 ", *tokenizer), "empty text filled");
+}
+
+void TestOutOfTextEditThrows() {
+    auto tokenizer = NewKaldiTokenizer(std::make_shared<TBytesPhoneticizer>());
+    auto script = TTokenizedScript::FromText("ёж и уж", *tokenizer);
+    bool thrown = false;
+    try {
+        script->Edit(0, CountTextChars(script->GetText()) + 1, "", *tokenizer);
+    } catch (const std::exception&) {
+        thrown = true;
+    }
+    Check(thrown, "edit past the text end throws");
+}
+
+} // namespace
+
+int main() {
+    TestRandomEditsMatchRetokenization();
+    TestOutOfTextEditThrows();
+}